@@ -31,14 +31,20 @@ if test "$PHP_STAT" != "no"; then
 
   PHP_NEW_EXTENSION(stat,
         zend_stat.c \
+        src/zend_stat_agent.c \
         src/zend_stat_arena.c \
+        src/zend_stat_baseline.c \
         src/zend_stat_buffer.c \
         src/zend_stat_ini.c \
         src/zend_stat_io.c \
+        src/zend_stat_profile.c \
+        src/zend_stat_region.c \
         src/zend_stat_request.c \
+        src/zend_stat_routes.c \
         src/zend_stat_stream.c \
         src/zend_stat_control.c \
         src/zend_stat_sampler.c \
+        src/zend_stat_sketch.c \
         src/zend_stat_sample.c \
         src/zend_stat_strings.c,
         $ext_shared,,-DZEND_ENABLE_STATIC_TSRMLS_CACHE=1,,yes)
@@ -0,0 +1,424 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                 |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_AGENT
+# define ZEND_STAT_AGENT
+
+#include "zend_stat.h"
+#include "zend_stat_agent.h"
+#include "zend_stat_sampler.h"
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define ZEND_STAT_AGENT_FREE    0
+#define ZEND_STAT_AGENT_CLAIMED 1
+#define ZEND_STAT_AGENT_ACTIVE  2
+#define ZEND_STAT_AGENT_BUSY    3
+
+#ifndef ZEND_STAT_AGENT_SPINS
+#   define ZEND_STAT_AGENT_SPINS 65536
+#endif
+
+#ifndef ZEND_STAT_AGENT_WAIT
+#   define ZEND_STAT_AGENT_WAIT 1000
+#endif
+
+/* A slot in the registry describes a process to sample: processes claim a
+    slot on request startup and free it on request shutdown, the agent only
+    samples a slot while it holds it busy */
+typedef struct _zend_stat_agent_slot_t {
+    uint32_t             state;
+    zend_stat_request_t  request;
+    zend_stat_request_summary_t summary;
+    void                *heap;
+    void                *fp;
+} zend_stat_agent_slot_t;
+
+typedef struct _zend_stat_agent_registry_t {
+    zend_long               slots;
+    zend_long               top;
+    zend_stat_agent_slot_t  slot[1];
+} zend_stat_agent_registry_t;
+
+typedef struct _zend_stat_agent_t {
+    zend_stat_agent_registry_t *registry;
+    zend_stat_buffer_t         *buffer;
+    zend_stat_buffer_shard_t  **shards;
+    zend_long                   stripes;
+    pthread_t                   thread;
+    int                         epoll;
+    int                         timer;
+    int                         closed;
+} zend_stat_agent_t;
+
+static zend_stat_agent_t zend_stat_agent;
+
+#define ZAG(v) zend_stat_agent.v
+#define ZAR(v) ZAG(registry)->v
+
+static zend_always_inline size_t zend_stat_agent_size(zend_long slots) {
+    return sizeof(zend_stat_agent_registry_t) +
+                  (sizeof(zend_stat_agent_slot_t) * (slots - 1));
+}
+
+static zend_always_inline zend_bool zend_stat_agent_arm(uint64_t deadline) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(struct itimerspec));
+
+    its.it_value.tv_sec  = deadline / 1000000000L;
+    its.it_value.tv_nsec = deadline % 1000000000L;
+
+    return timerfd_settime(ZAG(timer), TFD_TIMER_ABSTIME, &its, NULL) == SUCCESS;
+}
+
+static zend_always_inline void zend_stat_agent_reclaim(zend_stat_agent_slot_t *slot) {
+    /* A process that died during a request never frees its slot, the
+        agent ends the request and frees the slot for it */
+    zend_stat_request_t request;
+
+    memcpy(&request, &slot->request, sizeof(zend_stat_request_t));
+
+    zend_stat_request_end(&request);
+
+    memset(&slot->request, 0, sizeof(zend_stat_request_t));
+
+    slot->heap = NULL;
+    slot->fp   = NULL;
+
+    __atomic_store_n(&slot->state, ZEND_STAT_AGENT_FREE, __ATOMIC_RELEASE);
+}
+
+static zend_always_inline void zend_stat_agent_sample(zend_stat_sampler_t **samplers, zend_stat_sampler_clock_t *clock) {
+    zend_long it = 0,
+              end = __atomic_load_n(&ZAR(top), __ATOMIC_ACQUIRE);
+
+    while (it < end) {
+        zend_stat_agent_slot_t *slot = &ZAR(slot)[it];
+        uint32_t active = ZEND_STAT_AGENT_ACTIVE;
+
+        if (__atomic_compare_exchange_n(
+                &slot->state,
+                &active, ZEND_STAT_AGENT_BUSY,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+
+            if (UNEXPECTED(NULL == samplers[it])) {
+                /* the processes in the registry are striped over the shards
+                    of the agent, those in a slot always go to the same one */
+                samplers[it] = zend_stat_sampler_create(ZAG(buffer),
+                    ZAG(stripes) ? ZAG(shards)[it % ZAG(stripes)] : NULL);
+            }
+
+            if (EXPECTED(NULL != samplers[it]) &&
+                UNEXPECTED(zend_stat_sampler_sample(
+                    samplers[it],
+                    &slot->request, &slot->summary, slot->heap, slot->fp, clock) != SUCCESS) &&
+                (kill(slot->request.pid, 0) == FAILURE) && (errno == ESRCH)) {
+                zend_stat_agent_reclaim(slot);
+
+                it++;
+                continue;
+            }
+
+            __atomic_store_n(&slot->state, ZEND_STAT_AGENT_ACTIVE, __ATOMIC_RELEASE);
+        }
+
+        it++;
+    }
+}
+
+static void* zend_stat_agent_thread(void *arg) {
+    zend_stat_sampler_t **samplers =
+        (zend_stat_sampler_t**)
+            calloc(ZAR(slots), sizeof(zend_stat_sampler_t*));
+    zend_stat_sampler_clock_t clock;
+    zend_long it;
+
+    if (UNEXPECTED(NULL == samplers)) {
+        pthread_exit(NULL);
+    }
+
+    if (UNEXPECTED(!zend_stat_sampler_clock_start(&clock, (uint64_t) zend_stat_pid() << 32))) {
+        free(samplers);
+        pthread_exit(NULL);
+    }
+
+    do {
+        struct epoll_event events[2];
+        int ready, event, ticked = 0;
+
+        /* The timer is armed for one deadline at a time, so that changes to
+            the interval, jitter, and scale take effect on the next tick */
+        if (!zend_stat_agent_arm(zend_stat_sampler_clock_next(&clock))) {
+            break;
+        }
+
+_zend_stat_agent_thread_wait:
+        ready = epoll_wait(ZAG(epoll), events, 2, -1);
+
+        if (UNEXPECTED(FAILURE == ready)) {
+            if (EINTR == errno) {
+                goto _zend_stat_agent_thread_wait;
+            }
+
+            break;
+        }
+
+        for (event = 0; event < ready; event++) {
+            if (events[event].data.fd == ZAG(closed)) {
+                goto _zend_stat_agent_thread_leave;
+            }
+
+            if (events[event].data.fd == ZAG(timer)) {
+                uint64_t expired;
+
+                if (read(ZAG(timer), &expired, sizeof(uint64_t)) != sizeof(uint64_t)) {
+                    continue;
+                }
+
+                ticked = 1;
+
+                zend_stat_sampler_clock_tick(&clock);
+                zend_stat_agent_sample(samplers, &clock);
+            }
+        }
+
+        if (UNEXPECTED(!ticked)) {
+            goto _zend_stat_agent_thread_wait;
+        }
+    } while (1);
+
+_zend_stat_agent_thread_leave:
+    for (it = 0; it < ZAR(slots); it++) {
+        if (samplers[it]) {
+            zend_stat_sampler_destroy(samplers[it]);
+        }
+    }
+
+    free(samplers);
+
+    pthread_exit(NULL);
+}
+
+zend_bool zend_stat_agent_startup(zend_long slots, zend_stat_buffer_t *buffer) {
+    struct epoll_event event;
+
+    memset(&zend_stat_agent, 0, sizeof(zend_stat_agent_t));
+
+    ZAG(registry) = zend_stat_map(zend_stat_agent_size(slots));
+
+    if (!ZAG(registry)) {
+        zend_error(E_WARNING,
+            "[STAT] Failed to allocate shared memory for agent");
+        return 0;
+    }
+
+    ZAR(slots) = slots;
+    ZAR(top)   = 0;
+
+    ZAG(buffer) = buffer;
+    ZAG(shards) =
+        (zend_stat_buffer_shard_t**)
+            calloc(MAX(zend_stat_buffer_shards(buffer), 1), sizeof(zend_stat_buffer_shard_t*));
+
+    if (!ZAG(shards)) {
+        zend_error(E_WARNING,
+            "[STAT] Failed to allocate shards for agent");
+        zend_stat_unmap(ZAG(registry), zend_stat_agent_size(slots));
+        memset(&zend_stat_agent, 0, sizeof(zend_stat_agent_t));
+        return 0;
+    }
+
+    /* The agent is the only producer of samples, it claims every shard it
+        can, anything it could not claim it writes to the shared shard */
+    while ((ZAG(stripes) < (zend_long) zend_stat_buffer_shards(buffer)) &&
+           (ZAG(shards)[ZAG(stripes)] = zend_stat_buffer_claim(buffer))) {
+        ZAG(stripes)++;
+    }
+
+    ZAG(timer)  = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ZAG(closed) = eventfd(0, EFD_CLOEXEC);
+    ZAG(epoll)  = epoll_create1(EPOLL_CLOEXEC);
+
+    if (ZAG(timer) == FAILURE || ZAG(closed) == FAILURE || ZAG(epoll) == FAILURE) {
+        zend_error(E_WARNING,
+            "[STAT] %s - cannot create agent",
+            strerror(errno));
+        goto _zend_stat_agent_startup_failed;
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+
+    event.events  = EPOLLIN;
+    event.data.fd = ZAG(timer);
+
+    if (epoll_ctl(ZAG(epoll), EPOLL_CTL_ADD, ZAG(timer), &event) != SUCCESS) {
+        goto _zend_stat_agent_startup_failed;
+    }
+
+    event.data.fd = ZAG(closed);
+
+    if (epoll_ctl(ZAG(epoll), EPOLL_CTL_ADD, ZAG(closed), &event) != SUCCESS) {
+        goto _zend_stat_agent_startup_failed;
+    }
+
+    if (pthread_create(&ZAG(thread),
+            NULL,
+            zend_stat_agent_thread, NULL) != SUCCESS) {
+        zend_error(E_WARNING,
+            "[STAT] %s - cannot create thread for agent",
+            strerror(errno));
+        goto _zend_stat_agent_startup_failed;
+    }
+
+    return 1;
+
+_zend_stat_agent_startup_failed:
+    if (ZAG(timer) > 0) {
+        close(ZAG(timer));
+    }
+
+    if (ZAG(closed) > 0) {
+        close(ZAG(closed));
+    }
+
+    if (ZAG(epoll) > 0) {
+        close(ZAG(epoll));
+    }
+
+    while (ZAG(stripes) > 0) {
+        zend_stat_buffer_release(ZAG(buffer), ZAG(shards)[--ZAG(stripes)]);
+    }
+
+    free(ZAG(shards));
+
+    zend_stat_unmap(ZAG(registry), zend_stat_agent_size(slots));
+
+    memset(&zend_stat_agent, 0, sizeof(zend_stat_agent_t));
+
+    return 0;
+}
+
+zend_long zend_stat_agent_register(zend_stat_request_t *request, void *heap, void *fp) {
+    zend_long it = 0;
+
+    if (UNEXPECTED(NULL == ZAG(registry))) {
+        return FAILURE;
+    }
+
+    while (it < ZAR(slots)) {
+        zend_stat_agent_slot_t *slot = &ZAR(slot)[it];
+        uint32_t free = ZEND_STAT_AGENT_FREE;
+
+        if (__atomic_compare_exchange_n(
+                &slot->state,
+                &free, ZEND_STAT_AGENT_CLAIMED,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            zend_long top = __atomic_load_n(&ZAR(top), __ATOMIC_ACQUIRE);
+
+            /* the request table owns the request, the agent only needs
+                to know which process and request to sample */
+            memcpy(&slot->request, request, sizeof(zend_stat_request_t));
+            memset(&slot->summary, 0, sizeof(zend_stat_request_summary_t));
+
+            slot->heap = heap;
+            slot->fp   = fp;
+
+            while ((top <= it) &&
+                   !__atomic_compare_exchange_n(
+                        &ZAR(top), &top, it + 1,
+                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+            __atomic_store_n(&slot->state, ZEND_STAT_AGENT_ACTIVE, __ATOMIC_RELEASE);
+
+            return it;
+        }
+
+        it++;
+    }
+
+    return FAILURE;
+}
+
+zend_bool zend_stat_agent_unregister(zend_long it, zend_stat_request_summary_t *summary) {
+    zend_stat_agent_slot_t *slot = &ZAR(slot)[it];
+    uint32_t active, spins = 0, waited = 0;
+
+    /* wait for the agent to finish with the slot, it only ever holds the
+        slot for a sample, an agent that holds it for longer is gone */
+    do {
+        active = ZEND_STAT_AGENT_ACTIVE;
+
+        if (__atomic_compare_exchange_n(
+                &slot->state,
+                &active, ZEND_STAT_AGENT_CLAIMED,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        if (UNEXPECTED(++spins >= ZEND_STAT_AGENT_SPINS)) {
+            if (waited++ == ZEND_STAT_AGENT_WAIT) {
+                memset(summary, 0, sizeof(zend_stat_request_summary_t));
+                return 0;
+            }
+
+            usleep(1000);
+        }
+    } while (1);
+
+    /* only the agent counts in the summary, and it is done with the slot */
+    memcpy(summary, &slot->summary, sizeof(zend_stat_request_summary_t));
+    memset(&slot->request, 0, sizeof(zend_stat_request_t));
+
+    slot->heap = NULL;
+    slot->fp   = NULL;
+
+    __atomic_store_n(&slot->state, ZEND_STAT_AGENT_FREE, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+void zend_stat_agent_shutdown(void) {
+    uint64_t closed = 1;
+
+    if (!ZAG(registry)) {
+        return;
+    }
+
+    if (write(ZAG(closed), &closed, sizeof(uint64_t)) == sizeof(uint64_t)) {
+        pthread_join(ZAG(thread), NULL);
+    }
+
+    close(ZAG(timer));
+    close(ZAG(closed));
+    close(ZAG(epoll));
+
+    while (ZAG(stripes) > 0) {
+        zend_stat_buffer_release(ZAG(buffer), ZAG(shards)[--ZAG(stripes)]);
+    }
+
+    free(ZAG(shards));
+
+    zend_stat_unmap(ZAG(registry), zend_stat_agent_size(ZAR(slots)));
+
+    memset(&zend_stat_agent, 0, sizeof(zend_stat_agent_t));
+}
+#endif	/* ZEND_STAT_AGENT */
@@ -0,0 +1,37 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                 |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_AGENT_H
+# define ZEND_STAT_AGENT_H
+
+#include "zend_stat_buffer.h"
+#include "zend_stat_request.h"
+
+#ifndef ZEND_STAT_AGENT_SLOTS
+#   define ZEND_STAT_AGENT_SLOTS 1024
+#endif
+
+#ifndef ZEND_STAT_AGENT_SHARDS
+#   define ZEND_STAT_AGENT_SHARDS 8
+#endif
+
+zend_bool zend_stat_agent_startup(zend_long slots, zend_stat_buffer_t *buffer);
+zend_long zend_stat_agent_register(zend_stat_request_t *request, void *heap, void *fp);
+zend_bool zend_stat_agent_unregister(zend_long slot, zend_stat_request_summary_t *summary);
+void      zend_stat_agent_shutdown(void);
+#endif	/* ZEND_STAT_AGENT_H */
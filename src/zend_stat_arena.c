@@ -21,6 +21,7 @@
 
 #include "zend_stat.h"
 #include "zend_stat_arena.h"
+#include "zend_stat_region.h"
 
 #ifndef ZEND_STAT_ARENA_DEBUG
 # define ZEND_STAT_ARENA_DEBUG 0
@@ -119,14 +120,14 @@ zend_stat_arena_t* zend_stat_arena_create(zend_long size) {
         zend_stat_arena_aligned(ZEND_STAT_ARENA_SIZE + size);
     zend_stat_arena_t *arena =
         (zend_stat_arena_t*)
-            zend_stat_map(aligned);
+            zend_stat_region_map(ZEND_STAT_REGION_ARENA, aligned);
 
     if (!arena) {
         return NULL;
     }
 
     if (!zend_stat_mutex_init(&arena->mutex, 1)) {
-        zend_stat_unmap(arena, aligned);
+        zend_stat_region_unmap(ZEND_STAT_REGION_ARENA, arena, aligned);
         return NULL;
     }
 
@@ -274,6 +275,6 @@ void zend_stat_arena_destroy(zend_stat_arena_t *arena) {
 
     zend_stat_mutex_destroy(&arena->mutex);
 
-    zend_stat_unmap(arena, arena->size);
+    zend_stat_region_unmap(ZEND_STAT_REGION_ARENA, arena, arena->size);
 }
 #endif
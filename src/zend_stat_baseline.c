@@ -0,0 +1,465 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_BASELINE
+# define ZEND_STAT_BASELINE
+
+#include "zend_stat.h"
+#include "zend_stat_baseline.h"
+
+#include <ctype.h>
+#include <limits.h>
+
+/* A saved baseline is a header followed by a record for every symbol, each
+    record followed by the bytes of its function and scope */
+#define ZEND_STAT_BASELINE_MAGIC   "zendbase"
+#define ZEND_STAT_BASELINE_VERSION 1
+
+/* Bounds on what is read from a file, that may not be what it claims */
+#define ZEND_STAT_BASELINE_SYMBOLS_MAX (1 << 24)
+#define ZEND_STAT_BASELINE_STRING_MAX  (1 << 16)
+
+typedef struct _zend_stat_baseline_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t  pid;
+    double   started;
+    double   elapsed;
+    uint64_t samples;
+    uint64_t used;
+} zend_stat_baseline_header_t;
+
+typedef struct _zend_stat_baseline_record_t {
+    uint64_t samples;
+    uint32_t function;
+    uint32_t scope;
+} zend_stat_baseline_record_t;
+
+typedef struct _zend_stat_baseline_change_t {
+    zend_stat_baseline_symbol_t *symbol;
+    uint64_t                     samples;
+    double                       before;
+    double                       after;
+    double                       change;
+} zend_stat_baseline_change_t;
+
+/* Names become file names, they are kept to a safe set of characters */
+zend_bool zend_stat_baseline_name(const char *name) {
+    size_t it, length = strlen(name);
+
+    if ((0 == length) || (length >= ZEND_STAT_BASELINE_NAME) || ('.' == name[0])) {
+        return 0;
+    }
+
+    for (it = 0; it < length; it++) {
+        if (!isalnum((unsigned char) name[it]) &&
+            (name[it] != '-') && (name[it] != '_') && (name[it] != '.')) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static zend_stat_baseline_t* zend_stat_baseline_create(void) {
+    return calloc(1, sizeof(zend_stat_baseline_t));
+}
+
+static zend_bool zend_stat_baseline_add(zend_stat_baseline_t *baseline, zend_ulong *size, const char *scope, size_t scopes, const char *function, size_t functions, uint64_t samples) {
+    zend_stat_baseline_symbol_t *symbol;
+    char *name;
+
+    if (baseline->used == *size) {
+        zend_ulong grow = MAX(*size * 2, 1024);
+        zend_stat_baseline_symbol_t *symbols =
+            realloc(baseline->symbol, grow * sizeof(zend_stat_baseline_symbol_t));
+
+        if (UNEXPECTED(NULL == symbols)) {
+            return 0;
+        }
+
+        baseline->symbol = symbols;
+        *size = grow;
+    }
+
+    /* the function and the scope share an allocation, the function first */
+    name = malloc(functions + 1 + (scope ? scopes + 1 : 0));
+
+    if (UNEXPECTED(NULL == name)) {
+        return 0;
+    }
+
+    symbol = &baseline->symbol[baseline->used++];
+
+    symbol->function = name;
+    symbol->scope    = NULL;
+    symbol->samples  = samples;
+
+    memcpy(name, function, functions);
+    name[functions] = 0;
+
+    if (scope) {
+        symbol->scope = name + functions + 1;
+
+        memcpy(symbol->scope, scope, scopes);
+        symbol->scope[scopes] = 0;
+    }
+
+    return 1;
+}
+
+zend_stat_baseline_t* zend_stat_baseline_take(zend_stat_profile_t *profile, int64_t pid, double started) {
+    zend_stat_baseline_t *baseline = zend_stat_baseline_create();
+    zend_ulong it, size = 0;
+
+    if (UNEXPECTED(NULL == baseline)) {
+        return NULL;
+    }
+
+    baseline->pid     = pid;
+    baseline->started = started;
+    baseline->elapsed = zend_stat_time();
+    baseline->samples = __atomic_load_n(&profile->samples, __ATOMIC_RELAXED);
+
+    for (it = 0; it < profile->slots; it++) {
+        zend_stat_profile_symbol_t *symbol = &profile->symbol[it];
+        zend_stat_string_t *function =
+            __atomic_load_n(&symbol->function, __ATOMIC_ACQUIRE);
+
+        if (NULL == function) {
+            continue;
+        }
+
+        if (!zend_stat_baseline_add(baseline, &size,
+                symbol->scope ? symbol->scope->value : NULL,
+                symbol->scope ? symbol->scope->length : 0,
+                function->value, function->length,
+                __atomic_load_n(&symbol->samples, __ATOMIC_RELAXED))) {
+            zend_stat_baseline_free(baseline);
+            return NULL;
+        }
+    }
+
+    return baseline;
+}
+
+/* {{{ A baseline is written beside its final name, and renamed over it, so
+    that a reader never finds half a baseline */
+zend_bool zend_stat_baseline_save(zend_stat_baseline_t *baseline, const char *path) {
+    zend_stat_baseline_header_t header;
+    char temporary[PATH_MAX];
+    zend_ulong it;
+    FILE *file;
+    int fd;
+
+    if (snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path) >= sizeof(temporary)) {
+        return 0;
+    }
+
+    fd = mkstemp(temporary);
+
+    if (UNEXPECTED(FAILURE == fd)) {
+        return 0;
+    }
+
+    file = fdopen(fd, "wb");
+
+    if (UNEXPECTED(NULL == file)) {
+        close(fd);
+        goto _zend_stat_baseline_save_failed;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZEND_STAT_BASELINE_MAGIC, sizeof(header.magic));
+
+    header.version = ZEND_STAT_BASELINE_VERSION;
+    header.pid     = baseline->pid;
+    header.started = baseline->started;
+    header.elapsed = baseline->elapsed;
+    header.samples = baseline->samples;
+    header.used    = baseline->used;
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        goto _zend_stat_baseline_save_failed;
+    }
+
+    for (it = 0; it < baseline->used; it++) {
+        zend_stat_baseline_symbol_t *symbol = &baseline->symbol[it];
+        zend_stat_baseline_record_t record;
+
+        record.samples  = symbol->samples;
+        record.function = strlen(symbol->function);
+        record.scope    = symbol->scope ? strlen(symbol->scope) : 0;
+
+        if ((fwrite(&record, sizeof(record), 1, file) != 1) ||
+            (fwrite(symbol->function, 1, record.function, file) != record.function) ||
+            (record.scope &&
+                (fwrite(symbol->scope, 1, record.scope, file) != record.scope))) {
+            fclose(file);
+            goto _zend_stat_baseline_save_failed;
+        }
+    }
+
+    if ((fclose(file) != SUCCESS) ||
+        (rename(temporary, path) != SUCCESS)) {
+        goto _zend_stat_baseline_save_failed;
+    }
+
+    return 1;
+
+_zend_stat_baseline_save_failed:
+    unlink(temporary);
+
+    return 0;
+}
+
+zend_stat_baseline_t* zend_stat_baseline_load(const char *path) {
+    zend_stat_baseline_header_t header;
+    zend_stat_baseline_t *baseline;
+    char *function = NULL, *scope = NULL;
+    zend_ulong it, size = 0;
+    FILE *file = fopen(path, "rb");
+
+    if (UNEXPECTED(NULL == file)) {
+        return NULL;
+    }
+
+    if ((fread(&header, sizeof(header), 1, file) != 1) ||
+        (SUCCESS != memcmp(header.magic, ZEND_STAT_BASELINE_MAGIC, sizeof(header.magic))) ||
+        (header.version != ZEND_STAT_BASELINE_VERSION) ||
+        (header.used > ZEND_STAT_BASELINE_SYMBOLS_MAX)) {
+        fclose(file);
+        return NULL;
+    }
+
+    baseline = zend_stat_baseline_create();
+    function = malloc(ZEND_STAT_BASELINE_STRING_MAX);
+    scope    = malloc(ZEND_STAT_BASELINE_STRING_MAX);
+
+    if (UNEXPECTED((NULL == baseline) || (NULL == function) || (NULL == scope))) {
+        goto _zend_stat_baseline_load_failed;
+    }
+
+    baseline->pid     = header.pid;
+    baseline->started = header.started;
+    baseline->elapsed = header.elapsed;
+    baseline->samples = header.samples;
+
+    for (it = 0; it < header.used; it++) {
+        zend_stat_baseline_record_t record;
+
+        if ((fread(&record, sizeof(record), 1, file) != 1) ||
+            (0 == record.function) ||
+            (record.function >= ZEND_STAT_BASELINE_STRING_MAX) ||
+            (record.scope >= ZEND_STAT_BASELINE_STRING_MAX) ||
+            (fread(function, 1, record.function, file) != record.function) ||
+            (record.scope &&
+                (fread(scope, 1, record.scope, file) != record.scope))) {
+            goto _zend_stat_baseline_load_failed;
+        }
+
+        if (!zend_stat_baseline_add(baseline, &size,
+                record.scope ? scope : NULL, record.scope,
+                function, record.function, record.samples)) {
+            goto _zend_stat_baseline_load_failed;
+        }
+    }
+
+    free(function);
+    free(scope);
+    fclose(file);
+
+    return baseline;
+
+_zend_stat_baseline_load_failed:
+    if (baseline) {
+        zend_stat_baseline_free(baseline);
+    }
+
+    free(function);
+    free(scope);
+    fclose(file);
+
+    return NULL;
+} /* }}} */
+
+/* {{{ Symbols are compared by value, both baselines are sorted by name and
+    merged */
+static int zend_stat_baseline_compare(const void *l, const void *r) {
+    const zend_stat_baseline_symbol_t *left = l, *right = r;
+    int result = strcmp(left->function, right->function);
+
+    if (result != SUCCESS) {
+        return result;
+    }
+
+    return strcmp(
+        left->scope  ? left->scope  : "",
+        right->scope ? right->scope : "");
+}
+
+static int zend_stat_baseline_change_compare(const void *l, const void *r) {
+    const zend_stat_baseline_change_t *left = l, *right = r;
+
+    if (left->change < right->change) {
+        return 1;
+    }
+
+    if (left->change > right->change) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static zend_bool zend_stat_baseline_write_change(zend_stat_io_buffer_t *iob, zend_stat_baseline_change_t *change, zend_bool separate) {
+    if (!zend_stat_io_buffer_appendf(iob,
+            "%s{\"function\": \"%s\"",
+            separate ? ", " : "",
+            change->symbol->function)) {
+        return 0;
+    }
+
+    if (change->symbol->scope) {
+        if (!zend_stat_io_buffer_appendf(iob, ", \"scope\": \"%s\"", change->symbol->scope)) {
+            return 0;
+        }
+    }
+
+    return zend_stat_io_buffer_appendf(iob,
+        ", \"before\": %.10f, \"after\": %.10f, \"change\": %.10f, \"samples\": %" PRIu64 "}",
+        change->before, change->after, change->change, change->samples);
+}
+
+zend_bool zend_stat_baseline_diff(zend_stat_baseline_t *before, zend_stat_baseline_t *after, zend_stat_io_buffer_t *iob) {
+    zend_stat_baseline_change_t *changes;
+    zend_ulong l = 0, r = 0, used = 0, it, end;
+    uint64_t samples;
+    zend_bool cumulative, result = 0;
+
+    /* a later baseline of the same master includes the earlier one, the
+        samples taken since the earlier are compared with it */
+    cumulative =
+        (before->pid == after->pid) &&
+        (before->started == after->started) &&
+        (after->samples >= before->samples);
+
+    samples = cumulative ?
+        after->samples - before->samples : after->samples;
+
+    changes = malloc(
+        MAX(before->used + after->used, 1) * sizeof(zend_stat_baseline_change_t));
+
+    if (UNEXPECTED(NULL == changes)) {
+        return 0;
+    }
+
+    qsort(before->symbol, before->used, sizeof(zend_stat_baseline_symbol_t), zend_stat_baseline_compare);
+    qsort(after->symbol,  after->used,  sizeof(zend_stat_baseline_symbol_t), zend_stat_baseline_compare);
+
+    while ((l < before->used) || (r < after->used)) {
+        zend_stat_baseline_change_t *change = &changes[used];
+        uint64_t was = 0, is = 0;
+        int order;
+
+        if (l == before->used) {
+            order = 1;
+        } else if (r == after->used) {
+            order = -1;
+        } else {
+            order = zend_stat_baseline_compare(&before->symbol[l], &after->symbol[r]);
+        }
+
+        if (order <= 0) {
+            change->symbol = &before->symbol[l];
+            was = before->symbol[l++].samples;
+        }
+
+        if (order >= 0) {
+            change->symbol = &after->symbol[r];
+            is = after->symbol[r++].samples;
+        }
+
+        if (cumulative) {
+            is = (is > was) ? is - was : 0;
+        }
+
+        if ((0 == was) && (0 == is)) {
+            continue;
+        }
+
+        /* counts are normalized by the samples of each side, so that
+            captures of different lengths and rates compare */
+        change->samples = is;
+        change->before  = before->samples ? (double) was / before->samples : 0;
+        change->after   = samples ? (double) is / samples : 0;
+        change->change  = change->after - change->before;
+
+        used++;
+    }
+
+    qsort(changes, used, sizeof(zend_stat_baseline_change_t), zend_stat_baseline_change_compare);
+
+    if (!zend_stat_io_buffer_appendf(iob,
+            "{\"type\": \"diff\", \"cumulative\": %s, "
+            "\"before\": {\"elapsed\": %.10f, \"samples\": %" PRIu64 "}, "
+            "\"after\": {\"elapsed\": %.10f, \"samples\": %" PRIu64 "}, \"slower\": [",
+            cumulative ? "true" : "false",
+            before->elapsed, before->samples,
+            after->elapsed, samples)) {
+        goto _zend_stat_baseline_diff_leave;
+    }
+
+    for (it = 0; (it < used) && (it < ZEND_STAT_BASELINE_TOP) && (changes[it].change > 0); it++) {
+        if (!zend_stat_baseline_write_change(iob, &changes[it], it > 0)) {
+            goto _zend_stat_baseline_diff_leave;
+        }
+    }
+
+    if (!zend_stat_io_buffer_append(iob, "], \"faster\": [", sizeof("], \"faster\": [")-1)) {
+        goto _zend_stat_baseline_diff_leave;
+    }
+
+    /* the symbols that improved most are at the end */
+    for (it = used, end = 0; (it > 0) && (end < ZEND_STAT_BASELINE_TOP) && (changes[it - 1].change < 0); it--, end++) {
+        if (!zend_stat_baseline_write_change(iob, &changes[it - 1], end > 0)) {
+            goto _zend_stat_baseline_diff_leave;
+        }
+    }
+
+    result = zend_stat_io_buffer_append(iob, "]}\n", sizeof("]}\n")-1);
+
+_zend_stat_baseline_diff_leave:
+    free(changes);
+
+    return result;
+} /* }}} */
+
+void zend_stat_baseline_free(zend_stat_baseline_t *baseline) {
+    zend_ulong it;
+
+    for (it = 0; it < baseline->used; it++) {
+        free(baseline->symbol[it].function);
+    }
+
+    free(baseline->symbol);
+    free(baseline);
+}
+#endif	/* ZEND_STAT_BASELINE */
@@ -0,0 +1,59 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_BASELINE_H
+# define ZEND_STAT_BASELINE_H
+
+#include "zend_stat_io.h"
+#include "zend_stat_profile.h"
+
+#ifndef ZEND_STAT_BASELINE_TOP
+#   define ZEND_STAT_BASELINE_TOP 64
+#endif
+
+#ifndef ZEND_STAT_BASELINE_NAME
+#   define ZEND_STAT_BASELINE_NAME 64
+#endif
+
+/* A baseline is a copy of the symbol aggregates of the profile, taken by
+    value, so that it can be saved to a file and compared with the profile
+    of a later master */
+typedef struct _zend_stat_baseline_symbol_t {
+    char     *scope;
+    char     *function;
+    uint64_t  samples;
+} zend_stat_baseline_symbol_t;
+
+typedef struct _zend_stat_baseline_t {
+    /* The master the profile was aggregated by, and when it started: two
+        baselines of the same master are cumulative */
+    int64_t                      pid;
+    double                       started;
+    double                       elapsed;
+    uint64_t                     samples;
+    uint64_t                     used;
+    zend_stat_baseline_symbol_t *symbol;
+} zend_stat_baseline_t;
+
+zend_bool             zend_stat_baseline_name(const char *name);
+zend_stat_baseline_t* zend_stat_baseline_take(zend_stat_profile_t *profile, int64_t pid, double started);
+zend_bool             zend_stat_baseline_save(zend_stat_baseline_t *baseline, const char *path);
+zend_stat_baseline_t* zend_stat_baseline_load(const char *path);
+zend_bool             zend_stat_baseline_diff(zend_stat_baseline_t *before, zend_stat_baseline_t *after, zend_stat_io_buffer_t *iob);
+void                  zend_stat_baseline_free(zend_stat_baseline_t *baseline);
+#endif	/* ZEND_STAT_BASELINE_H */
@@ -22,24 +22,122 @@
 #include "zend_stat.h"
 #include "zend_stat_buffer.h"
 #include "zend_stat_io.h"
+#include "zend_stat_region.h"
+
+#include <sched.h>
+#include <signal.h>
+
+/* A shard is a ring with a single producer: the head is only written by the
+    producer that claimed the shard, so that producers in different processes
+    never share a cache line. The first shard has no owner, producers that
+    could not claim a shard of their own share it, one at a time.
+
+   The ring is broadcast: consumers don't retire samples, each reads through
+    a cursor of its own, and a sample stays in the ring until the producer
+    overwrites it.
+
+   Every slot is stamped with the sequence of the sample it holds, the
+    producer stamps a slot busy while it writes it. The producer is the only
+    writer of its shard and overwrites any stamp, a busy stamp it finds was
+    left by a producer that died while writing, and the sample is counted as
+    skipped.
+
+   Consumers never write to a slot: a consumer copies the sample and keeps
+    the copy only if the stamp is the sequence it expected both before and
+    after the copy, so that it can tell that the sample was overwritten while
+    it looked.
+
+   Extensions are written to a ring of bytes beside the slots, the producer
+    moves the head of the extensions before writing them, so that a consumer
+    that copied an extension can tell whether it was overwritten meanwhile */
+struct _zend_stat_buffer_shard_t {
+    zend_stat_sample_t *samples;
+    zend_ulong          size;
+    uint64_t            head;
+    uint64_t            skipped;
+    uint32_t            claimed;
+    pid_t               pid;
+    uint32_t            lock;
+    struct {
+        char           *bytes;
+        zend_ulong      size;
+        uint64_t        head;
+    } extensions;
+} ZEND_STAT_CACHELINE_ALIGNED;
+
+#ifndef ZEND_STAT_BUFFER_EXTENSION
+#   define ZEND_STAT_BUFFER_EXTENSION 64
+#endif
+
+/* A cursor has a position in every shard and counts the samples that were
+    overwritten before it read them. A cursor may be shared by the members of
+    a consumer group: a member takes a shard of the cursor for reading, so
+    that every sample is read by exactly one of them.
+
+   The shared shard has many producers, the members of a group each read it
+    through a cursor of their own, and only take the samples of the requests
+    in their partition */
+struct _zend_stat_buffer_cursor_t {
+    zend_ulong shards;
+    zend_ulong next;
+    uint64_t   missed;
+    struct {
+        uint64_t position;
+        uint32_t reading;
+    } shard[1];
+};
+
+#define ZEND_STAT_BUFFER_PARTITION(shard, partition, partitions) \
+    ((((shard) - 1) % (partitions)) == (partition))
+#define ZEND_STAT_BUFFER_PARTITION_REQUEST(request, partition, partitions) \
+    ((((zend_ulong) (request)) % (partitions)) == (partition))
+
+#define ZEND_STAT_BUFFER_SLOT_BUSY UINT64_MAX
 
 struct _zend_stat_buffer_t {
-    zend_stat_sample_t *samples;
-    zend_stat_sample_t *position;
-    zend_stat_sample_t *it;
-    zend_stat_sample_t *end;
     zend_ulong max;
-    zend_ulong used;
-};
+    zend_ulong size;
+    zend_ulong shards;
+    zend_ulong next;
+    zend_stat_buffer_shard_t *shard;
+    struct {
+        uint64_t   evaluated;
+        uint64_t   missed;
+        uint64_t   lost;
+        zend_ulong backlog;
+        uint32_t   scale;
+    } pressure;
+} ZEND_STAT_CACHELINE_ALIGNED;
+
+#ifndef ZEND_STAT_BUFFER_PRESSURE_PERIOD
+#   define ZEND_STAT_BUFFER_PRESSURE_PERIOD 100000000L
+#endif
+
+#ifndef ZEND_STAT_BUFFER_SCALE_MAX
+#   define ZEND_STAT_BUFFER_SCALE_MAX 10
+#endif
+
+#define ZEND_STAT_BUFFER_SHARED(buffer) (&(buffer)->shard[0])
 
-static size_t zend_always_inline zend_stat_buffer_size(zend_long samples) {
+static size_t zend_always_inline zend_stat_buffer_size(zend_ulong shards, zend_ulong size) {
     return sizeof(zend_stat_buffer_t) +
-                  (samples * sizeof(zend_stat_sample_t));
+                  (shards * sizeof(zend_stat_buffer_shard_t)) +
+                  (shards * size * sizeof(zend_stat_sample_t)) +
+                  (shards * size * ZEND_STAT_BUFFER_EXTENSION);
 }
 
-zend_stat_buffer_t* zend_stat_buffer_startup(zend_long samples) {
-    size_t size = zend_stat_buffer_size(samples);
-    zend_stat_buffer_t *buffer = zend_stat_map(size);
+zend_stat_buffer_t* zend_stat_buffer_startup(zend_long samples, zend_long shards) {
+    zend_stat_buffer_t *buffer;
+    zend_stat_sample_t *sample;
+    char *extension;
+    zend_ulong size, it;
+
+    /* one more for the shared shard */
+    shards = MAX(shards, 0) + 1;
+    size   = MAX(samples / shards, 1);
+
+    buffer = zend_stat_region_map(
+        ZEND_STAT_REGION_BUFFER, zend_stat_buffer_size(shards, size));
 
     if (!buffer) {
         zend_error(E_WARNING,
@@ -47,150 +145,648 @@ zend_stat_buffer_t* zend_stat_buffer_startup(zend_long samples) {
         return NULL;
     }
 
-    memset(buffer, 0, size);
+    zend_stat_commit(buffer, zend_stat_buffer_size(shards, size));
+
+    buffer->shards = shards;
+    buffer->size   = size;
+    buffer->max    = shards * size;
+    buffer->shard  =
+        (zend_stat_buffer_shard_t*) (((char*) buffer) + sizeof(zend_stat_buffer_t));
+
+    sample    = (zend_stat_sample_t*) (buffer->shard + shards);
+    extension = (char*) (sample + (shards * size));
+
+    for (it = 0; it < shards; it++) {
+        zend_stat_buffer_shard_t *shard = &buffer->shard[it];
 
-    buffer->samples =
-        buffer->it =
-        buffer->position =
-            (zend_stat_sample_t*) (((char*) buffer) + sizeof(zend_stat_buffer_t));
-    buffer->max       = samples;
-    buffer->used      = 0;
-    buffer->end       = buffer->position + buffer->max;
+        shard->samples          = sample;
+        shard->size             = size;
+        shard->extensions.bytes = extension;
+        shard->extensions.size  = size * ZEND_STAT_BUFFER_EXTENSION;
 
-    memset(buffer->samples, 0, sizeof(zend_stat_sample_t) * buffer->max);
+        sample    += size;
+        extension += size * ZEND_STAT_BUFFER_EXTENSION;
+    }
 
     return buffer;
 }
 
-zend_bool zend_stat_buffer_empty(zend_stat_buffer_t *buffer) {
-    return 0 == __atomic_load_n(&buffer->used, __ATOMIC_SEQ_CST);
+zend_ulong zend_stat_buffer_shards(zend_stat_buffer_t *buffer) {
+    /* the shards that may be claimed, the shared shard is not */
+    return buffer->shards - 1;
 }
 
-void zend_stat_buffer_insert(zend_stat_buffer_t *buffer, zend_stat_sample_t *input) {
-    zend_stat_sample_t *sample;
-    zend_bool _unused = 0,
-              _used   = 1;
+zend_stat_buffer_shard_t* zend_stat_buffer_claim(zend_stat_buffer_t *buffer) {
+    pid_t pid = zend_stat_pid();
+    zend_ulong it;
 
-    do {
-        zend_bool _unbusy = 0,
-                  _busy   = 1;
+    for (it = 1; it < buffer->shards; it++) {
+        zend_stat_buffer_shard_t *shard = &buffer->shard[it];
+        uint32_t unclaimed = 0;
 
-        sample = __atomic_fetch_add(
-                    &buffer->position, sizeof(zend_stat_sample_t), __ATOMIC_SEQ_CST);
+        if (__atomic_compare_exchange_n(
+                &shard->claimed,
+                &unclaimed, 1,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&shard->pid, pid, __ATOMIC_RELEASE);
 
-        if (UNEXPECTED(sample >= buffer->end)) {
-            __atomic_store_n(
-                &buffer->position,
-                buffer->samples, __ATOMIC_SEQ_CST);
-            continue;
+            return shard;
+        }
+    }
+
+    /* A process that died without releasing its shard leaves it claimed */
+    for (it = 1; it < buffer->shards; it++) {
+        zend_stat_buffer_shard_t *shard = &buffer->shard[it];
+        pid_t owner = __atomic_load_n(&shard->pid, __ATOMIC_ACQUIRE);
+
+        if ((owner > 0) &&
+            (kill(owner, 0) == FAILURE) && (errno == ESRCH) &&
+            __atomic_compare_exchange_n(
+                &shard->pid,
+                &owner, pid,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            zend_stat_sample_t *sample =
+                &shard->samples[__atomic_load_n(&shard->head, __ATOMIC_ACQUIRE) % shard->size];
+
+            /* the owner may have died while writing the slot after the head,
+                consumers must not wait for it to be finished */
+            if (UNEXPECTED(__atomic_load_n(&sample->sequence, __ATOMIC_ACQUIRE) == ZEND_STAT_BUFFER_SLOT_BUSY)) {
+                __atomic_store_n(&sample->sequence, 0, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&shard->skipped, 1, __ATOMIC_RELAXED);
+            }
+
+            return shard;
         }
+    }
+
+    return NULL;
+}
+
+void zend_stat_buffer_release(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard) {
+    if (NULL == shard) {
+        return;
+    }
+
+    __atomic_store_n(&shard->pid, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&shard->claimed, 0, __ATOMIC_RELEASE);
+}
+
+zend_stat_buffer_cursor_t* zend_stat_buffer_cursor_create(zend_stat_buffer_t *buffer) {
+    zend_stat_buffer_cursor_t *cursor =
+        calloc(1,
+            sizeof(zend_stat_buffer_cursor_t) +
+            (sizeof(cursor->shard[0]) * (buffer->shards - 1)));
+    zend_ulong it;
+
+    if (UNEXPECTED(NULL == cursor)) {
+        return NULL;
+    }
+
+    cursor->shards = buffer->shards;
+
+    /* A new cursor starts at the oldest sample still in each shard */
+    for (it = 0; it < buffer->shards; it++) {
+        zend_stat_buffer_shard_t *shard = &buffer->shard[it];
+        uint64_t head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE);
+
+        cursor->shard[it].position = (head > shard->size) ? head - shard->size : 0;
+    }
+
+    return cursor;
+}
+
+zend_stat_buffer_cursor_t* zend_stat_buffer_cursor_shared(zend_stat_buffer_t *buffer, zend_bool oldest) {
+    zend_stat_buffer_cursor_t *cursor =
+        calloc(1, sizeof(zend_stat_buffer_cursor_t));
+    zend_stat_buffer_shard_t *shard = ZEND_STAT_BUFFER_SHARED(buffer);
+    uint64_t head;
+
+    if (UNEXPECTED(NULL == cursor)) {
+        return NULL;
+    }
+
+    head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE);
+
+    cursor->shards = 1;
+    cursor->shard[0].position =
+        oldest ?
+            ((head > shard->size) ? head - shard->size : 0) :
+            head;
+
+    return cursor;
+}
+
+void zend_stat_buffer_cursor_destroy(zend_stat_buffer_cursor_t *cursor) {
+    free(cursor);
+}
+
+static zend_always_inline zend_ulong zend_stat_buffer_shard_used(zend_stat_buffer_shard_t *shard, uint64_t position) {
+    uint64_t head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE);
 
-        if (UNEXPECTED(!__atomic_compare_exchange(
-                &sample->state.busy,
-                &_unbusy, &_busy,
-                0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))) {
+    if (head <= position) {
+        return 0;
+    }
+
+    return MIN(head - position, shard->size);
+}
+
+static zend_always_inline zend_ulong zend_stat_buffer_used(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions) {
+    zend_ulong it, used = 0;
+
+    if (shared) {
+        used += zend_stat_buffer_shard_used(
+                    ZEND_STAT_BUFFER_SHARED(buffer),
+                    __atomic_load_n(&shared->shard[0].position, __ATOMIC_ACQUIRE));
+    }
+
+    for (it = 0; it < buffer->shards; it++) {
+        if (shared &&
+            ((0 == it) || !ZEND_STAT_BUFFER_PARTITION(it, partition, partitions))) {
             continue;
         }
 
-        break;
-    } while(1);
+        used += zend_stat_buffer_shard_used(
+                    &buffer->shard[it],
+                    __atomic_load_n(&cursor->shard[it].position, __ATOMIC_ACQUIRE));
+    }
+
+    return used;
+}
+
+zend_bool zend_stat_buffer_empty(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor) {
+    return zend_stat_buffer_empty_partition(buffer, cursor, NULL, 0, 1);
+}
+
+zend_bool zend_stat_buffer_empty_partition(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions) {
+    return 0 == zend_stat_buffer_used(buffer, cursor, shared, partition, partitions);
+}
+
+void zend_stat_buffer_loss(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_loss_t *loss) {
+    zend_ulong it;
+
+    memset(loss, 0, sizeof(zend_stat_buffer_loss_t));
+
+    for (it = 0; it < buffer->shards; it++) {
+        zend_stat_buffer_shard_t *shard = &buffer->shard[it];
+
+        loss->inserted    += __atomic_load_n(&shard->head, __ATOMIC_RELAXED);
+        loss->skipped     += __atomic_load_n(&shard->skipped, __ATOMIC_RELAXED);
+    }
+
+    if (cursor) {
+        loss->overwritten = __atomic_load_n(&cursor->missed, __ATOMIC_RELAXED);
+    } else {
+        loss->overwritten = __atomic_load_n(&buffer->pressure.missed, __ATOMIC_RELAXED);
+    }
+}
+
+static zend_always_inline void zend_stat_buffer_backlog(zend_stat_buffer_t *buffer, zend_ulong backlog) {
+    zend_ulong current = __atomic_load_n(&buffer->pressure.backlog, __ATOMIC_RELAXED);
+
+    /* The pressure is that of the slowest consumer */
+    while ((backlog > current) &&
+           !__atomic_compare_exchange_n(
+                &buffer->pressure.backlog,
+                &current, backlog,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+#ifndef ZEND_STAT_BUFFER_SPINS
+#   define ZEND_STAT_BUFFER_SPINS 65536
+#endif
+
+/* The lock of the shared shard holds the pid of its holder, as the lock of a
+    request slot does: a holder that keeps it for longer than the spin is
+    checked and, if it died holding the lock, the lock is taken from it */
+static zend_always_inline void zend_stat_buffer_lock(zend_stat_buffer_shard_t *shard) {
+    uint32_t pid = (uint32_t) zend_stat_pid(),
+             holder;
+    uint32_t spins = 0;
+
+    do {
+        holder = 0;
+
+        if (__atomic_compare_exchange_n(
+                &shard->lock,
+                &holder, pid,
+                1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        if (UNEXPECTED(++spins == ZEND_STAT_BUFFER_SPINS)) {
+            spins = 0;
+
+            if ((kill((pid_t) holder, 0) == FAILURE) && (errno == ESRCH) &&
+                __atomic_compare_exchange_n(
+                    &shard->lock,
+                    &holder, pid,
+                    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+
+            sched_yield();
+        }
+    } while (1);
+}
+
+static zend_always_inline void zend_stat_buffer_unlock(zend_stat_buffer_shard_t *shard) {
+    __atomic_store_n(&shard->lock, 0, __ATOMIC_RELEASE);
+}
+
+static zend_always_inline void zend_stat_buffer_extension_write(zend_stat_buffer_shard_t *shard, zend_stat_sample_t *sample, zend_stat_sample_t *input) {
+    uint64_t position = shard->extensions.head;
+    zend_ulong offset = position % shard->extensions.size,
+               length = input->extension.length,
+               split  = MIN(length, shard->extensions.size - offset);
+
+    if (UNEXPECTED(length > shard->extensions.size)) {
+        sample->extension.length = 0;
+        return;
+    }
+
+    __atomic_store_n(&shard->extensions.head, position + length, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&shard->extensions.bytes[offset],
+        ZEND_STAT_SAMPLE_EXTENSION(input), split);
+
+    if (UNEXPECTED(split < length)) {
+        memcpy(shard->extensions.bytes,
+            ZEND_STAT_SAMPLE_EXTENSION(input) + split, length - split);
+    }
+
+    sample->extension.position = (uint32_t) position;
+}
+
+static zend_always_inline void zend_stat_buffer_extension_read(zend_stat_buffer_shard_t *shard, zend_stat_sample_t *sampled) {
+    /* The header keeps the low bits of the position, the extension of a
+        sample still in the ring is never more than the ring behind the head */
+    uint64_t head = __atomic_load_n(&shard->extensions.head, __ATOMIC_ACQUIRE),
+             position = head - (uint32_t) (((uint32_t) head) - sampled->extension.position);
+    zend_ulong offset = position % shard->extensions.size,
+               length = sampled->extension.length,
+               split  = MIN(length, shard->extensions.size - offset);
+
+    if (UNEXPECTED((head - position) > shard->extensions.size)) {
+        sampled->extension.length = 0;
+        return;
+    }
+
+    memcpy(ZEND_STAT_SAMPLE_EXTENSION(sampled),
+        &shard->extensions.bytes[offset], split);
+
+    if (UNEXPECTED(split < length)) {
+        memcpy(ZEND_STAT_SAMPLE_EXTENSION(sampled) + split,
+            shard->extensions.bytes, length - split);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (UNEXPECTED((__atomic_load_n(&shard->extensions.head, __ATOMIC_RELAXED) - position) > shard->extensions.size)) {
+        /* the extension was overwritten by later samples, the sample is
+            still good without it */
+        sampled->extension.length = 0;
+    }
+}
+
+void zend_stat_buffer_insert(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard, zend_stat_sample_t *input) {
+    zend_stat_buffer_shard_t *shared = NULL;
+    zend_stat_sample_t *sample;
+    uint64_t sequence;
 
-    zend_stat_request_release(&sample->request);
+    if (UNEXPECTED(NULL == shard)) {
+        shard = shared = ZEND_STAT_BUFFER_SHARED(buffer);
+
+        zend_stat_buffer_lock(shared);
+    }
+
+    sequence = shard->head + 1;
+    sample   = &shard->samples[(sequence - 1) % shard->size];
+
+    if (UNEXPECTED(__atomic_load_n(&sample->sequence, __ATOMIC_RELAXED) == ZEND_STAT_BUFFER_SLOT_BUSY)) {
+        /* a producer died while writing the slot, its sample was lost */
+        __atomic_fetch_add(&shard->skipped, 1, __ATOMIC_RELAXED);
+    }
+
+    /* nobody else writes the slot, the stamp is overwritten whatever it was */
+    __atomic_store_n(&sample->sequence, ZEND_STAT_BUFFER_SLOT_BUSY, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
     memcpy(
         ZEND_STAT_SAMPLE_DATA(sample),
         ZEND_STAT_SAMPLE_DATA(input),
         ZEND_STAT_SAMPLE_DATA_SIZE);
 
-    if (__atomic_compare_exchange(&sample->state.used,
-            &_unused, &_used, 0,
-            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
-        __atomic_fetch_add(&buffer->used, 1, __ATOMIC_SEQ_CST);
+    if (UNEXPECTED(input->extension.length)) {
+        zend_stat_buffer_extension_write(shard, sample, input);
     }
 
-    __atomic_store_n(&sample->state.busy, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&sample->sequence, sequence, __ATOMIC_RELEASE);
+    __atomic_store_n(&shard->head, sequence, __ATOMIC_RELEASE);
+
+    if (UNEXPECTED(NULL != shared)) {
+        zend_stat_buffer_unlock(shared);
+    }
 }
 
-zend_bool zend_stat_buffer_consume(zend_stat_buffer_t *buffer, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong max) {
-    zend_stat_sample_t *sample;
+uint32_t zend_stat_buffer_scale(zend_stat_buffer_t *buffer) {
+    struct timespec clk;
+    uint64_t now, evaluated;
+    zend_ulong used;
+    uint64_t lost;
+    uint32_t scale = __atomic_load_n(&buffer->pressure.scale, __ATOMIC_ACQUIRE);
+
+    if (UNEXPECTED(clock_gettime(CLOCK_MONOTONIC, &clk) != SUCCESS)) {
+        return scale;
+    }
+
+    now = ((uint64_t) clk.tv_sec * 1000000000L) + clk.tv_nsec;
+    evaluated = __atomic_load_n(&buffer->pressure.evaluated, __ATOMIC_ACQUIRE);
+
+    /* Pressure is evaluated once per period, by whichever sampler gets there
+        first, every other sampler uses the current scale */
+    if (EXPECTED((now - evaluated) < ZEND_STAT_BUFFER_PRESSURE_PERIOD) ||
+        !__atomic_compare_exchange_n(
+            &buffer->pressure.evaluated,
+            &evaluated, now,
+            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return scale;
+    }
+
+    lost = __atomic_load_n(&buffer->pressure.missed, __ATOMIC_RELAXED);
+
+    for (used = 0; used < buffer->shards; used++) {
+        lost += __atomic_load_n(&buffer->shard[used].skipped, __ATOMIC_RELAXED);
+    }
+
+    used = __atomic_exchange_n(&buffer->pressure.backlog, 0, __ATOMIC_RELAXED);
+
+    if ((lost != buffer->pressure.lost) || ((used * 4) >= (buffer->max * 3))) {
+        /* the consumer is not keeping up, halve the rate */
+        if (scale < ZEND_STAT_BUFFER_SCALE_MAX) {
+            scale++;
+        }
+    } else if ((used * 4) <= buffer->max) {
+        /* the consumer has room, double the rate */
+        if (scale > 0) {
+            scale--;
+        }
+    }
+
+    buffer->pressure.lost = lost;
+
+    __atomic_store_n(&buffer->pressure.scale, scale, __ATOMIC_RELEASE);
+
+    return scale;
+}
+
+static zend_always_inline int zend_stat_buffer_consume_shard(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard, zend_stat_buffer_cursor_t *cursor, zend_ulong index, zend_ulong partition, zend_ulong partitions, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong *max) {
+    uint64_t *position = &cursor->shard[index].position;
+    uint32_t reading = 0;
     zend_ulong tried = 0;
+    int result = ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
 
-    if (zend_stat_buffer_empty(buffer)) {
+    if (!__atomic_compare_exchange_n(
+            &cursor->shard[index].reading,
+            &reading, 1,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        /* another member of the group is reading the shard */
         return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
     }
 
-    while (tried++ < max) {
-        zend_stat_sample_t sampled = zend_stat_sample_empty;
-        zend_bool _unbusy = 0,
-                  _busy   = 1,
-                  _unused = 0,
-                  _used = 1;
+    while ((tried++ < shard->size) && (*max > 0)) {
+        zend_stat_sample_extended_t sampled;
+        zend_stat_sample_t *sample;
+        uint64_t head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE),
+                 stamp;
+
+        if (*position >= head) {
+            break;
+        }
+
+        if (UNEXPECTED((head - *position) > shard->size)) {
+            /* the producer has lapped this cursor, skip to the oldest
+                sample that may still be in the ring */
+            __atomic_fetch_add(
+                &cursor->missed,
+                (head - shard->size) - *position, __ATOMIC_RELAXED);
+            __atomic_fetch_add(
+                &buffer->pressure.missed,
+                (head - shard->size) - *position, __ATOMIC_RELAXED);
+
+            __atomic_store_n(position, head - shard->size, __ATOMIC_RELEASE);
+        }
+
+        sample = &shard->samples[*position % shard->size];
+        stamp  = __atomic_load_n(&sample->sequence, __ATOMIC_ACQUIRE);
+
+        if (UNEXPECTED(stamp != (*position + 1))) {
+            if (ZEND_STAT_BUFFER_SLOT_BUSY == stamp) {
+                /* the producer is writing the slot, come back to it later */
+                break;
+            }
+
+            if (stamp > (*position + 1)) {
+                /* the sample was overwritten while we looked */
+                __atomic_fetch_add(
+                    &cursor->missed, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(
+                    &buffer->pressure.missed, 1, __ATOMIC_RELAXED);
+            }
+
+            /* otherwise the producer dropped it, and counted it */
+            __atomic_store_n(position, *position + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        memcpy(&sampled.sample, sample, sizeof(zend_stat_sample_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-        sample = __atomic_fetch_add(
-                   &buffer->it, sizeof(zend_stat_sample_t), __ATOMIC_SEQ_CST);
+        if (UNEXPECTED(__atomic_load_n(&sample->sequence, __ATOMIC_RELAXED) != stamp)) {
+            /* the sample was overwritten while we copied it, the copy is
+                discarded */
+            __atomic_fetch_add(
+                &cursor->missed, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(
+                &buffer->pressure.missed, 1, __ATOMIC_RELAXED);
 
-        if (UNEXPECTED(sample >= buffer->end)) {
-            __atomic_store_n(
-                &buffer->it,
-                buffer->samples, __ATOMIC_SEQ_CST);
+            __atomic_store_n(position, *position + 1, __ATOMIC_RELEASE);
             continue;
         }
 
-        if (UNEXPECTED(!__atomic_compare_exchange(
-                &sample->state.busy,
-                &_unbusy, &_busy,
-                0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))) {
+        if (UNEXPECTED(partitions > 1) &&
+            !ZEND_STAT_BUFFER_PARTITION_REQUEST(sampled.sample.request.id, partition, partitions)) {
+            /* the sample belongs to another member of the group */
+            __atomic_store_n(position, *position + 1, __ATOMIC_RELEASE);
             continue;
         }
 
-        if (EXPECTED(__atomic_compare_exchange(
-                &sample->state.used,
-                &_used, &_unused,
-                0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))) {
+        if (UNEXPECTED(sampled.sample.extension.length)) {
+            zend_stat_buffer_extension_read(shard, &sampled.sample);
+        }
+
+        __atomic_store_n(position, *position + 1, __ATOMIC_RELEASE);
+        (*max)--;
 
-            __atomic_sub_fetch(&buffer->used, 1, __ATOMIC_SEQ_CST);
+        if (UNEXPECTED(ZEND_STAT_SAMPLE_UNUSED == sampled.sample.type)) {
+            continue;
+        }
 
-            memcpy(&sampled, sample, sizeof(zend_stat_sample_t));
+        if (zend_stat_buffer_consumer(&sampled.sample, arg) == ZEND_STAT_BUFFER_CONSUMER_STOP) {
+            result = ZEND_STAT_BUFFER_CONSUMER_STOP;
+            break;
         }
+    }
 
-        __atomic_store_n(&sample->state.busy, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cursor->shard[index].reading, 0, __ATOMIC_RELEASE);
 
-        if (UNEXPECTED(ZEND_STAT_SAMPLE_UNUSED == sampled.type)) {
+    return result;
+}
+
+zend_bool zend_stat_buffer_consume(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong max) {
+    return zend_stat_buffer_consume_partition(buffer, cursor, NULL, 0, 1, zend_stat_buffer_consumer, arg, max);
+}
+
+zend_bool zend_stat_buffer_consume_partition(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong max) {
+    zend_ulong it, start, used = zend_stat_buffer_used(buffer, cursor, shared, partition, partitions);
+
+    if (0 == used) {
+        return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
+    }
+
+    zend_stat_buffer_backlog(buffer, used);
+
+    if (shared &&
+        zend_stat_buffer_consume_shard(
+            buffer,
+            ZEND_STAT_BUFFER_SHARED(buffer),
+            shared,
+            0,
+            partition, partitions,
+            zend_stat_buffer_consumer, arg, &max) == ZEND_STAT_BUFFER_CONSUMER_STOP) {
+        return ZEND_STAT_BUFFER_CONSUMER_STOP;
+    }
+
+    /* Shards are merged in turn, each consumption starts at the next shard
+        so that a busy shard cannot starve the others */
+    start = __atomic_fetch_add(&cursor->next, 1, __ATOMIC_RELAXED);
+
+    for (it = 0; (it < buffer->shards) && (max > 0); it++) {
+        zend_ulong shard = (start + it) % buffer->shards;
+
+        if (shared &&
+            ((0 == shard) || !ZEND_STAT_BUFFER_PARTITION(shard, partition, partitions))) {
             continue;
         }
 
-        if (zend_stat_buffer_consumer(&sampled, arg) == ZEND_STAT_BUFFER_CONSUMER_STOP) {
-            zend_stat_request_release(&sampled.request);
+        if (zend_stat_buffer_consume_shard(
+                buffer,
+                &buffer->shard[shard],
+                cursor,
+                shard,
+                0, 1,
+                zend_stat_buffer_consumer, arg, &max) == ZEND_STAT_BUFFER_CONSUMER_STOP) {
             return ZEND_STAT_BUFFER_CONSUMER_STOP;
         }
-
-        zend_stat_request_release(&sampled.request);
     }
 
     return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
 }
 
+typedef struct _zend_stat_buffer_writer_t {
+    int                         fd;
+    zend_stat_sample_defined_t *defined;
+} zend_stat_buffer_writer_t;
+
 static zend_bool zend_stat_buffer_write(zend_stat_sample_t *sample, void *arg) {
-    return zend_stat_sample_write(sample, *(int*) arg);
+    zend_stat_buffer_writer_t *writer = (zend_stat_buffer_writer_t*) arg;
+
+    return zend_stat_sample_write(sample, writer->fd, writer->defined);
+}
+
+zend_bool zend_stat_buffer_loss_write(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, int fd, zend_stat_buffer_loss_t *last) {
+    zend_stat_io_buffer_t iob;
+    zend_stat_buffer_loss_t loss;
+
+    zend_stat_buffer_loss(buffer, cursor, &loss);
+
+    /* Loss is only reported when there is something new to report */
+    if ((loss.overwritten == last->overwritten) &&
+        (loss.skipped == last->skipped)) {
+        return 1;
+    }
+
+    if (!zend_stat_io_buffer_alloc(&iob, 256)) {
+        return 0;
+    }
+
+    if (!zend_stat_io_buffer_appendf(&iob,
+            "{\"type\": \"loss\", \"elapsed\": %.10f, "
+            "\"inserted\": %" PRIu64 ", "
+            "\"overwritten\": %" PRIu64 ", "
+            "\"skipped\": %" PRIu64 "}\n",
+            zend_stat_time(),
+            loss.inserted,
+            loss.overwritten,
+            loss.skipped)) {
+        zend_stat_io_buffer_free(&iob);
+        return 0;
+    }
+
+    memcpy(last, &loss, sizeof(zend_stat_buffer_loss_t));
+
+    return zend_stat_io_buffer_flush(&iob, fd);
 }
 
-zend_bool zend_stat_buffer_dump(zend_stat_buffer_t *buffer, int fd) {
-    return zend_stat_buffer_consume(buffer, zend_stat_buffer_write, (void*) &fd, buffer->max);
+zend_bool zend_stat_buffer_dump_partition(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions, int fd, zend_stat_sample_defined_t *defined) {
+    zend_stat_buffer_writer_t writer = {fd, defined};
+
+    return zend_stat_buffer_consume_partition(buffer, cursor, shared, partition, partitions, zend_stat_buffer_write, (void*) &writer, buffer->max);
 }
 
-void zend_stat_buffer_shutdown(zend_stat_buffer_t *buffer) {
-#ifdef ZEND_DEBUG
-    zend_stat_sample_t *sample = buffer->samples,
-                       *end    = sample + buffer->max;
+zend_bool zend_stat_buffer_dump(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, int fd, zend_stat_sample_defined_t *defined) {
+    zend_stat_buffer_writer_t writer = {fd, defined};
+    zend_bool result;
 
-    while (sample < end) {
-        if (sample->type != ZEND_STAT_SAMPLE_UNUSED) {
-            zend_stat_request_release(&sample->request);
-        }
-        sample++;
+    if (EXPECTED(NULL != cursor)) {
+        return zend_stat_buffer_consume(buffer, cursor, zend_stat_buffer_write, (void*) &writer, buffer->max);
     }
-#endif
-    zend_stat_unmap(buffer, zend_stat_buffer_size(buffer->max));
+
+    /* A single dump reads every sample still in the buffer, and defines
+        stacks and requests for itself */
+    cursor = zend_stat_buffer_cursor_create(buffer);
+
+    if (UNEXPECTED(NULL == cursor)) {
+        return 0;
+    }
+
+    writer.defined = zend_stat_sample_defined_create();
+
+    if (UNEXPECTED(NULL == writer.defined)) {
+        zend_stat_buffer_cursor_destroy(cursor);
+        return 0;
+    }
+
+    result = zend_stat_buffer_consume(buffer, cursor, zend_stat_buffer_write, (void*) &writer, buffer->max);
+
+    zend_stat_sample_defined_destroy(writer.defined);
+
+    if (result) {
+        zend_stat_buffer_loss_t last = {0, 0, 0};
+
+        result = zend_stat_buffer_loss_write(buffer, NULL, fd, &last);
+    }
+
+    zend_stat_buffer_cursor_destroy(cursor);
+
+    return result;
+}
+
+void zend_stat_buffer_shutdown(zend_stat_buffer_t *buffer) {
+    zend_stat_region_unmap(
+        ZEND_STAT_REGION_BUFFER,
+        buffer, zend_stat_buffer_size(buffer->shards, buffer->size));
 }
 
 #endif	/* ZEND_STAT_BUFFER */
@@ -22,8 +22,14 @@
 extern ZEND_FUNCTION(zend_stat_buffer_consume);
 
 typedef struct _zend_stat_buffer_t zend_stat_buffer_t;
+typedef struct _zend_stat_buffer_shard_t zend_stat_buffer_shard_t;
+typedef struct _zend_stat_buffer_cursor_t zend_stat_buffer_cursor_t;
 
-zend_stat_buffer_t* zend_stat_buffer_startup(zend_long samples);
+#ifndef ZEND_STAT_BUFFER_SHARDS
+#   define ZEND_STAT_BUFFER_SHARDS 64
+#endif
+
+zend_stat_buffer_t* zend_stat_buffer_startup(zend_long samples, zend_long shards);
 void zend_stat_buffer_shutdown(zend_stat_buffer_t *);
 
 void zend_stat_buffer_activate(zend_stat_buffer_t *buffer, pid_t pid);
@@ -36,10 +42,28 @@ void zend_stat_buffer_deactivate(zend_stat_buffer_t *buffer, pid_t pid);
 
 typedef zend_bool (*zend_stat_buffer_consumer_t)(zend_stat_sample_t *, void *);
 
+typedef struct _zend_stat_buffer_loss_t {
+    uint64_t inserted;
+    uint64_t overwritten;
+    uint64_t skipped;
+} zend_stat_buffer_loss_t;
+
 double     zend_stat_buffer_started(zend_stat_buffer_t *buffer);
-void       zend_stat_buffer_insert(zend_stat_buffer_t *buffer, zend_stat_sample_t *sample);
-zend_bool  zend_stat_buffer_empty(zend_stat_buffer_t *buffer);
-zend_bool  zend_stat_buffer_dump(zend_stat_buffer_t *buffer, int fd);
-zend_bool  zend_stat_buffer_consume(zend_stat_buffer_t *buffer, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong max);
+zend_ulong zend_stat_buffer_shards(zend_stat_buffer_t *buffer);
+zend_stat_buffer_shard_t* zend_stat_buffer_claim(zend_stat_buffer_t *buffer);
+void       zend_stat_buffer_release(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard);
+void       zend_stat_buffer_insert(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard, zend_stat_sample_t *sample);
+zend_stat_buffer_cursor_t* zend_stat_buffer_cursor_create(zend_stat_buffer_t *buffer);
+zend_stat_buffer_cursor_t* zend_stat_buffer_cursor_shared(zend_stat_buffer_t *buffer, zend_bool oldest);
+void       zend_stat_buffer_cursor_destroy(zend_stat_buffer_cursor_t *cursor);
+zend_bool  zend_stat_buffer_empty(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor);
+zend_bool  zend_stat_buffer_empty_partition(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions);
+uint32_t   zend_stat_buffer_scale(zend_stat_buffer_t *buffer);
+void       zend_stat_buffer_loss(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_loss_t *loss);
+zend_bool  zend_stat_buffer_loss_write(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, int fd, zend_stat_buffer_loss_t *last);
+zend_bool  zend_stat_buffer_dump(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, int fd, zend_stat_sample_defined_t *defined);
+zend_bool  zend_stat_buffer_dump_partition(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions, int fd, zend_stat_sample_defined_t *defined);
+zend_bool  zend_stat_buffer_consume(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong max);
+zend_bool  zend_stat_buffer_consume_partition(zend_stat_buffer_t *buffer, zend_stat_buffer_cursor_t *cursor, zend_stat_buffer_cursor_t *shared, zend_ulong partition, zend_ulong partitions, zend_stat_buffer_consumer_t zend_stat_buffer_consumer, void *arg, zend_ulong max);
 
 #endif	/* ZEND_STAT_BUFFER_H */
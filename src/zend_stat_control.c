@@ -29,7 +29,9 @@ typedef enum {
     ZEND_STAT_CONTROL_AUTO     = (1<<1),
     ZEND_STAT_CONTROL_SAMPLERS = (1<<2),
     ZEND_STAT_CONTROL_INTERVAL = (1<<3),
-    ZEND_STAT_CONTROL_ARGINFO  = (1<<4)
+    ZEND_STAT_CONTROL_ARGINFO  = (1<<4),
+    ZEND_STAT_CONTROL_DEPTH    = (1<<5),
+    ZEND_STAT_CONTROL_JITTER   = (1<<6)
 } zend_stat_control_type_t;
 
 typedef struct _zend_stat_control_t {
@@ -84,6 +86,18 @@ static void zend_stat_control(zend_stat_io_t *io, int client) {
                 zend_stat_sampler_arginfo_set((zend_bool) param);
             break;
 
+            case ZEND_STAT_CONTROL_DEPTH:
+                if ((param >= 0) && (param <= ZEND_STAT_DEPTH_MAX)) {
+                    zend_stat_sampler_depth_set((zend_long) param);
+                }
+            break;
+
+            case ZEND_STAT_CONTROL_JITTER:
+                if ((param >= 0) && (param <= ZEND_STAT_JITTER_MAX)) {
+                    zend_stat_sampler_jitter_set((zend_long) param);
+                }
+            break;
+
             case ZEND_STAT_CONTROL_FAILED:
                 return;
 
@@ -25,11 +25,24 @@
 zend_bool    zend_stat_ini_auto      = 0;
 zend_long    zend_stat_ini_samplers  = -1;
 zend_long    zend_stat_ini_samples   = -1;
+zend_long    zend_stat_ini_shards    = -1;
 zend_long    zend_stat_ini_interval  = -1;
 zend_bool    zend_stat_ini_arginfo   = 0;
+zend_long    zend_stat_ini_depth     = -1;
+zend_long    zend_stat_ini_jitter    = -1;
+zend_long    zend_stat_ini_adaptive  = -1;
+zend_long    zend_stat_ini_cpu       = ZEND_STAT_CPU_OFF;
+zend_long    zend_stat_ini_proc      = -1;
+zend_bool    zend_stat_ini_persistent = 0;
+zend_bool    zend_stat_ini_agent = 0;
 zend_long    zend_stat_ini_strings   = -1;
+zend_long    zend_stat_ini_hugepages = ZEND_STAT_MEMORY_EAGER;
+zend_bool    zend_stat_ini_lazy      = 0;
 char*        zend_stat_ini_stream    = NULL;
 char*        zend_stat_ini_control   = NULL;
+char*        zend_stat_ini_snapshot  = NULL;
+char*        zend_stat_ini_map       = NULL;
+char*        zend_stat_ini_baselines = NULL;
 int          zend_stat_ini_dump      = -1;
 
 #if PHP_VERSION_ID < 70300
@@ -81,6 +94,24 @@ static ZEND_INI_MH(zend_stat_ini_update_samples)
     return SUCCESS;
 }
 
+static ZEND_INI_MH(zend_stat_ini_update_shards)
+{
+    if (UNEXPECTED(zend_stat_ini_shards != -1)) {
+        return FAILURE;
+    }
+
+    zend_stat_ini_shards =
+        zend_atol(
+            ZSTR_VAL(new_value),
+            ZSTR_LEN(new_value));
+
+    if (UNEXPECTED(zend_stat_ini_shards < 0)) {
+        zend_stat_ini_shards = 0;
+    }
+
+    return SUCCESS;
+}
+
 static ZEND_INI_MH(zend_stat_ini_update_interval)
 {
     if (UNEXPECTED(zend_stat_ini_interval != -1)) {
@@ -113,6 +144,123 @@ static ZEND_INI_MH(zend_stat_ini_update_arginfo)
     return SUCCESS;
 }
 
+static ZEND_INI_MH(zend_stat_ini_update_depth)
+{
+    if (UNEXPECTED(zend_stat_ini_depth != -1)) {
+        return FAILURE;
+    }
+
+    zend_stat_ini_depth =
+        zend_atol(
+            ZSTR_VAL(new_value),
+            ZSTR_LEN(new_value));
+
+    if (zend_stat_ini_depth > ZEND_STAT_DEPTH_MAX) {
+        zend_error(
+            E_WARNING,
+            "[STAT] maximum depth is %d, "
+            "stat.depth set at " ZEND_LONG_FMT,
+            ZEND_STAT_DEPTH_MAX,
+            zend_stat_ini_depth);
+        zend_stat_ini_depth = ZEND_STAT_DEPTH_MAX;
+    }
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_jitter)
+{
+    if (UNEXPECTED(zend_stat_ini_jitter != -1)) {
+        return FAILURE;
+    }
+
+    zend_stat_ini_jitter =
+        zend_atol(
+            ZSTR_VAL(new_value),
+            ZSTR_LEN(new_value));
+
+    if (UNEXPECTED(zend_stat_ini_jitter < 0)) {
+        zend_stat_ini_jitter = 0;
+    }
+
+    if (UNEXPECTED(zend_stat_ini_jitter > ZEND_STAT_JITTER_MAX)) {
+        zend_error(
+            E_WARNING,
+            "[STAT] maximum jitter is %d, "
+            "stat.jitter set at " ZEND_LONG_FMT,
+            ZEND_STAT_JITTER_MAX,
+            zend_stat_ini_jitter);
+        zend_stat_ini_jitter = ZEND_STAT_JITTER_MAX;
+    }
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_adaptive)
+{
+    if (UNEXPECTED(zend_stat_ini_adaptive != -1)) {
+        return FAILURE;
+    }
+
+    zend_stat_ini_adaptive =
+        zend_atol(
+            ZSTR_VAL(new_value),
+            ZSTR_LEN(new_value));
+
+    if (UNEXPECTED(zend_stat_ini_adaptive < 0)) {
+        zend_stat_ini_adaptive = 0;
+    }
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_cpu)
+{
+    if (SUCCESS == strcasecmp("clock", ZSTR_VAL(new_value))) {
+        zend_stat_ini_cpu = ZEND_STAT_CPU_CLOCK;
+    } else {
+        zend_stat_ini_cpu =
+            zend_stat_ini_parse_bool(new_value) ?
+                ZEND_STAT_CPU_TAG : ZEND_STAT_CPU_OFF;
+    }
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_proc)
+{
+    if (UNEXPECTED(zend_stat_ini_proc != -1)) {
+        return FAILURE;
+    }
+
+    zend_stat_ini_proc =
+        zend_atol(
+            ZSTR_VAL(new_value),
+            ZSTR_LEN(new_value));
+
+    if (UNEXPECTED(zend_stat_ini_proc < 0)) {
+        zend_stat_ini_proc = 0;
+    }
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_persistent)
+{
+    zend_stat_ini_persistent =
+        zend_stat_ini_parse_bool(new_value);
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_agent)
+{
+    zend_stat_ini_agent =
+        zend_stat_ini_parse_bool(new_value);
+
+    return SUCCESS;
+}
+
 static ZEND_INI_MH(zend_stat_ini_update_strings)
 {
     if (UNEXPECTED(zend_stat_ini_strings != -1)) {
@@ -127,6 +275,29 @@ static ZEND_INI_MH(zend_stat_ini_update_strings)
     return SUCCESS;
 }
 
+static ZEND_INI_MH(zend_stat_ini_update_hugepages)
+{
+    if (SUCCESS == strcasecmp("explicit", ZSTR_VAL(new_value))) {
+        zend_stat_ini_hugepages = ZEND_STAT_MEMORY_EXPLICIT;
+    } else if (SUCCESS == strcasecmp("transparent", ZSTR_VAL(new_value))) {
+        zend_stat_ini_hugepages = ZEND_STAT_MEMORY_TRANSPARENT;
+    } else {
+        zend_stat_ini_hugepages =
+            zend_stat_ini_parse_bool(new_value) ?
+                ZEND_STAT_MEMORY_TRANSPARENT : ZEND_STAT_MEMORY_EAGER;
+    }
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_lazy)
+{
+    zend_stat_ini_lazy =
+        zend_stat_ini_parse_bool(new_value);
+
+    return SUCCESS;
+}
+
 static ZEND_INI_MH(zend_stat_ini_update_stream)
 {
     int skip = FAILURE;
@@ -165,6 +336,63 @@ static ZEND_INI_MH(zend_stat_ini_update_control)
     return SUCCESS;
 }
 
+static ZEND_INI_MH(zend_stat_ini_update_snapshot)
+{
+    int skip = FAILURE;
+
+    if (UNEXPECTED(NULL != zend_stat_ini_snapshot)) {
+        return FAILURE;
+    }
+
+    if (sscanf(ZSTR_VAL(new_value), "%d", &skip) == 1) {
+        if (SUCCESS == skip) {
+            return SUCCESS;
+        }
+    }
+
+    zend_stat_ini_snapshot = pestrndup(ZSTR_VAL(new_value), ZSTR_LEN(new_value), 1);
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_map)
+{
+    int skip = FAILURE;
+
+    if (UNEXPECTED(NULL != zend_stat_ini_map)) {
+        return FAILURE;
+    }
+
+    if (sscanf(ZSTR_VAL(new_value), "%d", &skip) == 1) {
+        if (SUCCESS == skip) {
+            return SUCCESS;
+        }
+    }
+
+    zend_stat_ini_map = pestrndup(ZSTR_VAL(new_value), ZSTR_LEN(new_value), 1);
+
+    return SUCCESS;
+}
+
+static ZEND_INI_MH(zend_stat_ini_update_baselines)
+{
+    int skip = FAILURE;
+
+    if (UNEXPECTED(NULL != zend_stat_ini_baselines)) {
+        return FAILURE;
+    }
+
+    if (sscanf(ZSTR_VAL(new_value), "%d", &skip) == 1) {
+        if (SUCCESS == skip) {
+            return SUCCESS;
+        }
+    }
+
+    zend_stat_ini_baselines = pestrndup(ZSTR_VAL(new_value), ZSTR_LEN(new_value), 1);
+
+    return SUCCESS;
+}
+
 static ZEND_INI_MH(zend_stat_ini_update_dump)
 {
     if (UNEXPECTED(-1 != zend_stat_ini_dump)) {
@@ -180,11 +408,24 @@ ZEND_INI_BEGIN()
     ZEND_INI_ENTRY("stat.auto",      "On",                ZEND_INI_SYSTEM, zend_stat_ini_update_auto)
     ZEND_INI_ENTRY("stat.samplers",  "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_samplers)
     ZEND_INI_ENTRY("stat.samples",   "10000",             ZEND_INI_SYSTEM, zend_stat_ini_update_samples)
+    ZEND_INI_ENTRY("stat.shards",    "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_shards)
     ZEND_INI_ENTRY("stat.interval",  "100",               ZEND_INI_SYSTEM, zend_stat_ini_update_interval)
     ZEND_INI_ENTRY("stat.arginfo",   "Off",               ZEND_INI_SYSTEM, zend_stat_ini_update_arginfo)
+    ZEND_INI_ENTRY("stat.depth",     "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_depth)
+    ZEND_INI_ENTRY("stat.jitter",    "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_jitter)
+    ZEND_INI_ENTRY("stat.adaptive",  "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_adaptive)
+    ZEND_INI_ENTRY("stat.cpu",       "Off",               ZEND_INI_SYSTEM, zend_stat_ini_update_cpu)
+    ZEND_INI_ENTRY("stat.proc",      "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_proc)
+    ZEND_INI_ENTRY("stat.persistent", "Off",              ZEND_INI_SYSTEM, zend_stat_ini_update_persistent)
+    ZEND_INI_ENTRY("stat.agent",      "Off",              ZEND_INI_SYSTEM, zend_stat_ini_update_agent)
     ZEND_INI_ENTRY("stat.strings",   "32M",               ZEND_INI_SYSTEM, zend_stat_ini_update_strings)
+    ZEND_INI_ENTRY("stat.hugepages", "Off",               ZEND_INI_SYSTEM, zend_stat_ini_update_hugepages)
+    ZEND_INI_ENTRY("stat.lazy",      "Off",               ZEND_INI_SYSTEM, zend_stat_ini_update_lazy)
     ZEND_INI_ENTRY("stat.stream",    "zend.stat.stream",  ZEND_INI_SYSTEM, zend_stat_ini_update_stream)
     ZEND_INI_ENTRY("stat.control",   "zend.stat.control", ZEND_INI_SYSTEM, zend_stat_ini_update_control)
+    ZEND_INI_ENTRY("stat.snapshot",  "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_snapshot)
+    ZEND_INI_ENTRY("stat.map",       "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_map)
+    ZEND_INI_ENTRY("stat.baselines", "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_baselines)
     ZEND_INI_ENTRY("stat.dump",      "0",                 ZEND_INI_SYSTEM, zend_stat_ini_update_dump)
 ZEND_INI_END()
 
@@ -197,5 +438,8 @@ void zend_stat_ini_shutdown() {
 
     pefree(zend_stat_ini_stream, 1);
     pefree(zend_stat_ini_control, 1);
+    pefree(zend_stat_ini_snapshot, 1);
+    pefree(zend_stat_ini_map, 1);
+    pefree(zend_stat_ini_baselines, 1);
 }
 #endif	/* ZEND_STAT_INI */
@@ -23,12 +23,25 @@
 
 extern zend_bool    zend_stat_ini_auto;
 extern zend_long    zend_stat_ini_samples;
+extern zend_long    zend_stat_ini_shards;
 extern zend_long    zend_stat_ini_samplers;
 extern zend_long    zend_stat_ini_interval;
 extern zend_bool    zend_stat_ini_arginfo;
+extern zend_long    zend_stat_ini_depth;
+extern zend_long    zend_stat_ini_jitter;
+extern zend_long    zend_stat_ini_adaptive;
+extern zend_long    zend_stat_ini_cpu;
+extern zend_long    zend_stat_ini_proc;
+extern zend_bool    zend_stat_ini_persistent;
+extern zend_bool    zend_stat_ini_agent;
 extern zend_long    zend_stat_ini_strings;
+extern zend_long    zend_stat_ini_hugepages;
+extern zend_bool    zend_stat_ini_lazy;
 extern char*        zend_stat_ini_stream;
 extern char*        zend_stat_ini_control;
+extern char*        zend_stat_ini_snapshot;
+extern char*        zend_stat_ini_map;
+extern char*        zend_stat_ini_baselines;
 extern int          zend_stat_ini_dump;
 
 void zend_stat_ini_startup();
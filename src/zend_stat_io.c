@@ -284,6 +284,82 @@ void zend_stat_io_buffer_free(zend_stat_io_buffer_t *buffer) {
     memset(buffer, 0, sizeof(zend_stat_io_buffer_t));
 }
 
+typedef struct _zend_stat_io_client_t {
+    zend_stat_io_t *io;
+    int             client;
+    int             slot;
+} zend_stat_io_client_t;
+
+static void* zend_stat_io_client(zend_stat_io_client_t *connection) {
+    zend_stat_io_t *io = connection->io;
+    int client = connection->client,
+        slot   = connection->slot;
+
+    free(connection);
+
+    io->routine(io, client);
+
+    close(client);
+
+    __atomic_store_n(&io->clients[slot], 0, __ATOMIC_RELEASE);
+
+    pthread_exit(NULL);
+}
+
+static zend_bool zend_stat_io_serve(zend_stat_io_t *io, int client) {
+    zend_stat_io_client_t *connection;
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int slot;
+
+    for (slot = 0; slot < ZEND_STAT_IO_CLIENTS; slot++) {
+        int unused = 0;
+
+        if (__atomic_compare_exchange_n(
+                &io->clients[slot],
+                &unused, client + 1,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    if (UNEXPECTED(slot == ZEND_STAT_IO_CLIENTS)) {
+        return 0;
+    }
+
+    connection = malloc(sizeof(zend_stat_io_client_t));
+
+    if (UNEXPECTED(NULL == connection)) {
+        goto _zend_stat_io_serve_failed;
+    }
+
+    connection->io     = io;
+    connection->client = client;
+    connection->slot   = slot;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread,
+            &attributes,
+            (void*)(void*)
+                zend_stat_io_client,
+            (void*) connection) != SUCCESS) {
+        pthread_attr_destroy(&attributes);
+        free(connection);
+        goto _zend_stat_io_serve_failed;
+    }
+
+    pthread_attr_destroy(&attributes);
+
+    return 1;
+
+_zend_stat_io_serve_failed:
+    __atomic_store_n(&io->clients[slot], 0, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
 static void* zend_stat_io_thread(zend_stat_io_t *io) {
     struct sockaddr* address =
         (struct sockaddr*)
@@ -308,9 +384,11 @@ static void* zend_stat_io_thread(zend_stat_io_t *io) {
             break;
         }
 
-        io->routine(io, client);
-
-        close(client);
+        /* Every client is served by a thread of its own, so that one
+            client does not hold up the others */
+        if (UNEXPECTED(!zend_stat_io_serve(io, client))) {
+            close(client);
+        }
     } while (!zend_stat_io_closed(io));
 
     pefree(address, 1);
@@ -378,5 +456,45 @@ void zend_stat_io_shutdown(zend_stat_io_t *io) {
         &io->closed, 1, __ATOMIC_SEQ_CST);
 
     pthread_join(io->thread, NULL);
+
+    {
+        int slot, waited = 0;
+
+        /* Clients stop reading, and have ZEND_STAT_IO_DRAIN milliseconds
+            to finish writing what they have to */
+        for (slot = 0; slot < ZEND_STAT_IO_CLIENTS; slot++) {
+            int client = __atomic_load_n(&io->clients[slot], __ATOMIC_ACQUIRE);
+
+            if (client) {
+                shutdown(client - 1, SHUT_RD);
+            }
+        }
+
+        for (slot = 0; slot < ZEND_STAT_IO_CLIENTS; slot++) {
+            while (__atomic_load_n(&io->clients[slot], __ATOMIC_ACQUIRE) &&
+                   (waited < ZEND_STAT_IO_DRAIN)) {
+                usleep(1000);
+                waited++;
+            }
+        }
+
+        /* A client that is still writing, to a peer that stopped reading for
+            example, has its socket shutdown so that the write fails */
+        for (slot = 0; slot < ZEND_STAT_IO_CLIENTS; slot++) {
+            int client = __atomic_load_n(&io->clients[slot], __ATOMIC_ACQUIRE);
+
+            if (client) {
+                shutdown(client - 1, SHUT_RDWR);
+            }
+        }
+
+        for (slot = 0, waited = 0; slot < ZEND_STAT_IO_CLIENTS; slot++) {
+            while (__atomic_load_n(&io->clients[slot], __ATOMIC_ACQUIRE) &&
+                   (waited < ZEND_STAT_IO_DRAIN)) {
+                usleep(1000);
+                waited++;
+            }
+        }
+    }
 }
 #endif	/* ZEND_STAT_IO */
@@ -40,6 +40,14 @@ typedef struct _zend_stat_io_t zend_stat_io_t;
 
 typedef void (zend_stat_io_routine_t) (zend_stat_io_t *io, int client);
 
+#ifndef ZEND_STAT_IO_CLIENTS
+#   define ZEND_STAT_IO_CLIENTS 64
+#endif
+
+#ifndef ZEND_STAT_IO_DRAIN
+#   define ZEND_STAT_IO_DRAIN 1000
+#endif
+
 struct _zend_stat_io_t {
     zend_stat_io_type_t     type;
     int                     descriptor;
@@ -48,6 +56,8 @@ struct _zend_stat_io_t {
     pthread_t               thread;
     zend_stat_buffer_t      *buffer;
     zend_stat_io_routine_t  *routine;
+    /* descriptors of connected clients, plus one, zero when free */
+    int                     clients[ZEND_STAT_IO_CLIENTS];
 };
 
 typedef struct _zend_stat_io_buffer_t {
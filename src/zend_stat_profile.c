@@ -0,0 +1,866 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_PROFILE
+# define ZEND_STAT_PROFILE
+
+#include "zend_stat.h"
+#include "zend_stat_baseline.h"
+#include "zend_stat_io.h"
+#include "zend_stat_profile.h"
+#include "zend_stat_region.h"
+#include "zend_stat_request.h"
+#include "zend_stat_routes.h"
+#include "zend_stat_sketch.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#ifndef ZEND_STAT_PROFILE_HANDSHAKE
+#   define ZEND_STAT_PROFILE_HANDSHAKE 100
+#endif
+
+/* The memory last seen for a request slot, a sample is charged with the
+    change in memory since the previous sample of the same request, and the
+    uri of the request, looked up once for every generation of the slot */
+typedef struct _zend_stat_profile_request_t {
+    uint32_t            generation;
+    size_t              used;
+    zend_stat_string_t *uri;
+} zend_stat_profile_request_t;
+
+/* The profile is aggregated in the master by a thread of its own, that reads
+    the buffer through a cursor like any other consumer: it is the only writer
+    of the profile, readers in other threads and processes see counts that
+    are at worst a little behind */
+static struct {
+    zend_stat_profile_t       *profile;
+    zend_stat_buffer_t        *buffer;
+    zend_stat_buffer_cursor_t *cursor;
+    pthread_t                  thread;
+    zend_bool                  closed;
+    zend_stat_profile_request_t *requests;
+    zend_ulong                 slots;
+    /* A ring of windows for every span */
+    zend_stat_profile_window_t *windows;
+    /* The heaviest symbols, files, and uris in fixed memory */
+    struct {
+        zend_stat_sketch_t *symbols;
+        zend_stat_sketch_t *files;
+        zend_stat_sketch_t *uris;
+    } heavy;
+    /* Where baselines are saved, and what identifies this master in them */
+    char                      *baselines;
+    int64_t                    pid;
+    double                     started;
+} zend_stat_profile = {NULL};
+
+static const uint32_t zend_stat_profile_spans[ZEND_STAT_PROFILE_SPANS_COUNT] = ZEND_STAT_PROFILE_SPANS;
+
+static zend_always_inline size_t zend_stat_profile_size(zend_ulong slots) {
+    return sizeof(zend_stat_profile_t) +
+                ((slots - 1) * sizeof(zend_stat_profile_symbol_t));
+}
+
+static zend_always_inline zend_ulong zend_stat_profile_hash(zend_stat_string_t *scope, zend_stat_string_t *function) {
+    zend_ulong hash = function->hash;
+
+    if (scope) {
+        hash ^= scope->hash + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+
+    return hash;
+}
+
+/* Interned strings are never moved or freed, so the pointers are the key */
+static zend_stat_profile_symbol_t* zend_stat_profile_symbol(zend_stat_profile_t *profile, zend_stat_string_t *scope, zend_stat_string_t *function) {
+    zend_ulong hash = zend_stat_profile_hash(scope, function),
+               it;
+
+    for (it = 0; it < ZEND_STAT_PROFILE_PROBES; it++) {
+        zend_stat_profile_symbol_t *symbol =
+            &profile->symbol[(hash + it) % profile->slots];
+        zend_stat_string_t *key =
+            __atomic_load_n(&symbol->function, __ATOMIC_ACQUIRE);
+
+        if (NULL == key) {
+            /* a slot is published by its function, the scope is set first */
+            symbol->scope = scope;
+
+            __atomic_store_n(&symbol->function, function, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&profile->used, 1, __ATOMIC_RELAXED);
+
+            return symbol;
+        }
+
+        if ((key == function) && (symbol->scope == scope)) {
+            return symbol;
+        }
+    }
+
+    return NULL;
+}
+
+static zend_always_inline zend_stat_profile_request_t* zend_stat_profile_request(zend_stat_sample_t *sample, int64_t *memory) {
+    zend_stat_profile_request_t *request;
+
+    *memory = 0;
+
+    if ((0 == sample->request.generation) ||
+        (sample->request.id >= zend_stat_profile.slots)) {
+        return NULL;
+    }
+
+    request = &zend_stat_profile.requests[sample->request.id];
+
+    if (EXPECTED(request->generation == sample->request.generation)) {
+        *memory = (int64_t) sample->memory.used - (int64_t) request->used;
+    } else {
+        zend_stat_request_t found;
+
+        if (request->uri) {
+            zend_stat_string_release(request->uri);
+
+            request->uri = NULL;
+        }
+
+        if (zend_stat_request_find(
+                sample->request.id,
+                sample->request.generation, &found)) {
+            if (found.uri) {
+                request->uri = zend_stat_string_copy(found.uri);
+            }
+
+            zend_stat_request_release(&found);
+        }
+
+        request->generation = sample->request.generation;
+    }
+
+    request->used = sample->memory.used;
+
+    return request;
+}
+
+/* {{{ The window of a span that a sample falls in is found by the elapsed
+    time of the sample, a window is reset when it is reused for a later
+    index, and a sample older than every window in the ring is ignored */
+static zend_stat_profile_window_t* zend_stat_profile_window(uint32_t span, double elapsed) {
+    int64_t index = (int64_t) (elapsed / zend_stat_profile_spans[span]);
+    zend_stat_profile_window_t *window =
+        &zend_stat_profile.windows[
+            (span * ZEND_STAT_PROFILE_WINDOWS) + (index % ZEND_STAT_PROFILE_WINDOWS)];
+
+    if (EXPECTED(window->index == index)) {
+        return window;
+    }
+
+    if (UNEXPECTED(window->index > index)) {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&window->sequence, 1, __ATOMIC_ACQ_REL);
+
+    memset(
+        ((char*) window) + XtOffsetOf(zend_stat_profile_window_t, samples), 0,
+        sizeof(zend_stat_profile_window_t) - XtOffsetOf(zend_stat_profile_window_t, samples));
+
+    __atomic_store_n(&window->index, index, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&window->sequence, 1, __ATOMIC_RELEASE);
+
+    return window;
+}
+
+static void zend_stat_profile_window_add(zend_stat_profile_window_t *window, zend_stat_sample_t *sample) {
+    zend_ulong hash, it;
+
+    __atomic_add_fetch(&window->samples, sample->weight, __ATOMIC_RELAXED);
+
+    if ((sample->type == ZEND_STAT_SAMPLE_USER) &&
+        (sample->location.opline.opcode > 0) &&
+        (sample->location.opline.opcode <= ZEND_VM_LAST_OPCODE)) {
+        __atomic_add_fetch(
+            &window->opcodes[sample->location.opline.opcode],
+            sample->weight, __ATOMIC_RELAXED);
+    }
+
+    if ((sample->type == ZEND_STAT_SAMPLE_MEMORY) ||
+        (NULL == sample->symbol.function)) {
+        return;
+    }
+
+    hash = zend_stat_profile_hash(sample->symbol.scope, sample->symbol.function);
+
+    for (it = 0; it < ZEND_STAT_PROFILE_WINDOW_SYMBOLS; it++) {
+        zend_stat_profile_window_symbol_t *symbol =
+            &window->symbol[(hash + it) % ZEND_STAT_PROFILE_WINDOW_SYMBOLS];
+
+        if (NULL == symbol->function) {
+            symbol->scope = sample->symbol.scope;
+
+            __atomic_store_n(&symbol->function, sample->symbol.function, __ATOMIC_RELEASE);
+        } else if ((symbol->function != sample->symbol.function) ||
+                   (symbol->scope != sample->symbol.scope)) {
+            continue;
+        }
+
+        __atomic_add_fetch(&symbol->samples, sample->weight, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&window->other, sample->weight, __ATOMIC_RELAXED);
+} /* }}} */
+
+static zend_bool zend_stat_profile_aggregate(zend_stat_sample_t *sample, zend_stat_profile_t *profile) {
+    zend_stat_profile_symbol_t *symbol;
+    zend_stat_profile_request_t *request;
+    int64_t memory;
+    uint32_t span;
+
+    if (UNEXPECTED(sample->type == ZEND_STAT_SAMPLE_SUMMARY)) {
+        /* the samples it summarizes were already aggregated */
+        return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
+    }
+
+    request = zend_stat_profile_request(sample, &memory);
+
+    __atomic_add_fetch(&profile->samples, sample->weight, __ATOMIC_RELAXED);
+
+    for (span = 0; span < ZEND_STAT_PROFILE_SPANS_COUNT; span++) {
+        zend_stat_profile_window_t *window =
+            zend_stat_profile_window(span, sample->elapsed);
+
+        if (EXPECTED(NULL != window)) {
+            zend_stat_profile_window_add(window, sample);
+        }
+    }
+
+    if (request && request->uri) {
+        zend_stat_sketch_add(
+            zend_stat_profile.heavy.uris, request->uri, NULL, sample->weight);
+    }
+
+    if ((sample->type != ZEND_STAT_SAMPLE_MEMORY) && sample->symbol.file) {
+        zend_stat_sketch_add(
+            zend_stat_profile.heavy.files, sample->symbol.file, NULL, sample->weight);
+    }
+
+    if ((sample->type == ZEND_STAT_SAMPLE_MEMORY) ||
+        (NULL == sample->symbol.function)) {
+        return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
+    }
+
+    zend_stat_sketch_add(
+        zend_stat_profile.heavy.symbols,
+        sample->symbol.function,
+        sample->symbol.scope, sample->weight);
+
+    symbol = zend_stat_profile_symbol(
+        profile, sample->symbol.scope, sample->symbol.function);
+
+    if (UNEXPECTED(NULL == symbol)) {
+        __atomic_add_fetch(&profile->dropped, sample->weight, __ATOMIC_RELAXED);
+
+        return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
+    }
+
+    __atomic_add_fetch(&symbol->samples, sample->weight, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&symbol->memory,  memory,         __ATOMIC_RELAXED);
+
+    /* An internal function is charged to itself, and counted against the
+        user function that called it */
+    if ((sample->type == ZEND_STAT_SAMPLE_INTERNAL) &&
+        (NULL != sample->location.caller.function)) {
+        symbol = zend_stat_profile_symbol(
+            profile,
+            sample->location.caller.scope,
+            sample->location.caller.function);
+
+        if (EXPECTED(NULL != symbol)) {
+            __atomic_add_fetch(&symbol->callers, sample->weight, __ATOMIC_RELAXED);
+        }
+    }
+
+    return ZEND_STAT_BUFFER_CONSUMER_CONTINUE;
+}
+
+static void* zend_stat_profile_routine(void *arg) {
+    do {
+        zend_stat_buffer_consume(
+            zend_stat_profile.buffer,
+            zend_stat_profile.cursor,
+            (zend_stat_buffer_consumer_t) zend_stat_profile_aggregate,
+            zend_stat_profile.profile,
+            ZEND_LONG_MAX);
+
+        if (zend_stat_buffer_empty(zend_stat_profile.buffer, zend_stat_profile.cursor)) {
+            if (__atomic_load_n(&zend_stat_profile.closed, __ATOMIC_SEQ_CST)) {
+                break;
+            }
+
+            usleep(ceil((zend_stat_sampler_interval_get() / 1000) / 2));
+        }
+    } while (1);
+
+    pthread_exit(NULL);
+}
+
+static zend_bool zend_stat_profile_write_symbol(zend_stat_io_buffer_t *iob, zend_stat_string_t *scope, zend_stat_string_t *function) {
+    if (!zend_stat_io_buffer_append(iob, "\"function\": \"", sizeof("\"function\": \"")-1) ||
+        !zend_stat_io_buffer_appends(iob, function) ||
+        !zend_stat_io_buffer_append(iob, "\"", sizeof("\"")-1)) {
+        return 0;
+    }
+
+    if (scope) {
+        if (!zend_stat_io_buffer_append(iob, ", \"scope\": \"", sizeof(", \"scope\": \"")-1) ||
+            !zend_stat_io_buffer_appends(iob, scope) ||
+            !zend_stat_io_buffer_append(iob, "\"", sizeof("\"")-1)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* {{{ A window is copied before it is written, a copy taken while the window
+    was reset for a later index is discarded */
+static zend_bool zend_stat_profile_window_copy(zend_stat_profile_window_t *window, zend_stat_profile_window_t *copy) {
+    uint32_t sequence = __atomic_load_n(&window->sequence, __ATOMIC_ACQUIRE);
+
+    if (sequence & 1) {
+        return 0;
+    }
+
+    memcpy(copy, window, sizeof(zend_stat_profile_window_t));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&window->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+static zend_ulong zend_stat_profile_window_top(zend_stat_profile_window_t *window, zend_stat_profile_window_symbol_t **top) {
+    zend_ulong it, used = 0;
+
+    for (it = 0; it < ZEND_STAT_PROFILE_WINDOW_SYMBOLS; it++) {
+        zend_stat_profile_window_symbol_t *symbol = &window->symbol[it];
+        zend_ulong position = used;
+
+        if ((NULL == symbol->function) || (0 == symbol->samples)) {
+            continue;
+        }
+
+        while ((position > 0) && (top[position - 1]->samples < symbol->samples)) {
+            if (position < ZEND_STAT_PROFILE_TOP) {
+                top[position] = top[position - 1];
+            }
+            position--;
+        }
+
+        if (position < ZEND_STAT_PROFILE_TOP) {
+            top[position] = symbol;
+
+            if (used < ZEND_STAT_PROFILE_TOP) {
+                used++;
+            }
+        }
+    }
+
+    return used;
+}
+
+static zend_ulong zend_stat_profile_window_opcodes(zend_stat_profile_window_t *window, zend_uchar *top) {
+    zend_ulong it, used = 0;
+
+    for (it = 1; it <= ZEND_VM_LAST_OPCODE; it++) {
+        zend_ulong position = used;
+
+        if (0 == window->opcodes[it]) {
+            continue;
+        }
+
+        while ((position > 0) && (window->opcodes[top[position - 1]] < window->opcodes[it])) {
+            if (position < ZEND_STAT_PROFILE_TOP) {
+                top[position] = top[position - 1];
+            }
+            position--;
+        }
+
+        if (position < ZEND_STAT_PROFILE_TOP) {
+            top[position] = it;
+
+            if (used < ZEND_STAT_PROFILE_TOP) {
+                used++;
+            }
+        }
+    }
+
+    return used;
+}
+
+static zend_bool zend_stat_profile_write_window(zend_stat_io_buffer_t *iob, uint32_t span, zend_stat_profile_window_t *window) {
+    zend_stat_profile_window_symbol_t *symbols[ZEND_STAT_PROFILE_TOP];
+    zend_uchar opcodes[ZEND_STAT_PROFILE_TOP];
+    zend_ulong it, end;
+
+    if (!zend_stat_io_buffer_appendf(iob,
+            "{\"span\": %" PRIu32 ", \"start\": %" PRId64 ", "
+            "\"samples\": %" PRIu64 ", \"other\": %" PRIu64 ", \"symbols\": [",
+            span,
+            window->index * span,
+            window->samples,
+            window->other)) {
+        return 0;
+    }
+
+    for (it = 0, end = zend_stat_profile_window_top(window, symbols); it < end; it++) {
+        if (!zend_stat_io_buffer_append(iob,
+                it ? ", {" : "{",
+                it ? sizeof(", {")-1 : sizeof("{")-1) ||
+            !zend_stat_profile_write_symbol(iob, symbols[it]->scope, symbols[it]->function) ||
+            !zend_stat_io_buffer_appendf(iob,
+                ", \"samples\": %" PRIu64 "}", symbols[it]->samples)) {
+            return 0;
+        }
+    }
+
+    if (!zend_stat_io_buffer_append(iob, "], \"opcodes\": [", sizeof("], \"opcodes\": [")-1)) {
+        return 0;
+    }
+
+    for (it = 0, end = zend_stat_profile_window_opcodes(window, opcodes); it < end; it++) {
+        if (!zend_stat_io_buffer_append(iob,
+                it ? ", {\"opcode\": \"" : "{\"opcode\": \"",
+                it ? sizeof(", {\"opcode\": \"")-1 : sizeof("{\"opcode\": \"")-1) ||
+            !zend_stat_io_buffer_appends(iob, zend_stat_string_opcode(opcodes[it])) ||
+            !zend_stat_io_buffer_appendf(iob,
+                "\", \"samples\": %" PRIu64 "}", window->opcodes[opcodes[it]])) {
+            return 0;
+        }
+    }
+
+    return zend_stat_io_buffer_append(iob, "]}", sizeof("]}")-1);
+}
+
+/* Windows are written newest first, for every span */
+static zend_bool zend_stat_profile_write_windows(zend_stat_io_buffer_t *iob) {
+    zend_stat_profile_window_t *copy = malloc(sizeof(zend_stat_profile_window_t));
+    zend_bool separate = 0;
+    uint32_t span;
+
+    if (UNEXPECTED(NULL == copy)) {
+        return 0;
+    }
+
+    for (span = 0; span < ZEND_STAT_PROFILE_SPANS_COUNT; span++) {
+        zend_stat_profile_window_t *ring =
+            &zend_stat_profile.windows[span * ZEND_STAT_PROFILE_WINDOWS];
+        int64_t newest = -1, index;
+        uint32_t it;
+
+        for (it = 0; it < ZEND_STAT_PROFILE_WINDOWS; it++) {
+            newest = MAX(newest, __atomic_load_n(&ring[it].index, __ATOMIC_ACQUIRE));
+        }
+
+        for (index = newest; (index >= 0) && (index > (newest - ZEND_STAT_PROFILE_WINDOWS)); index--) {
+            zend_stat_profile_window_t *window =
+                &ring[index % ZEND_STAT_PROFILE_WINDOWS];
+
+            if (!zend_stat_profile_window_copy(window, copy) ||
+                (copy->index != index)) {
+                continue;
+            }
+
+            if ((separate && !zend_stat_io_buffer_append(iob, ", ", sizeof(", ")-1)) ||
+                !zend_stat_profile_write_window(iob, zend_stat_profile_spans[span], copy)) {
+                free(copy);
+                return 0;
+            }
+
+            separate = 1;
+        }
+    }
+
+    free(copy);
+    return 1;
+} /* }}} */
+
+/* {{{ When baselines are enabled, a client may send a command as soon as it
+    connects: "save <name>\n" saves a baseline of the profile, "diff <name>\n"
+    compares the profile with a baseline, "diff <name> <name>\n" compares
+    two baselines; a client that sends nothing receives a snapshot */
+typedef struct _zend_stat_profile_command_t {
+    char  line[(ZEND_STAT_BASELINE_NAME * 2) + sizeof("diff  ")];
+    char *verb;
+    char *names[2];
+} zend_stat_profile_command_t;
+
+static zend_bool zend_stat_profile_command(int client, zend_stat_profile_command_t *command) {
+    struct pollfd pfd = {client, POLLIN, 0};
+    size_t length = 0;
+    char *state = NULL;
+
+    memset(command, 0, sizeof(zend_stat_profile_command_t));
+
+    if (poll(&pfd, 1, ZEND_STAT_PROFILE_HANDSHAKE) <= 0) {
+        return 0;
+    }
+
+    while (length < (sizeof(command->line) - 1)) {
+        ssize_t bytes = recv(client, &command->line[length], 1, 0);
+
+        if (bytes <= 0) {
+            if ((bytes == FAILURE) && (errno == EINTR)) {
+                continue;
+            }
+
+            return 0;
+        }
+
+        if (command->line[length] == '\n') {
+            break;
+        }
+
+        length++;
+    }
+
+    if (length == (sizeof(command->line) - 1)) {
+        return 0;
+    }
+
+    command->line[length] = 0;
+
+    command->verb     = strtok_r(command->line, " \r", &state);
+    command->names[0] = strtok_r(NULL, " \r", &state);
+    command->names[1] = strtok_r(NULL, " \r", &state);
+
+    if ((NULL == command->verb) ||
+        (NULL == command->names[0]) ||
+        (NULL != strtok_r(NULL, " \r", &state)) ||
+        !zend_stat_baseline_name(command->names[0]) ||
+        (command->names[1] && !zend_stat_baseline_name(command->names[1]))) {
+        return 0;
+    }
+
+    if (SUCCESS == strcmp(command->verb, "save")) {
+        return NULL == command->names[1];
+    }
+
+    return SUCCESS == strcmp(command->verb, "diff");
+}
+
+static zend_always_inline zend_bool zend_stat_profile_baseline_path(char *path, size_t size, const char *name) {
+    return snprintf(path, size, "%s/%s.baseline", zend_stat_profile.baselines, name) < size;
+}
+
+static zend_stat_baseline_t* zend_stat_profile_baseline(const char *name) {
+    char path[PATH_MAX];
+
+    if (NULL == name) {
+        return zend_stat_baseline_take(
+            zend_stat_profile.profile,
+            zend_stat_profile.pid,
+            zend_stat_profile.started);
+    }
+
+    if (!zend_stat_profile_baseline_path(path, sizeof(path), name)) {
+        return NULL;
+    }
+
+    return zend_stat_baseline_load(path);
+}
+
+/* Nothing is written to a client when a baseline cannot be saved or read */
+static void zend_stat_profile_execute(int client, zend_stat_profile_command_t *command) {
+    zend_stat_baseline_t *before = NULL, *after = NULL;
+    zend_stat_io_buffer_t iob;
+    char path[PATH_MAX];
+
+    if (!zend_stat_io_buffer_alloc(&iob, 8192)) {
+        return;
+    }
+
+    if (SUCCESS == strcmp(command->verb, "save")) {
+        after = zend_stat_profile_baseline(NULL);
+
+        if (UNEXPECTED(NULL == after) ||
+            !zend_stat_profile_baseline_path(path, sizeof(path), command->names[0]) ||
+            !zend_stat_baseline_save(after, path) ||
+            !zend_stat_io_buffer_appendf(&iob,
+                "{\"type\": \"baseline\", \"name\": \"%s\", \"elapsed\": %.10f, "
+                "\"samples\": %" PRIu64 ", \"symbols\": %" PRIu64 "}\n",
+                command->names[0],
+                after->elapsed, after->samples, (uint64_t) after->used)) {
+            goto _zend_stat_profile_execute_failed;
+        }
+    } else {
+        before = zend_stat_profile_baseline(command->names[0]);
+        after  = zend_stat_profile_baseline(command->names[1]);
+
+        if (UNEXPECTED((NULL == before) || (NULL == after)) ||
+            !zend_stat_baseline_diff(before, after, &iob)) {
+            goto _zend_stat_profile_execute_failed;
+        }
+    }
+
+    zend_stat_io_buffer_flush(&iob, client);
+
+    goto _zend_stat_profile_execute_leave;
+
+_zend_stat_profile_execute_failed:
+    zend_stat_io_buffer_free(&iob);
+
+_zend_stat_profile_execute_leave:
+    if (before) {
+        zend_stat_baseline_free(before);
+    }
+
+    if (after) {
+        zend_stat_baseline_free(after);
+    }
+} /* }}} */
+
+/* A snapshot is the whole profile, in a single document */
+static void zend_stat_profile_snapshot(zend_stat_io_t *io, int client) {
+    zend_stat_profile_t *profile = zend_stat_profile.profile;
+    zend_stat_io_buffer_t iob;
+    zend_bool separate = 0;
+    zend_ulong it;
+
+    if (zend_stat_profile.baselines) {
+        zend_stat_profile_command_t command;
+
+        if (zend_stat_profile_command(client, &command)) {
+            zend_stat_profile_execute(client, &command);
+            return;
+        }
+    }
+
+    if (!zend_stat_io_buffer_alloc(&iob, 8192)) {
+        return;
+    }
+
+    if (!zend_stat_io_buffer_appendf(&iob,
+            "{\"type\": \"profile\", \"elapsed\": %.10f, "
+            "\"samples\": %" PRIu64 ", \"dropped\": %" PRIu64 ", \"windows\": [",
+            zend_stat_time(),
+            __atomic_load_n(&profile->samples, __ATOMIC_RELAXED),
+            __atomic_load_n(&profile->dropped, __ATOMIC_RELAXED)) ||
+        !zend_stat_profile_write_windows(&iob) ||
+        !zend_stat_io_buffer_append(&iob, "], \"heavy\": {\"symbols\": ", sizeof("], \"heavy\": {\"symbols\": ")-1) ||
+        !zend_stat_sketch_write(zend_stat_profile.heavy.symbols, &iob, "function", "scope") ||
+        !zend_stat_io_buffer_append(&iob, ", \"files\": ", sizeof(", \"files\": ")-1) ||
+        !zend_stat_sketch_write(zend_stat_profile.heavy.files, &iob, "file", NULL) ||
+        !zend_stat_io_buffer_append(&iob, ", \"uris\": ", sizeof(", \"uris\": ")-1) ||
+        !zend_stat_sketch_write(zend_stat_profile.heavy.uris, &iob, "uri", NULL) ||
+        !zend_stat_io_buffer_append(&iob, "}, \"routes\": ", sizeof("}, \"routes\": ")-1) ||
+        !zend_stat_routes_write(&iob) ||
+        !zend_stat_io_buffer_appendf(&iob,
+            ", \"unrouted\": %" PRIu64 ", \"symbols\": [",
+            zend_stat_routes_dropped())) {
+        goto _zend_stat_profile_snapshot_failed;
+    }
+
+    for (it = 0; it < profile->slots; it++) {
+        zend_stat_profile_symbol_t *symbol = &profile->symbol[it];
+        zend_stat_string_t *function =
+            __atomic_load_n(&symbol->function, __ATOMIC_ACQUIRE);
+
+        if (NULL == function) {
+            continue;
+        }
+
+        if (!zend_stat_io_buffer_append(&iob,
+                separate ? ", {" : "{",
+                separate ? sizeof(", {")-1 : sizeof("{")-1) ||
+            !zend_stat_profile_write_symbol(&iob, symbol->scope, function) ||
+            !zend_stat_io_buffer_appendf(&iob,
+                ", \"samples\": %" PRIu64 ", \"memory\": %" PRId64 ", \"callers\": %" PRIu64 "}",
+                __atomic_load_n(&symbol->samples, __ATOMIC_RELAXED),
+                __atomic_load_n(&symbol->memory,  __ATOMIC_RELAXED),
+                __atomic_load_n(&symbol->callers, __ATOMIC_RELAXED))) {
+            goto _zend_stat_profile_snapshot_failed;
+        }
+
+        separate = 1;
+    }
+
+    if (!zend_stat_io_buffer_append(&iob, "]}\n", sizeof("]}\n")-1)) {
+        goto _zend_stat_profile_snapshot_failed;
+    }
+
+    zend_stat_io_buffer_flush(&iob, client);
+    return;
+
+_zend_stat_profile_snapshot_failed:
+    zend_stat_io_buffer_free(&iob);
+}
+
+static void zend_stat_profile_free(void) {
+    if (zend_stat_profile.cursor) {
+        zend_stat_buffer_cursor_destroy(zend_stat_profile.cursor);
+    }
+
+    if (zend_stat_profile.requests) {
+        zend_ulong it;
+
+        for (it = 0; it < zend_stat_profile.slots; it++) {
+            if (zend_stat_profile.requests[it].uri) {
+                zend_stat_string_release(zend_stat_profile.requests[it].uri);
+            }
+        }
+
+        free(zend_stat_profile.requests);
+    }
+
+    free(zend_stat_profile.windows);
+
+    zend_stat_sketch_destroy(zend_stat_profile.heavy.symbols);
+    zend_stat_sketch_destroy(zend_stat_profile.heavy.files);
+    zend_stat_sketch_destroy(zend_stat_profile.heavy.uris);
+
+    zend_stat_region_unmap(
+        ZEND_STAT_REGION_PROFILE,
+        zend_stat_profile.profile,
+        zend_stat_profile_size(ZEND_STAT_PROFILE_SLOTS));
+
+    memset(&zend_stat_profile, 0, sizeof(zend_stat_profile));
+}
+
+zend_bool zend_stat_profile_startup(zend_stat_io_t *io, zend_stat_buffer_t *buffer, char *snapshot, char *baselines) {
+    if (!snapshot) {
+        /* nothing is aggregated unless there is somewhere to read it */
+        return zend_stat_io_startup(io, NULL, buffer, NULL);
+    }
+
+    zend_stat_profile.profile =
+        zend_stat_region_map(
+            ZEND_STAT_REGION_PROFILE,
+            zend_stat_profile_size(ZEND_STAT_PROFILE_SLOTS));
+
+    if (UNEXPECTED(NULL == zend_stat_profile.profile)) {
+        zend_error(E_WARNING,
+            "[STAT] Failed to allocate shared memory for profile");
+        return 0;
+    }
+
+    zend_stat_commit(
+        zend_stat_profile.profile,
+        zend_stat_profile_size(ZEND_STAT_PROFILE_SLOTS));
+
+    zend_stat_profile.profile->slots = ZEND_STAT_PROFILE_SLOTS;
+
+    {
+        struct timeval tv;
+
+        /* the monotonic clock means nothing to another master, the wall
+            clock and the pid tell masters apart */
+        gettimeofday(&tv, NULL);
+
+        zend_stat_profile.baselines = baselines;
+        zend_stat_profile.pid       = getpid();
+        zend_stat_profile.started   = (double) tv.tv_sec + (tv.tv_usec / 1000000.0);
+    }
+
+    zend_stat_profile.slots    = zend_stat_requests_slots();
+    zend_stat_profile.requests =
+        calloc(zend_stat_profile.slots, sizeof(zend_stat_profile_request_t));
+
+    if (UNEXPECTED(NULL == zend_stat_profile.requests)) {
+        goto _zend_stat_profile_startup_failed;
+    }
+
+    zend_stat_profile.windows =
+        calloc(
+            ZEND_STAT_PROFILE_SPANS_COUNT * ZEND_STAT_PROFILE_WINDOWS,
+            sizeof(zend_stat_profile_window_t));
+
+    if (UNEXPECTED(NULL == zend_stat_profile.windows)) {
+        goto _zend_stat_profile_startup_failed;
+    }
+
+    {
+        uint32_t it;
+
+        for (it = 0; it < ZEND_STAT_PROFILE_SPANS_COUNT * ZEND_STAT_PROFILE_WINDOWS; it++) {
+            zend_stat_profile.windows[it].index = -1;
+        }
+    }
+
+    zend_stat_profile.heavy.symbols =
+        zend_stat_sketch_create(ZEND_STAT_SKETCH_COUNTERS, ZEND_STAT_SKETCH_ADDRESS);
+    zend_stat_profile.heavy.files =
+        zend_stat_sketch_create(ZEND_STAT_SKETCH_COUNTERS, ZEND_STAT_SKETCH_ADDRESS);
+    zend_stat_profile.heavy.uris =
+        zend_stat_sketch_create(ZEND_STAT_SKETCH_COUNTERS, ZEND_STAT_SKETCH_VALUE);
+
+    if (UNEXPECTED(
+            (NULL == zend_stat_profile.heavy.symbols) ||
+            (NULL == zend_stat_profile.heavy.files) ||
+            (NULL == zend_stat_profile.heavy.uris))) {
+        goto _zend_stat_profile_startup_failed;
+    }
+
+    zend_stat_profile.buffer = buffer;
+    zend_stat_profile.closed = 0;
+    zend_stat_profile.cursor = zend_stat_buffer_cursor_create(buffer);
+
+    if (UNEXPECTED(NULL == zend_stat_profile.cursor)) {
+        goto _zend_stat_profile_startup_failed;
+    }
+
+    if (pthread_create(&zend_stat_profile.thread,
+            NULL,
+            zend_stat_profile_routine, NULL) != SUCCESS) {
+        zend_error(E_WARNING,
+            "[STAT] %s - cannot create thread for profile",
+            strerror(errno));
+        goto _zend_stat_profile_startup_failed;
+    }
+
+    if (!zend_stat_io_startup(io, snapshot, buffer, zend_stat_profile_snapshot)) {
+        __atomic_store_n(&zend_stat_profile.closed, 1, __ATOMIC_SEQ_CST);
+
+        pthread_join(zend_stat_profile.thread, NULL);
+
+        goto _zend_stat_profile_startup_failed;
+    }
+
+    return 1;
+
+_zend_stat_profile_startup_failed:
+    zend_stat_profile_free();
+
+    return 0;
+}
+
+void zend_stat_profile_shutdown(zend_stat_io_t *io) {
+    zend_stat_io_shutdown(io);
+
+    if (NULL == zend_stat_profile.profile) {
+        return;
+    }
+
+    __atomic_store_n(&zend_stat_profile.closed, 1, __ATOMIC_SEQ_CST);
+
+    pthread_join(zend_stat_profile.thread, NULL);
+
+    zend_stat_profile_free();
+}
+#endif	/* ZEND_STAT_PROFILE */
@@ -0,0 +1,85 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_PROFILE_H
+# define ZEND_STAT_PROFILE_H
+
+#include "zend_stat_io.h"
+
+#ifndef ZEND_STAT_PROFILE_SLOTS
+#   define ZEND_STAT_PROFILE_SLOTS  65536
+#endif
+
+#ifndef ZEND_STAT_PROFILE_PROBES
+#   define ZEND_STAT_PROFILE_PROBES 64
+#endif
+
+#ifndef ZEND_STAT_PROFILE_WINDOWS
+#   define ZEND_STAT_PROFILE_WINDOWS 4
+#endif
+
+#ifndef ZEND_STAT_PROFILE_WINDOW_SYMBOLS
+#   define ZEND_STAT_PROFILE_WINDOW_SYMBOLS 256
+#endif
+
+#ifndef ZEND_STAT_PROFILE_TOP
+#   define ZEND_STAT_PROFILE_TOP 10
+#endif
+
+/* The spans of the rolling windows, in seconds */
+#define ZEND_STAT_PROFILE_SPANS {1, 10, 60}
+#define ZEND_STAT_PROFILE_SPANS_COUNT 3
+
+/* A symbol is keyed by its interned scope and function, the counts are
+    weighted the same as the samples they were taken from */
+typedef struct _zend_stat_profile_symbol_t {
+    zend_stat_string_t *scope;
+    zend_stat_string_t *function;
+    uint64_t            samples;
+    int64_t             memory;
+    uint64_t            callers;
+} zend_stat_profile_symbol_t;
+
+typedef struct _zend_stat_profile_t {
+    zend_ulong                 slots;
+    zend_ulong                 used;
+    uint64_t                   samples;
+    uint64_t                   dropped;
+    zend_stat_profile_symbol_t symbol[1];
+} zend_stat_profile_t;
+
+typedef struct _zend_stat_profile_window_symbol_t {
+    zend_stat_string_t *scope;
+    zend_stat_string_t *function;
+    uint64_t            samples;
+} zend_stat_profile_window_symbol_t;
+
+/* A window aggregates the samples whose elapsed time falls within it, in a
+    fixed table: samples of symbols that don't fit are counted as other */
+typedef struct _zend_stat_profile_window_t {
+    uint32_t                          sequence;
+    int64_t                           index;
+    uint64_t                          samples;
+    uint64_t                          other;
+    zend_stat_profile_window_symbol_t symbol[ZEND_STAT_PROFILE_WINDOW_SYMBOLS];
+    uint64_t                          opcodes[256];
+} zend_stat_profile_window_t;
+
+zend_bool zend_stat_profile_startup(zend_stat_io_t *io, zend_stat_buffer_t *buffer, char *snapshot, char *baselines);
+void      zend_stat_profile_shutdown(zend_stat_io_t *io);
+#endif	/* ZEND_STAT_PROFILE_H */
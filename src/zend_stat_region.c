@@ -0,0 +1,201 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_REGION
+# define ZEND_STAT_REGION
+
+#include "zend_stat.h"
+#include "zend_stat_region.h"
+
+#include <fcntl.h>
+#include <limits.h>
+
+static struct {
+    char *path;
+    zend_bool memfd;
+    struct {
+        zend_stat_region_header_t *header;
+        int fd;
+    } region[ZEND_STAT_REGION_TYPES];
+} zend_stat_regions = {NULL, 0};
+
+static const char *zend_stat_region_names[ZEND_STAT_REGION_TYPES] = {
+    "buffer",
+    "strings",
+    "profile",
+    "requests",
+    "arena"
+};
+
+zend_bool zend_stat_regions_startup(char *path) {
+    int it;
+
+    for (it = 0; it < ZEND_STAT_REGION_TYPES; it++) {
+        zend_stat_regions.region[it].header = NULL;
+        zend_stat_regions.region[it].fd     = -1;
+    }
+
+    zend_stat_regions.path  = path;
+    zend_stat_regions.memfd =
+        path && (SUCCESS == strcasecmp(path, "memfd"));
+
+#if !defined(MFD_CLOEXEC) && !defined(SYS_memfd_create)
+    if (zend_stat_regions.memfd) {
+        zend_error(E_WARNING,
+            "[STAT] memfd is not supported on this system, set stat.map to a path");
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+static int zend_stat_region_open(zend_stat_region_type_t type) {
+    char name[PATH_MAX],
+         previous[PATH_MAX];
+
+    if (zend_stat_regions.memfd) {
+        snprintf(name, sizeof(name),
+            "zend.stat.%s", zend_stat_region_names[type]);
+
+#if defined(MFD_CLOEXEC)
+        return memfd_create(name, 0);
+#elif defined(SYS_memfd_create)
+        return syscall(SYS_memfd_create, name, 0);
+#else
+        return FAILURE;
+#endif
+    }
+
+    if (snprintf(name, sizeof(name),
+            "%s.%s",
+            zend_stat_regions.path,
+            zend_stat_region_names[type]) >= sizeof(name)) {
+        return FAILURE;
+    }
+
+    if (snprintf(previous, sizeof(previous),
+            "%s.previous", name) >= sizeof(previous)) {
+        return FAILURE;
+    }
+
+    /* a file left behind by a previous master is moved aside rather than
+        truncated, so that its samples may still be read post-mortem */
+    if ((rename(name, previous) != SUCCESS) && (errno != ENOENT)) {
+        zend_error(E_WARNING,
+            "[STAT] %s - cannot move aside %s",
+            strerror(errno), name);
+        return FAILURE;
+    }
+
+    return open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+}
+
+void* zend_stat_region_map(zend_stat_region_type_t type, zend_long size) {
+    zend_stat_region_header_t *header;
+    int fd, flags = MAP_SHARED;
+
+    if (NULL == zend_stat_regions.path) {
+        return zend_stat_map(size);
+    }
+
+    fd = zend_stat_region_open(type);
+
+    if (UNEXPECTED(FAILURE == fd)) {
+        return NULL;
+    }
+
+    /* the file is sparse, until the region is committed */
+    if (UNEXPECTED(ftruncate(fd, ZEND_STAT_REGION_HEADER + size) != SUCCESS)) {
+        close(fd);
+        return NULL;
+    }
+
+#ifdef MAP_NORESERVE
+    if (zend_stat_memory & ZEND_STAT_MEMORY_LAZY) {
+        flags |= MAP_NORESERVE;
+    }
+#endif
+
+    header = mmap(NULL,
+        ZEND_STAT_REGION_HEADER + size,
+        PROT_READ|PROT_WRITE, flags, fd, 0);
+
+    if (UNEXPECTED(header == MAP_FAILED)) {
+        close(fd);
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* explicit hugepages need a file on hugetlbfs, which is up to the path,
+        transparent hugepages are the best that can be done here */
+    if (zend_stat_memory & (ZEND_STAT_MEMORY_TRANSPARENT|ZEND_STAT_MEMORY_EXPLICIT)) {
+        madvise(header, ZEND_STAT_REGION_HEADER + size, MADV_HUGEPAGE);
+    }
+#endif
+
+    header->version = ZEND_STAT_REGION_VERSION;
+    header->type    = type;
+    header->size    = size;
+    header->address = (uint64_t) (((char*) header) + ZEND_STAT_REGION_HEADER);
+    header->pid     = getpid();
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    /* a reader that finds the magic finds the rest of the header */
+    memcpy(header->magic, ZEND_STAT_REGION_MAGIC, sizeof(header->magic));
+
+    if (zend_stat_regions.memfd) {
+        /* the memfd lives as long as this descriptor, readers open it
+            through /proc/<pid>/fd of this process */
+        zend_stat_regions.region[type].fd = fd;
+    } else {
+        close(fd);
+    }
+
+    zend_stat_regions.region[type].header = header;
+
+    return (void*) header->address;
+}
+
+void zend_stat_region_unmap(zend_stat_region_type_t type, void *address, zend_long size) {
+    if (NULL == zend_stat_regions.path) {
+        zend_stat_unmap(address, size);
+        return;
+    }
+
+    if (UNEXPECTED(NULL == address)) {
+        return;
+    }
+
+    /* a file is left in place, the samples it holds outlive the master */
+    munmap(((char*) address) - ZEND_STAT_REGION_HEADER, ZEND_STAT_REGION_HEADER + size);
+
+    if (zend_stat_regions.region[type].fd != -1) {
+        close(zend_stat_regions.region[type].fd);
+    }
+
+    zend_stat_regions.region[type].header = NULL;
+    zend_stat_regions.region[type].fd     = -1;
+}
+
+void zend_stat_regions_shutdown(void) {
+    zend_stat_regions.path  = NULL;
+    zend_stat_regions.memfd = 0;
+}
+#endif	/* ZEND_STAT_REGION */
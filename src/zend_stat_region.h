@@ -0,0 +1,56 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_REGION_H
+# define ZEND_STAT_REGION_H
+
+/* A region is shared memory that may be backed by a named file or a memfd,
+    so that processes other than the workers can map it: the region is
+    preceded by a header that describes it, and the layout of everything
+    that follows the header is fixed for a version */
+#define ZEND_STAT_REGION_MAGIC   "zendstat"
+#define ZEND_STAT_REGION_VERSION 1
+
+/* The header takes a page of its own, the region that follows it is page aligned */
+#define ZEND_STAT_REGION_HEADER  4096
+
+typedef enum {
+    ZEND_STAT_REGION_BUFFER,
+    ZEND_STAT_REGION_STRINGS,
+    ZEND_STAT_REGION_PROFILE,
+    ZEND_STAT_REGION_REQUESTS,
+    ZEND_STAT_REGION_ARENA,
+    ZEND_STAT_REGION_TYPES
+} zend_stat_region_type_t;
+
+typedef struct _zend_stat_region_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t type;
+    uint64_t size;
+    /* The address the region was mapped at by the process that created it,
+        every pointer within a region is relative to this address */
+    uint64_t address;
+    int64_t  pid;
+} zend_stat_region_header_t;
+
+zend_bool zend_stat_regions_startup(char *path);
+void*     zend_stat_region_map(zend_stat_region_type_t type, zend_long size);
+void      zend_stat_region_unmap(zend_stat_region_type_t type, void *address, zend_long size);
+void      zend_stat_regions_shutdown(void);
+#endif	/* ZEND_STAT_REGION_H */
@@ -15,15 +15,158 @@
   | Author: krakjoe                                                      |
   +----------------------------------------------------------------------+
  */
-
 #ifndef ZEND_STAT_REQUEST
 # define ZEND_STAT_REQUEST
 
 #include "zend_stat.h"
+#include "zend_stat_region.h"
 #include "zend_stat_request.h"
 
 #include "SAPI.h"
 
+#include <sched.h>
+#include <signal.h>
+
+#define ZEND_STAT_REQUEST_FREE   0
+#define ZEND_STAT_REQUEST_ACTIVE 1
+#define ZEND_STAT_REQUEST_ENDED  2
+
+/* The table owns the strings of every request in it: a request is published
+    once when it starts, samples refer to it by slot and generation, and the
+    request is kept after it ends, until the slot is reused, so that
+    consumers that are behind can still describe it */
+typedef struct _zend_stat_request_slot_t {
+    uint32_t             state;
+    uint32_t             lock;
+    uint32_t             generation;
+    zend_stat_request_t  request;
+} zend_stat_request_slot_t;
+
+typedef struct _zend_stat_requests_t {
+    zend_ulong               slots;
+    zend_ulong               next;
+    zend_stat_request_slot_t slot[1];
+} zend_stat_requests_t;
+
+static zend_stat_requests_t *zend_stat_requests = NULL;
+
+static zend_always_inline size_t zend_stat_requests_size(zend_ulong slots) {
+    return sizeof(zend_stat_requests_t) +
+                (sizeof(zend_stat_request_slot_t) * (slots - 1));
+}
+
+#ifndef ZEND_STAT_REQUEST_SPINS
+#   define ZEND_STAT_REQUEST_SPINS 65536
+#endif
+
+/* The lock holds the pid of its holder: a slot is only ever held for a few
+    instructions, a holder that keeps it for longer than the spin is checked
+    and, if it died holding the lock, the lock is taken from it */
+static zend_always_inline void zend_stat_request_lock(zend_stat_request_slot_t *slot) {
+    uint32_t pid = (uint32_t) zend_stat_pid(),
+             holder;
+    uint32_t spins = 0;
+
+    do {
+        holder = 0;
+
+        if (__atomic_compare_exchange_n(
+                &slot->lock,
+                &holder, pid,
+                1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        if (UNEXPECTED(++spins == ZEND_STAT_REQUEST_SPINS)) {
+            spins = 0;
+
+            if ((kill((pid_t) holder, 0) == FAILURE) && (errno == ESRCH) &&
+                __atomic_compare_exchange_n(
+                    &slot->lock,
+                    &holder, pid,
+                    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+
+            sched_yield();
+        }
+    } while (1);
+}
+
+static zend_always_inline void zend_stat_request_unlock(zend_stat_request_slot_t *slot) {
+    __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+}
+
+zend_bool zend_stat_requests_startup(zend_long slots) {
+    slots = MAX(slots, 1);
+
+    zend_stat_requests =
+        zend_stat_region_map(
+            ZEND_STAT_REGION_REQUESTS, zend_stat_requests_size(slots));
+
+    if (UNEXPECTED(NULL == zend_stat_requests)) {
+        zend_error(E_WARNING,
+            "[STAT] Failed to allocate shared memory for requests");
+        return 0;
+    }
+
+    zend_stat_commit(zend_stat_requests, zend_stat_requests_size(slots));
+
+    zend_stat_requests->slots = slots;
+
+    return 1;
+}
+
+zend_ulong zend_stat_requests_slots(void) {
+    return zend_stat_requests->slots;
+}
+
+static zend_always_inline zend_bool zend_stat_request_publish(zend_stat_request_t *request) {
+    zend_ulong tried = 0;
+
+    /* Slots are taken in turn, so that an ended request is kept for as long
+        as possible */
+    while (tried++ < zend_stat_requests->slots) {
+        zend_ulong id =
+            __atomic_fetch_add(
+                &zend_stat_requests->next, 1, __ATOMIC_RELAXED) % zend_stat_requests->slots;
+        zend_stat_request_slot_t *slot = &zend_stat_requests->slot[id];
+
+        if (ZEND_STAT_REQUEST_ACTIVE == __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        zend_stat_request_lock(slot);
+
+        if (UNEXPECTED(ZEND_STAT_REQUEST_ACTIVE == slot->state)) {
+            zend_stat_request_unlock(slot);
+            continue;
+        }
+
+        if (ZEND_STAT_REQUEST_ENDED == slot->state) {
+            zend_stat_request_release(&slot->request);
+        }
+
+        /* zero is never a generation */
+        if (UNEXPECTED(0 == ++slot->generation)) {
+            slot->generation++;
+        }
+
+        request->id         = id;
+        request->generation = slot->generation;
+
+        memcpy(&slot->request, request, sizeof(zend_stat_request_t));
+
+        __atomic_store_n(&slot->state, ZEND_STAT_REQUEST_ACTIVE, __ATOMIC_RELEASE);
+
+        zend_stat_request_unlock(slot);
+
+        return 1;
+    }
+
+    return 0;
+}
+
 zend_bool zend_stat_request_create(zend_stat_request_t *request) {
     sapi_request_info *ri = &SG(request_info);
 
@@ -70,6 +213,78 @@ zend_bool zend_stat_request_create(zend_stat_request_t *request) {
 
     /* anything else ? */
 
+    if (UNEXPECTED(!zend_stat_request_publish(request))) {
+        zend_stat_request_release(request);
+
+        return 0;
+    }
+
     return 1;
 }
+
+zend_bool zend_stat_request_find(uint32_t id, uint32_t generation, zend_stat_request_t *request) {
+    zend_stat_request_slot_t *slot;
+    zend_bool found = 0;
+
+    if (UNEXPECTED(id >= zend_stat_requests->slots)) {
+        return 0;
+    }
+
+    slot = &zend_stat_requests->slot[id];
+
+    zend_stat_request_lock(slot);
+
+    if (EXPECTED((slot->generation == generation) &&
+                 (slot->state != ZEND_STAT_REQUEST_FREE))) {
+        zend_stat_request_copy(request, &slot->request);
+
+        found = 1;
+    }
+
+    zend_stat_request_unlock(slot);
+
+    return found;
+}
+
+void zend_stat_request_end(zend_stat_request_t *request) {
+    zend_stat_request_slot_t *slot;
+
+    if (UNEXPECTED(0 == request->generation)) {
+        return;
+    }
+
+    slot = &zend_stat_requests->slot[request->id];
+
+    zend_stat_request_lock(slot);
+
+    /* the strings belong to the table now */
+    if (EXPECTED(slot->generation == request->generation)) {
+        __atomic_store_n(&slot->state, ZEND_STAT_REQUEST_ENDED, __ATOMIC_RELEASE);
+    }
+
+    zend_stat_request_unlock(slot);
+
+    memset(request, 0, sizeof(zend_stat_request_t));
+}
+
+void zend_stat_requests_shutdown(void) {
+    zend_ulong it;
+
+    if (UNEXPECTED(NULL == zend_stat_requests)) {
+        return;
+    }
+
+    for (it = 0; it < zend_stat_requests->slots; it++) {
+        zend_stat_request_slot_t *slot = &zend_stat_requests->slot[it];
+
+        if (slot->state != ZEND_STAT_REQUEST_FREE) {
+            zend_stat_request_release(&slot->request);
+        }
+    }
+
+    zend_stat_region_unmap(ZEND_STAT_REGION_REQUESTS, zend_stat_requests,
+        zend_stat_requests_size(zend_stat_requests->slots));
+
+    zend_stat_requests = NULL;
+}
 #endif	/* ZEND_STAT_REQUEST */
@@ -23,13 +23,80 @@
 
 typedef struct _zend_stat_request_t {
     pid_t               pid;
+    uint32_t            id;
+    uint32_t            generation;
     double              elapsed;
     zend_stat_string_t *path;
     zend_stat_string_t *method;
     zend_stat_string_t *uri;
 } zend_stat_request_t;
 
+#ifndef ZEND_STAT_REQUESTS_SLOTS
+#   define ZEND_STAT_REQUESTS_SLOTS 4096
+#endif
+
+#ifndef ZEND_STAT_REQUESTS_RETAIN
+#   define ZEND_STAT_REQUESTS_RETAIN 4
+#endif
+
+#ifndef ZEND_STAT_REQUEST_SYMBOLS
+#   define ZEND_STAT_REQUEST_SYMBOLS 6
+#endif
+
+typedef struct _zend_stat_request_symbol_t {
+    zend_stat_string_t *scope;
+    zend_stat_string_t *function;
+    uint64_t            samples;
+} zend_stat_request_symbol_t;
+
+/* What the sampler saw of a request: the samples taken and the symbols most
+    often found executing, counted with Space-Saving over a few entries. The
+    summary belongs to the sampler of the request, it is only written to the
+    stream when the request ends */
+typedef struct _zend_stat_request_summary_t {
+    uint64_t                   samples;
+    zend_stat_request_symbol_t symbol[ZEND_STAT_REQUEST_SYMBOLS];
+} zend_stat_request_summary_t;
+
+zend_bool  zend_stat_requests_startup(zend_long slots);
+zend_ulong zend_stat_requests_slots(void);
+void       zend_stat_requests_shutdown(void);
+
 zend_bool zend_stat_request_create(zend_stat_request_t *request);
+zend_bool zend_stat_request_find(uint32_t id, uint32_t generation, zend_stat_request_t *request);
+void      zend_stat_request_end(zend_stat_request_t *request);
+
+static zend_always_inline void zend_stat_request_count(zend_stat_request_summary_t *summary, zend_stat_string_t *scope, zend_stat_string_t *function, uint32_t weight) {
+    zend_stat_request_symbol_t *symbol = summary->symbol,
+                               *end    = symbol + ZEND_STAT_REQUEST_SYMBOLS,
+                               *least  = symbol;
+
+    summary->samples += weight;
+
+    if (NULL == function) {
+        return;
+    }
+
+    while (symbol < end) {
+        if ((symbol->function == function) &&
+            (symbol->scope == scope)) {
+            symbol->samples += weight;
+            return;
+        }
+
+        if (symbol->samples < least->samples) {
+            least = symbol;
+        }
+
+        symbol++;
+    }
+
+    /* the least counted symbol is replaced, and its count inherited, such
+        that the heaviest symbols of the request are never lost */
+    least->scope     = scope;
+    least->function  = function;
+    least->samples  += weight;
+}
 
 static zend_always_inline void zend_stat_request_copy(zend_stat_request_t *dest, zend_stat_request_t *src) {
     memcpy(dest, src, sizeof(zend_stat_request_t));
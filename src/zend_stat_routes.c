@@ -0,0 +1,351 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_ROUTES
+# define ZEND_STAT_ROUTES
+
+#include "zend_stat.h"
+#include "zend_stat_io.h"
+#include "zend_stat_routes.h"
+
+#include <ctype.h>
+
+#define ZEND_STAT_ROUTE_EMPTY 0
+#define ZEND_STAT_ROUTE_BUSY  1
+#define ZEND_STAT_ROUTE_READY 2
+
+/* A route that stays busy for this many loads belongs to a request that is
+    gone, or is too slow to wait for, and is passed over */
+#ifndef ZEND_STAT_ROUTES_SPINS
+#   define ZEND_STAT_ROUTES_SPINS 65536
+#endif
+
+/* A route is claimed by the first request that completes on it, and is
+    immutable but for its counts once it is ready */
+typedef struct _zend_stat_route_t {
+    uint32_t   state;
+    zend_ulong hash;
+    char       method[ZEND_STAT_ROUTE_METHOD];
+    char       uri[ZEND_STAT_ROUTE_URI];
+    uint64_t   max;
+    uint64_t   buckets[ZEND_STAT_HISTOGRAM_BUCKETS];
+} zend_stat_route_t;
+
+typedef struct _zend_stat_routes_t {
+    zend_ulong        slots;
+    uint64_t          dropped;
+    zend_stat_route_t route[1];
+} zend_stat_routes_t;
+
+static zend_stat_routes_t *zend_stat_routes = NULL;
+
+static zend_always_inline size_t zend_stat_routes_size(zend_ulong slots) {
+    return sizeof(zend_stat_routes_t) +
+                (sizeof(zend_stat_route_t) * (slots - 1));
+}
+
+zend_bool zend_stat_routes_startup(zend_long slots) {
+    slots = MAX(slots, 1);
+
+    zend_stat_routes = zend_stat_map(zend_stat_routes_size(slots));
+
+    if (UNEXPECTED(NULL == zend_stat_routes)) {
+        zend_error(E_WARNING,
+            "[STAT] Failed to allocate shared memory for routes");
+        return 0;
+    }
+
+    zend_stat_commit(zend_stat_routes, zend_stat_routes_size(slots));
+
+    zend_stat_routes->slots = slots;
+
+    return 1;
+}
+
+static zend_always_inline uint32_t zend_stat_histogram_index(uint64_t value) {
+    uint32_t exponent, index;
+
+    if (value < ZEND_STAT_HISTOGRAM_SUB) {
+        return (uint32_t) value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+    index    = ((exponent - ZEND_STAT_HISTOGRAM_BITS + 1) << ZEND_STAT_HISTOGRAM_BITS) +
+                    ((value >> (exponent - ZEND_STAT_HISTOGRAM_BITS)) & (ZEND_STAT_HISTOGRAM_SUB - 1));
+
+    return MIN(index, ZEND_STAT_HISTOGRAM_BUCKETS - 1);
+}
+
+/* The middle of the values recorded in a bucket */
+static zend_always_inline double zend_stat_histogram_value(uint32_t index) {
+    uint32_t group = index >> ZEND_STAT_HISTOGRAM_BITS,
+             sub   = index & (ZEND_STAT_HISTOGRAM_SUB - 1);
+    uint64_t lower, width;
+
+    if (index < ZEND_STAT_HISTOGRAM_SUB) {
+        return (double) index;
+    }
+
+    lower = ((uint64_t) (ZEND_STAT_HISTOGRAM_SUB + sub)) << (group - 1);
+    width = ((uint64_t) 1) << (group - 1);
+
+    return (double) lower + ((double) (width - 1) / 2);
+}
+
+/* {{{ A route is the method and the path of the uri, without the query, and
+    with every segment that looks like an identifier replaced with {id}: a
+    segment of digits, or of hex digits and dashes at least 8 long */
+static zend_always_inline zend_bool zend_stat_route_identifier(const char *segment, size_t length) {
+    size_t it, digits = 0;
+    zend_bool hex = 1;
+
+    for (it = 0; it < length; it++) {
+        if (segment[it] >= '0' && segment[it] <= '9') {
+            digits++;
+        } else if (!isxdigit((unsigned char) segment[it]) && (segment[it] != '-')) {
+            hex = 0;
+        }
+    }
+
+    if ((length > 0) && (digits == length)) {
+        return 1;
+    }
+
+    return hex && (digits > 0) && (length >= 8);
+}
+
+static zend_always_inline void zend_stat_route_append(char *route, size_t *used, const char *bytes, size_t length) {
+    length = MIN(length, ZEND_STAT_ROUTE_URI - 1 - *used);
+
+    memcpy(&route[*used], bytes, length);
+
+    *used += length;
+}
+
+static void zend_stat_route_normalize(zend_stat_string_t *uri, char *route) {
+    size_t it = 0, used = 0;
+
+    while ((it < uri->length) &&
+           (uri->value[it] != '?') &&
+           (uri->value[it] != '#')) {
+        size_t end = it;
+
+        if (uri->value[it] == '/') {
+            zend_stat_route_append(route, &used, "/", 1);
+            it++;
+            continue;
+        }
+
+        while ((end < uri->length) &&
+               (uri->value[end] != '/') &&
+               (uri->value[end] != '?') &&
+               (uri->value[end] != '#')) {
+            end++;
+        }
+
+        if (zend_stat_route_identifier(&uri->value[it], end - it)) {
+            zend_stat_route_append(route, &used, "{id}", sizeof("{id}")-1);
+        } else {
+            zend_stat_route_append(route, &used, &uri->value[it], end - it);
+        }
+
+        it = end;
+    }
+
+    route[used] = 0;
+} /* }}} */
+
+static zend_stat_route_t* zend_stat_route_find(const char *method, const char *uri) {
+    zend_ulong hash = zend_inline_hash_func(uri, strlen(uri)),
+               it;
+
+    hash ^= zend_inline_hash_func(method, strlen(method)) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+
+    for (it = 0; it < ZEND_STAT_ROUTES_PROBES; it++) {
+        zend_stat_route_t *route =
+            &zend_stat_routes->route[(hash + it) % zend_stat_routes->slots];
+        uint32_t state = __atomic_load_n(&route->state, __ATOMIC_ACQUIRE),
+                 spins = 0;
+
+        if (ZEND_STAT_ROUTE_EMPTY == state) {
+            if (__atomic_compare_exchange_n(
+                    &route->state,
+                    &state, ZEND_STAT_ROUTE_BUSY,
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                route->hash = hash;
+
+                strcpy(route->method, method);
+                strcpy(route->uri, uri);
+
+                __atomic_store_n(&route->state, ZEND_STAT_ROUTE_READY, __ATOMIC_RELEASE);
+
+                return route;
+            }
+        }
+
+        /* another request is claiming the route, it won't be long */
+        while ((ZEND_STAT_ROUTE_BUSY == state) && (++spins < ZEND_STAT_ROUTES_SPINS)) {
+            state = __atomic_load_n(&route->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (UNEXPECTED(ZEND_STAT_ROUTE_READY != state)) {
+            continue;
+        }
+
+        if ((route->hash == hash) &&
+            (SUCCESS == strcmp(route->uri, uri)) &&
+            (SUCCESS == strcmp(route->method, method))) {
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
+void zend_stat_routes_record(zend_stat_request_t *request, double duration) {
+    char method[ZEND_STAT_ROUTE_METHOD],
+         uri[ZEND_STAT_ROUTE_URI];
+    zend_stat_route_t *route;
+    uint64_t value, max;
+
+    if ((NULL == zend_stat_routes) || (NULL == request->uri)) {
+        return;
+    }
+
+    if (request->method) {
+        size_t length = MIN(request->method->length, ZEND_STAT_ROUTE_METHOD - 1);
+
+        memcpy(method, request->method->value, length);
+
+        method[length] = 0;
+    } else {
+        method[0] = 0;
+    }
+
+    zend_stat_route_normalize(request->uri, uri);
+
+    route = zend_stat_route_find(method, uri);
+
+    if (UNEXPECTED(NULL == route)) {
+        __atomic_add_fetch(&zend_stat_routes->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    value = (uint64_t) (MAX(duration, 0) * 1000000);
+
+    __atomic_add_fetch(&route->buckets[zend_stat_histogram_index(value)], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&route->max, __ATOMIC_RELAXED);
+
+    while ((value > max) &&
+           !__atomic_compare_exchange_n(
+                &route->max,
+                &max, value,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static double zend_stat_histogram_percentile(uint64_t *buckets, uint64_t total, double percentile) {
+    uint64_t rank = (uint64_t) ceil(percentile * total),
+             seen = 0;
+    uint32_t it;
+
+    rank = MAX(rank, 1);
+
+    for (it = 0; it < ZEND_STAT_HISTOGRAM_BUCKETS; it++) {
+        seen += buckets[it];
+
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    return zend_stat_histogram_value(MIN(it, ZEND_STAT_HISTOGRAM_BUCKETS - 1)) / 1000000;
+}
+
+zend_bool zend_stat_routes_write(zend_stat_io_buffer_t *iob) {
+    uint64_t buckets[ZEND_STAT_HISTOGRAM_BUCKETS];
+    zend_bool separate = 0;
+    zend_ulong it;
+
+    if (NULL == zend_stat_routes) {
+        return zend_stat_io_buffer_append(iob, "[]", sizeof("[]")-1);
+    }
+
+    if (!zend_stat_io_buffer_append(iob, "[", sizeof("[")-1)) {
+        return 0;
+    }
+
+    for (it = 0; it < zend_stat_routes->slots; it++) {
+        zend_stat_route_t *route = &zend_stat_routes->route[it];
+        uint64_t total = 0;
+        uint32_t bucket;
+
+        if (ZEND_STAT_ROUTE_READY != __atomic_load_n(&route->state, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        /* the percentiles are taken from a copy, so that they agree */
+        for (bucket = 0; bucket < ZEND_STAT_HISTOGRAM_BUCKETS; bucket++) {
+            buckets[bucket] = __atomic_load_n(&route->buckets[bucket], __ATOMIC_RELAXED);
+            total += buckets[bucket];
+        }
+
+        if (0 == total) {
+            continue;
+        }
+
+        if (!zend_stat_io_buffer_appendf(iob,
+                "%s{\"method\": \"%s\", \"uri\": \"%s\", \"count\": %" PRIu64 ", "
+                "\"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"p999\": %.6f, \"max\": %.6f}",
+                separate ? ", " : "",
+                route->method,
+                route->uri,
+                total,
+                zend_stat_histogram_percentile(buckets, total, 0.5),
+                zend_stat_histogram_percentile(buckets, total, 0.9),
+                zend_stat_histogram_percentile(buckets, total, 0.99),
+                zend_stat_histogram_percentile(buckets, total, 0.999),
+                (double) __atomic_load_n(&route->max, __ATOMIC_RELAXED) / 1000000)) {
+            return 0;
+        }
+
+        separate = 1;
+    }
+
+    return zend_stat_io_buffer_append(iob, "]", sizeof("]")-1);
+}
+
+uint64_t zend_stat_routes_dropped(void) {
+    if (NULL == zend_stat_routes) {
+        return 0;
+    }
+
+    return __atomic_load_n(&zend_stat_routes->dropped, __ATOMIC_RELAXED);
+}
+
+void zend_stat_routes_shutdown(void) {
+    if (UNEXPECTED(NULL == zend_stat_routes)) {
+        return;
+    }
+
+    zend_stat_unmap(zend_stat_routes,
+        zend_stat_routes_size(zend_stat_routes->slots));
+
+    zend_stat_routes = NULL;
+}
+#endif	/* ZEND_STAT_ROUTES */
@@ -0,0 +1,48 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_ROUTES_H
+# define ZEND_STAT_ROUTES_H
+
+#include "zend_stat_io.h"
+#include "zend_stat_request.h"
+
+#ifndef ZEND_STAT_ROUTES_SLOTS
+#   define ZEND_STAT_ROUTES_SLOTS 512
+#endif
+
+#ifndef ZEND_STAT_ROUTES_PROBES
+#   define ZEND_STAT_ROUTES_PROBES 64
+#endif
+
+#define ZEND_STAT_ROUTE_METHOD 16
+#define ZEND_STAT_ROUTE_URI    240
+
+/* Histograms are log-linear: every power of two is divided into sixteen
+    buckets, so that a value is recorded to within 1/16th of itself, values
+    are in microseconds, up to 2^36 */
+#define ZEND_STAT_HISTOGRAM_BITS    4
+#define ZEND_STAT_HISTOGRAM_SUB     (1 << ZEND_STAT_HISTOGRAM_BITS)
+#define ZEND_STAT_HISTOGRAM_BUCKETS (ZEND_STAT_HISTOGRAM_SUB * 33)
+
+zend_bool zend_stat_routes_startup(zend_long slots);
+void      zend_stat_routes_record(zend_stat_request_t *request, double duration);
+zend_bool zend_stat_routes_write(zend_stat_io_buffer_t *iob);
+uint64_t  zend_stat_routes_dropped(void);
+void      zend_stat_routes_shutdown(void);
+#endif	/* ZEND_STAT_ROUTES_H */
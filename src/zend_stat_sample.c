@@ -33,6 +33,9 @@ static zend_always_inline const char* zend_stat_sample_type_name(zend_uchar type
 
         case ZEND_STAT_SAMPLE_USER:
             return "user";
+
+        case ZEND_STAT_SAMPLE_SUMMARY:
+            return "summary";
     }
 
     return "unknown";
@@ -50,9 +53,13 @@ static zend_bool zend_stat_sample_write_type(zend_stat_io_buffer_t *iob, zend_uc
     return 1;
 }
 
+#define ZEND_STAT_SAMPLE_REQUEST_KEY(r) \
+    ((((uint64_t) (r)->generation) << 32) | (r)->id)
+
 static zend_bool zend_stat_sample_write_request(zend_stat_io_buffer_t *iob, zend_stat_request_t *request) {
     if (!zend_stat_io_buffer_appendf(iob,
-            ", \"request\": {\"pid\": %d, \"elapsed\": %.10f",
+            "{\"type\": \"request\", \"id\": %" PRIu64 ", \"pid\": %d, \"elapsed\": %.10f",
+            ZEND_STAT_SAMPLE_REQUEST_KEY(request),
             request->pid,
             request->elapsed)) {
         return 0;
@@ -82,13 +89,29 @@ static zend_bool zend_stat_sample_write_request(zend_stat_io_buffer_t *iob, zend
         }
     }
 
-    if (!zend_stat_io_buffer_append(iob, "}", sizeof("}")-1)) {
+    if (!zend_stat_io_buffer_append(iob, "}\n", sizeof("}\n")-1)) {
         return 0;
     }
 
     return 1;
 }
 
+static zend_bool zend_stat_sample_write_request_definition(zend_stat_io_buffer_t *iob, zend_stat_sample_request_t *id) {
+    zend_stat_request_t request;
+    zend_bool result;
+
+    if (!zend_stat_request_find(id->id, id->generation, &request)) {
+        /* The slot was reused, the request can no longer be described */
+        return 1;
+    }
+
+    result = zend_stat_sample_write_request(iob, &request);
+
+    zend_stat_request_release(&request);
+
+    return result;
+}
+
 static zend_bool zend_stat_sample_write_memory(zend_stat_io_buffer_t *iob, zend_stat_sample_memory_t *memory) {
     if (!zend_stat_io_buffer_appendf(iob, ", \"memory\": {\"used\": %d, \"peak\": %d}", memory->used, memory->peak)) {
         return 0;
@@ -152,6 +175,58 @@ static zend_bool zend_stat_sample_write_symbol(zend_stat_io_buffer_t *iob, char
     return 1;
 }
 
+static zend_bool zend_stat_sample_write_summary(zend_stat_io_buffer_t *iob, zend_stat_sample_t *sample) {
+    zend_stat_sample_summary_t *summary = ZEND_STAT_SAMPLE_SUMMARY_OF(sample);
+    uint32_t it;
+
+    if (UNEXPECTED(sample->extension.length < sizeof(zend_stat_sample_summary_t))) {
+        /* the summary did not survive the extension ring */
+        return 1;
+    }
+
+    if (!zend_stat_io_buffer_appendf(iob,
+            ", \"duration\": %.10f, \"samples\": %" PRIu64,
+            summary->duration, summary->samples)) {
+        return 0;
+    }
+
+    if (summary->cpu >= 0) {
+        if (!zend_stat_io_buffer_appendf(iob, ", \"cputime\": %.10f", summary->cpu)) {
+            return 0;
+        }
+    }
+
+    if (!zend_stat_io_buffer_append(iob, ", \"symbols\": [", sizeof(", \"symbols\": [")-1)) {
+        return 0;
+    }
+
+    for (it = 0; it < summary->symbols; it++) {
+        zend_stat_request_symbol_t *symbol = &summary->symbol[it];
+
+        if (!zend_stat_io_buffer_appendf(iob,
+                "%s{\"samples\": %" PRIu64,
+                it ? ", " : "", symbol->samples)) {
+            return 0;
+        }
+
+        if (symbol->scope) {
+            if (!zend_stat_io_buffer_append(iob, ", \"scope\": \"", sizeof(", \"scope\": \"")-1) ||
+                !zend_stat_io_buffer_appends(iob, symbol->scope) ||
+                !zend_stat_io_buffer_append(iob, "\"", sizeof("\"")-1)) {
+                return 0;
+            }
+        }
+
+        if (!zend_stat_io_buffer_append(iob, ", \"function\": \"", sizeof(", \"function\": \"")-1) ||
+            !zend_stat_io_buffer_appends(iob, symbol->function) ||
+            !zend_stat_io_buffer_append(iob, "\"}", sizeof("\"}")-1)) {
+            return 0;
+        }
+    }
+
+    return zend_stat_io_buffer_append(iob, "]", sizeof("]")-1);
+}
+
 static zend_bool zend_stat_sample_write_opline(zend_stat_io_buffer_t *iob, zend_stat_sample_opline_t *opline) {
     if (!opline->line &&
         !opline->offset &&
@@ -203,10 +278,101 @@ static zend_bool zend_stat_sample_write_opline(zend_stat_io_buffer_t *iob, zend_
     return 1;
 }
 
-zend_bool zend_stat_sample_write_arginfo(zend_stat_io_buffer_t *iob, zend_stat_sample_arginfo_t *arginfo) {
-    zval *it = arginfo->info,
-         *end = it + arginfo->length;
-    if (0 == arginfo->length) {
+static zend_bool zend_stat_sample_write_frame(zend_stat_io_buffer_t *iob, const zend_stat_stack_frame_t *frame) {
+    if (!zend_stat_io_buffer_append(iob, "{", sizeof("{")-1)) {
+        return 0;
+    }
+
+    if (frame->file) {
+        if (!zend_stat_io_buffer_append(iob, "\"file\": \"", sizeof("\"file\": \"")-1) ||
+            !zend_stat_io_buffer_appends(iob, frame->file) ||
+            !zend_stat_io_buffer_append(iob, "\", ", sizeof("\", ")-1)) {
+            return 0;
+        }
+    }
+
+    if (frame->scope) {
+        if (!zend_stat_io_buffer_append(iob, "\"scope\": \"", sizeof("\"scope\": \"")-1) ||
+            !zend_stat_io_buffer_appends(iob, frame->scope) ||
+            !zend_stat_io_buffer_append(iob, "\", ", sizeof("\", ")-1)) {
+            return 0;
+        }
+    }
+
+    if (frame->function) {
+        if (!zend_stat_io_buffer_append(iob, "\"function\": \"", sizeof("\"function\": \"")-1) ||
+            !zend_stat_io_buffer_appends(iob, frame->function) ||
+            !zend_stat_io_buffer_append(iob, "\", ", sizeof("\", ")-1)) {
+            return 0;
+        }
+    }
+
+    if (!zend_stat_io_buffer_appendf(iob, "\"line\": %d}", frame->line)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static zend_bool zend_stat_sample_write_stack_definition(zend_stat_io_buffer_t *iob, uint32_t id) {
+    const zend_stat_stack_t *stack = zend_stat_stack_find(id);
+    const uint32_t *frame, *end;
+
+    if (UNEXPECTED(NULL == stack)) {
+        return 1;
+    }
+
+    if (!zend_stat_io_buffer_appendf(iob, "{\"type\": \"stack\", \"id\": %u, \"frames\": [", id)) {
+        return 0;
+    }
+
+    frame = stack->frames;
+    end   = frame + stack->depth;
+
+    while (frame < end) {
+        const zend_stat_stack_frame_t *interned =
+            zend_stat_stack_frame_find(*frame);
+
+        if (UNEXPECTED(NULL == interned)) {
+            return 0;
+        }
+
+        if (!zend_stat_sample_write_frame(iob, interned)) {
+            return 0;
+        }
+
+        frame++;
+
+        if (frame < end) {
+            if (!zend_stat_io_buffer_append(iob, ",", sizeof(",")-1)) {
+                return 0;
+            }
+        }
+    }
+
+    if (!zend_stat_io_buffer_append(iob, "]}\n", sizeof("]}\n")-1)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static zend_bool zend_stat_sample_write_stack(zend_stat_io_buffer_t *iob, uint32_t stack) {
+    if (0 == stack) {
+        return 1;
+    }
+
+    if (!zend_stat_io_buffer_appendf(iob, ", \"stack\": %u", stack)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+zend_bool zend_stat_sample_write_arginfo(zend_stat_io_buffer_t *iob, zval *arginfo, uint32_t length) {
+    zval *it = arginfo,
+         *end = it + length;
+    if (0 == length) {
         return 1;
     }
 
@@ -299,13 +465,65 @@ zend_bool zend_stat_sample_write_arginfo(zend_stat_io_buffer_t *iob, zend_stat_s
     return 1;
 }
 
-zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd) {
+zend_stat_sample_defined_t* zend_stat_sample_defined_create(void) {
+    zend_stat_sample_defined_t *defined =
+        calloc(1, sizeof(zend_stat_sample_defined_t));
+
+    if (UNEXPECTED(NULL == defined)) {
+        return NULL;
+    }
+
+    defined->stacks =
+        calloc(zend_bitset_len(ZEND_STAT_STACKS_SLOTS), ZEND_BITSET_ELM_SIZE);
+    defined->requests =
+        calloc(zend_stat_requests_slots(), sizeof(uint32_t));
+
+    if (UNEXPECTED((NULL == defined->stacks) || (NULL == defined->requests))) {
+        zend_stat_sample_defined_destroy(defined);
+        return NULL;
+    }
+
+    return defined;
+}
+
+void zend_stat_sample_defined_destroy(zend_stat_sample_defined_t *defined) {
+    if (defined->stacks) {
+        free(defined->stacks);
+    }
+
+    if (defined->requests) {
+        free(defined->requests);
+    }
+
+    free(defined);
+}
+
+zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd, zend_stat_sample_defined_t *defined) {
     zend_stat_io_buffer_t iob;
 
     if (!zend_stat_io_buffer_alloc(&iob, 8192)) {
         goto _zend_stat_sample_write_abort;
     }
 
+    /* Each request is defined once for each consumer, before the first sample that refers to it */
+    if (sample->request.generation &&
+        (defined->requests[sample->request.id] != sample->request.generation)) {
+        if (!zend_stat_sample_write_request_definition(&iob, &sample->request)) {
+            goto _zend_stat_sample_write_abort;
+        }
+
+        defined->requests[sample->request.id] = sample->request.generation;
+    }
+
+    /* Each stack is defined once for each consumer, before the first sample that uses it */
+    if (sample->stack && !zend_bitset_in(defined->stacks, sample->stack - 1)) {
+        if (!zend_stat_sample_write_stack_definition(&iob, sample->stack)) {
+            goto _zend_stat_sample_write_abort;
+        }
+
+        zend_bitset_incl(defined->stacks, sample->stack - 1);
+    }
+
     if (!zend_stat_io_buffer_append(&iob, "{", sizeof("{")-1)) {
         goto _zend_stat_sample_write_abort;
     }
@@ -314,8 +532,12 @@ zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd) {
         goto _zend_stat_sample_write_abort;
     }
 
-    if (!zend_stat_sample_write_request(&iob, &sample->request)) {
-        goto _zend_stat_sample_write_abort;
+    if (sample->request.generation) {
+        if (!zend_stat_io_buffer_appendf(&iob,
+                ", \"request\": %" PRIu64,
+                ZEND_STAT_SAMPLE_REQUEST_KEY(&sample->request))) {
+            goto _zend_stat_sample_write_abort;
+        }
     }
 
     if (!zend_stat_io_buffer_appendf(&iob, ", \"elapsed\": %.10f", sample->elapsed)) {
@@ -326,6 +548,40 @@ zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd) {
         goto _zend_stat_sample_write_abort;
     }
 
+    if (sample->type == ZEND_STAT_SAMPLE_SUMMARY) {
+        if (!zend_stat_sample_write_summary(&iob, sample) ||
+            !zend_stat_io_buffer_append(&iob, "}\n", sizeof("}\n")-1)) {
+            goto _zend_stat_sample_write_abort;
+        }
+        goto _zend_stat_sample_write_flush;
+    }
+
+    if (!zend_stat_io_buffer_appendf(&iob, ", \"syscalls\": %u", sample->syscalls)) {
+        goto _zend_stat_sample_write_abort;
+    }
+
+    if (!zend_stat_io_buffer_appendf(&iob,
+            ", \"weight\": %u, \"lag\": %" PRIu64,
+            sample->weight, sample->lag)) {
+        goto _zend_stat_sample_write_abort;
+    }
+
+    if (sample->cpu != ZEND_STAT_SAMPLE_CPU_UNKNOWN) {
+        if (!zend_stat_io_buffer_appendf(&iob,
+                ", \"cpu\": %s",
+                sample->cpu == ZEND_STAT_SAMPLE_CPU_ON ? "true" : "false")) {
+            goto _zend_stat_sample_write_abort;
+        }
+    }
+
+    if (sample->task.state) {
+        if (!zend_stat_io_buffer_appendf(&iob,
+                ", \"state\": \"%c\", \"syscall\": %d",
+                sample->task.state, sample->task.syscall)) {
+            goto _zend_stat_sample_write_abort;
+        }
+    }
+
     if (sample->type == ZEND_STAT_SAMPLE_MEMORY) {
         if (!zend_stat_io_buffer_append(&iob, "}\n", sizeof("}\n")-1)) {
             goto _zend_stat_sample_write_abort;
@@ -337,7 +593,13 @@ zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd) {
         goto _zend_stat_sample_write_abort;
     }
 
-    if (!zend_stat_sample_write_arginfo(&iob, &sample->arginfo)) {
+    if (!zend_stat_sample_write_arginfo(&iob,
+            ZEND_STAT_SAMPLE_ARGINFO(sample),
+            ZEND_STAT_SAMPLE_ARGINFO_LENGTH(sample))) {
+        goto _zend_stat_sample_write_abort;
+    }
+
+    if (!zend_stat_sample_write_stack(&iob, sample->stack)) {
         goto _zend_stat_sample_write_abort;
     }
 
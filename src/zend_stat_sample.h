@@ -19,6 +19,8 @@
 #ifndef ZEND_STAT_SAMPLE_H
 # define ZEND_STAT_SAMPLE_H
 
+#include "zend_bitset.h"
+
 #include "zend_stat_strings.h"
 #include "zend_stat_request.h"
 
@@ -26,11 +28,6 @@
 #   define ZEND_STAT_SAMPLE_MAX_ARGINFO 12
 #endif
 
-typedef struct _zend_stat_sample_state_t {
-    zend_bool                busy;
-    zend_bool                used;
-} zend_stat_sample_state_t;
-
 typedef struct _zend_stat_sample_memory_t {
     size_t used;
     size_t peak;
@@ -48,45 +45,113 @@ typedef struct _zend_stat_sample_opline_t {
     zend_uchar           opcode;
 } zend_stat_sample_opline_t;
 
-typedef struct _zend_stat_sample_arginfo_t {
+typedef struct _zend_stat_sample_task_t {
+    char                 state;
+    int32_t              syscall;
+} zend_stat_sample_task_t;
+
+typedef struct _zend_stat_sample_request_t {
+    uint32_t             id;
+    uint32_t             generation;
+} zend_stat_sample_request_t;
+
+typedef struct _zend_stat_sample_extension_t {
+    uint32_t             position;
     uint32_t             length;
-    zval                 info[ZEND_STAT_SAMPLE_MAX_ARGINFO];
-} zend_stat_sample_arginfo_t;
+} zend_stat_sample_extension_t;
 
+/* A sample is a fixed header, aligned to cache lines so that inserting a
+    sample touches no more lines than it must, followed by extensions of
+    variable length that are only present when enabled: the buffer keeps
+    extensions apart from headers, in a ring of bytes of their own */
 typedef struct _zend_stat_sample_t {
-    zend_stat_sample_state_t  state;
-    zend_uchar                type;
-    zend_stat_request_t       request;
+    uint64_t                  sequence;
     double                    elapsed;
+    uint64_t                  lag;
     zend_stat_sample_memory_t memory;
+    zend_stat_sample_request_t request;
+    zend_stat_sample_symbol_t symbol;
     union {
         zend_stat_sample_opline_t opline;
         zend_stat_sample_symbol_t caller;
     } location;
-    zend_stat_sample_symbol_t symbol;
-    zend_stat_sample_arginfo_t arginfo;
-} zend_stat_sample_t;
+    uint32_t                  syscalls;
+    uint32_t                  weight;
+    uint32_t                  stack;
+    zend_stat_sample_task_t   task;
+    zend_uchar                type;
+    zend_uchar                cpu;
+    zend_stat_sample_extension_t extension;
+} ZEND_STAT_CACHELINE_ALIGNED zend_stat_sample_t;
+
+/* A sample and the room for its extensions, as built by a sampler and as
+    copied out of the buffer by a consumer */
+typedef struct _zend_stat_sample_extended_t {
+    zend_stat_sample_t        sample;
+    zval                      arginfo[ZEND_STAT_SAMPLE_MAX_ARGINFO];
+} zend_stat_sample_extended_t;
+
+#define ZEND_STAT_SAMPLE_EXTENSION(s) \
+    ((char*) (((zend_stat_sample_extended_t*) (s))->arginfo))
+#define ZEND_STAT_SAMPLE_EXTENSION_MAX \
+    (sizeof(zval) * ZEND_STAT_SAMPLE_MAX_ARGINFO)
+#define ZEND_STAT_SAMPLE_ARGINFO(s) \
+    (((zend_stat_sample_extended_t*) (s))->arginfo)
+#define ZEND_STAT_SAMPLE_ARGINFO_LENGTH(s) \
+    ((s)->extension.length / sizeof(zval))
+
+/* A summary is written once as a request ends, in the room of the arginfo */
+typedef struct _zend_stat_sample_summary_t {
+    double                     duration;
+    double                     cpu;
+    uint64_t                   samples;
+    uint32_t                   symbols;
+    zend_stat_request_symbol_t symbol[ZEND_STAT_REQUEST_SYMBOLS];
+} zend_stat_sample_summary_t;
+
+#define ZEND_STAT_SAMPLE_SUMMARY_OF(s) \
+    ((zend_stat_sample_summary_t*) ZEND_STAT_SAMPLE_EXTENSION(s))
+
+/* The stacks and requests already defined for a consumer */
+typedef struct _zend_stat_sample_defined_t {
+    zend_bitset  stacks;
+    uint32_t    *requests;
+} zend_stat_sample_defined_t;
 
 #define ZEND_STAT_SAMPLE_UNUSED   0
 #define ZEND_STAT_SAMPLE_MEMORY   1
 #define ZEND_STAT_SAMPLE_INTERNAL 2
 #define ZEND_STAT_SAMPLE_USER     4
+#define ZEND_STAT_SAMPLE_SUMMARY  8
+
+#define ZEND_STAT_SAMPLE_CPU_UNKNOWN 0
+#define ZEND_STAT_SAMPLE_CPU_ON      1
+#define ZEND_STAT_SAMPLE_CPU_OFF     2
 
 #define ZEND_STAT_SAMPLE_DATA(s) \
-    (((char*) s) + XtOffsetOf(zend_stat_sample_t, type))
+    (((char*) s) + XtOffsetOf(zend_stat_sample_t, elapsed))
 #define ZEND_STAT_SAMPLE_DATA_SIZE \
-    (sizeof(zend_stat_sample_t) - XtOffsetOf(zend_stat_sample_t, type))
+    (sizeof(zend_stat_sample_t) - XtOffsetOf(zend_stat_sample_t, elapsed))
 
 const static zend_stat_sample_t zend_stat_sample_empty = {
     .type = ZEND_STAT_SAMPLE_UNUSED,
-    .state = {0, 0},
-    .request = {0},
+    .sequence = 0,
+    .request = {0, 0},
     .elapsed = 0.0,
     .memory = {0, 0},
+    .syscalls = 0,
+    .weight = 1,
+    .lag = 0,
+    .cpu = ZEND_STAT_SAMPLE_CPU_UNKNOWN,
+    .task = {0, -1},
     .location = {{0}},
     .symbol = {NULL, NULL, NULL},
-    .arginfo.length = 0
+    .stack = 0,
+    .extension = {0, 0}
 };
 
-zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd);
+zend_stat_sample_defined_t* zend_stat_sample_defined_create(void);
+void zend_stat_sample_defined_destroy(zend_stat_sample_defined_t *defined);
+
+zend_bool zend_stat_sample_write(zend_stat_sample_t *sample, int fd, zend_stat_sample_defined_t *defined);
 #endif
@@ -22,14 +22,37 @@
 #include "zend_stat_buffer.h"
 #include "zend_stat_sampler.h"
 
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "zend_stat_agent.h"
+#include "zend_stat_routes.h"
+
 static zend_bool               zend_stat_sampler_auto = 1;
 static zend_long               zend_stat_sampler_interval = 0;
 static zend_long               zend_stat_sampler_count = 0;
 static zend_long               zend_stat_sampler_limit = 0;
 static zend_bool               zend_stat_sampler_arginfo = 0;
+static uint32_t                zend_stat_sampler_depth = 0;
+static uint32_t                zend_stat_sampler_jitter = 0;
+static zend_long               zend_stat_sampler_adaptive = 0;
+static zend_long               zend_stat_sampler_cpu = ZEND_STAT_CPU_OFF;
+static zend_long               zend_stat_sampler_proc = 0;
+static zend_bool               zend_stat_sampler_persistent = 0;
+static zend_bool               zend_stat_sampler_agent = 0;
 
 static   zend_stat_buffer_t*   zend_stat_sampler_buffer;
 ZEND_TLS zend_stat_request_t   zend_stat_sampler_request;
+ZEND_TLS zend_stat_request_summary_t zend_stat_sampler_summary;
+ZEND_TLS double                zend_stat_sampler_rusage;
+ZEND_TLS double                zend_stat_sampler_restart_checked;
+
+/* While a restart is pending, opcache is asked at most this often (seconds) */
+#ifndef ZEND_STAT_SAMPLER_RESTART_CHECK
+#   define ZEND_STAT_SAMPLER_RESTART_CHECK 1
+#endif
 
 typedef struct _zend_heap_header_t {
     int custom;
@@ -38,25 +61,119 @@ typedef struct _zend_heap_header_t {
     size_t peak;
 } zend_heap_header_t;
 
-typedef struct _zend_stat_sampler_t {
+/* The caches belong to the process (or thread) rather than the request, they
+    are only valid for the pid and generation they were filled in, and are
+    bypassed while an opcache restart is pending */
+typedef struct _zend_stat_sampler_cache_t {
+    zend_bool           initialized;
+    zend_bool           bypass;
+    pid_t               pid;
+    zend_ulong          generation;
+    HashTable           strings;
+    HashTable           symbols;
+} zend_stat_sampler_cache_t;
+
+struct _zend_stat_sampler_t {
     zend_stat_request_t *request;
+    zend_stat_request_summary_t *summary;
     zend_stat_buffer_t  *buffer;
+    zend_stat_buffer_shard_t *shard;
     struct zend_stat_sampler_timer_t {
         pthread_mutex_t mutex;
         pthread_cond_t  cond;
         zend_bool       closed;
         zend_bool       active;
+        zend_bool       parked;
+        zend_bool       persistent;
         pthread_t       thread;
     } timer;
-    struct {
-        HashTable       strings;
-        HashTable       symbols;
-    } cache;
+    zend_stat_sampler_cache_t *cache;
     zend_heap_header_t *heap;
     zend_execute_data  *fp;
-} zend_stat_sampler_t;
+    uint32_t            syscalls;
+    zend_stat_sampler_clock_t clock;
+    struct zend_stat_sampler_cpu_t {
+        clockid_t       id;
+        zend_bool       available;
+        pid_t           pid;
+        uint64_t        last;
+        uint64_t        wall;
+        uint64_t        budget;
+    } cpu;
+    struct zend_stat_sampler_proc_t {
+        pid_t           pid;
+        pid_t           tid;
+        int             stat;
+        int             syscall;
+        zend_ulong      tick;
+    } proc;
+    zend_long           agent;
+};
+
+#ifndef ZEND_STAT_SAMPLER_PLAN_MAX
+#   define ZEND_STAT_SAMPLER_PLAN_MAX 16
+#endif
+
+#ifndef ZEND_STAT_SAMPLER_STRINGS_MAX
+#   define ZEND_STAT_SAMPLER_STRINGS_MAX 4
+#endif
+
+#ifndef ZEND_STAT_SAMPLER_STRING_SPECULATE
+#   define ZEND_STAT_SAMPLER_STRING_SPECULATE 128
+#endif
+
+typedef struct _zend_stat_sampler_plan_t {
+    struct iovec local[ZEND_STAT_SAMPLER_PLAN_MAX];
+    struct iovec remote[ZEND_STAT_SAMPLER_PLAN_MAX];
+    int          count;
+} zend_stat_sampler_plan_t;
+
+typedef struct _zend_stat_sampler_string_t {
+    zend_string         *remote;
+    zend_stat_string_t **result;
+    int                  entry;
+    union {
+        zend_string      string;
+        char             bytes[_ZSTR_STRUCT_SIZE(ZEND_STAT_SAMPLER_STRING_SPECULATE)];
+    } buffer;
+} zend_stat_sampler_string_t;
+
+typedef struct _zend_stat_sampler_strings_t {
+    int                        count;
+    zend_stat_sampler_string_t strings[ZEND_STAT_SAMPLER_STRINGS_MAX];
+} zend_stat_sampler_strings_t;
+
+typedef struct _zend_stat_sampler_frame_t {
+    zend_function      *func;
+    const zend_op      *opline;
+    zend_execute_data  *prev;
+    uint32_t            args;
+} zend_stat_sampler_frame_t;
+
+typedef struct _zend_stat_sampler_stack_t {
+    uint32_t                 depth;
+    zend_stat_stack_frame_t  frames[ZEND_STAT_DEPTH_MAX];
+} zend_stat_sampler_stack_t;
+
+/* The fields of a remote function, as read */
+typedef struct _zend_stat_sampler_symbol_t {
+    zend_uchar          type;
+    uint32_t            flags;
+    zend_class_entry   *scope;
+    zend_string        *function;
+    zend_string        *file;
+    zend_op            *opcodes;
+} zend_stat_sampler_symbol_t;
+
+/* The fields of a remote function, as resolved */
+typedef struct _zend_stat_sampler_function_t {
+    zend_uchar                type;
+    const zend_op            *opcodes;
+    zend_stat_sample_symbol_t symbol;
+} zend_stat_sampler_function_t;
 
 ZEND_TLS zend_stat_sampler_t __sampler;
+ZEND_TLS zend_stat_sampler_cache_t __cache;
 
 #define ZEND_STAT_SAMPLER_RESET() \
     memset(&__sampler, 0, sizeof(zend_stat_sampler_t))
@@ -84,6 +201,40 @@ static zend_always_inline zend_bool zend_stat_sampler_arginfo_get() {
     return __atomic_load_n(&zend_stat_sampler_arginfo, __ATOMIC_SEQ_CST);
 }
 
+void zend_stat_sampler_depth_set(zend_long depth) {
+    if (!zend_stat_stacks_enabled()) {
+        /* the stack tables are not mapped */
+        depth = 0;
+    }
+
+    __atomic_store_n(&zend_stat_sampler_depth, MIN(MAX(depth, 0), ZEND_STAT_DEPTH_MAX), __ATOMIC_SEQ_CST);
+}
+
+static zend_always_inline uint32_t zend_stat_sampler_depth_get() {
+    return __atomic_load_n(&zend_stat_sampler_depth, __ATOMIC_SEQ_CST);
+}
+
+void zend_stat_sampler_jitter_set(zend_long jitter) {
+    __atomic_store_n(&zend_stat_sampler_jitter, MIN(MAX(jitter, 0), ZEND_STAT_JITTER_MAX), __ATOMIC_SEQ_CST);
+}
+
+static zend_always_inline uint32_t zend_stat_sampler_jitter_get() {
+    return __atomic_load_n(&zend_stat_sampler_jitter, __ATOMIC_SEQ_CST);
+}
+
+static zend_always_inline uint64_t zend_stat_sampler_random(uint64_t *seed) {
+    /* xorshift64*, the state is owned by the calling thread */
+    uint64_t x = *seed ? *seed : 0x9E3779B97F4A7C15ULL;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    *seed = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
 void zend_stat_sampler_interval_set(zend_long interval) {
     __atomic_store_n(&zend_stat_sampler_interval, interval * 1000, __ATOMIC_SEQ_CST);
 }
@@ -92,6 +243,77 @@ zend_long zend_stat_sampler_interval_get() {
     return __atomic_load_n(&zend_stat_sampler_interval, __ATOMIC_SEQ_CST);
 }
 
+static zend_always_inline uint64_t zend_stat_sampler_now(void) { /* {{{ */
+    struct timespec clk;
+
+    if (UNEXPECTED(clock_gettime(CLOCK_MONOTONIC, &clk) != SUCCESS)) {
+        return 0;
+    }
+
+    return ((uint64_t) clk.tv_sec * 1000000000L) + clk.tv_nsec;
+} /* }}} */
+
+zend_bool zend_stat_sampler_clock_start(zend_stat_sampler_clock_t *clock, uint64_t seed) { /* {{{ */
+    clock->deadline = zend_stat_sampler_now();
+    clock->seed     = clock->deadline ^ seed;
+    clock->weight   = 1;
+
+    return clock->deadline > 0;
+} /* }}} */
+
+uint64_t zend_stat_sampler_clock_next(zend_stat_sampler_clock_t *clock) { /* {{{ */
+    /* Deadlines advance from the previous deadline, not from the time the
+        previous sample was taken, so that time spent sampling does not
+        accumulate as drift.
+
+       The mean interval is the configured interval scaled by the pressure on
+        the buffer, with jitter each interval is drawn uniformly from the mean
+        plus or minus jitter percent of it */
+    uint64_t interval = zend_stat_sampler_interval_get(),
+             jitter   = zend_stat_sampler_jitter_get(),
+             spread;
+    uint32_t scale = 0;
+
+    if (zend_stat_sampler_adaptive > interval) {
+        scale = zend_stat_buffer_scale(zend_stat_sampler_buffer);
+
+        while (scale && ((interval << scale) > (uint64_t) zend_stat_sampler_adaptive)) {
+            scale--;
+        }
+    }
+
+    clock->interval = interval << scale;
+    clock->scale    = scale;
+
+    spread = (clock->interval * jitter) / 100;
+
+    if (EXPECTED(0 == spread)) {
+        return clock->deadline += clock->interval;
+    }
+
+    return clock->deadline +=
+        (clock->interval - spread) +
+            (zend_stat_sampler_random(&clock->seed) % ((spread * 2) + 1));
+} /* }}} */
+
+void zend_stat_sampler_clock_tick(zend_stat_sampler_clock_t *clock) { /* {{{ */
+    /* When the sampler oversleeps, the deadlines it missed are skipped
+        rather than sampled in a burst, and the sample taken carries their
+        weight, in units of the configured interval */
+    uint64_t now = zend_stat_sampler_now(),
+             missed = 0;
+
+    if (EXPECTED(now > clock->deadline && clock->interval > 0)) {
+        missed = (now - clock->deadline) / clock->interval;
+    }
+
+    clock->deadline += missed * clock->interval;
+
+    missed = (1 + missed) << clock->scale;
+
+    clock->weight = missed > UINT32_MAX ? UINT32_MAX : missed;
+} /* }}} */
+
 void zend_stat_sampler_limit_set(zend_long limit) {
     __atomic_store_n(&zend_stat_sampler_limit, limit, __ATOMIC_SEQ_CST);
 }
@@ -143,6 +365,8 @@ static zend_always_inline int zend_stat_sampler_read(zend_stat_sampler_t *sample
     target.iov_base = (void*) remote;
     target.iov_len = size;
 
+    sampler->syscalls++;
+
     if (process_vm_readv(sampler->request->pid, &local, 1, &target, 1, 0) != size) {
         return FAILURE;
     }
@@ -150,37 +374,74 @@ static zend_always_inline int zend_stat_sampler_read(zend_stat_sampler_t *sample
     return SUCCESS;
 } /* }}} */
 
-static zend_always_inline int zend_stat_sampler_read_symbol(zend_stat_sampler_t *sampler, const zend_function *remote, zend_function *local) { /* {{{ */
-    zend_function *cache;
+/* {{{ A plan gathers every read that does not depend on another read in
+    the same plan, so that each level of the sample costs one syscall */
+static zend_always_inline void zend_stat_sampler_plan_init(zend_stat_sampler_plan_t *plan) {
+    plan->count = 0;
+}
+
+static zend_always_inline int zend_stat_sampler_plan_add(zend_stat_sampler_plan_t *plan, const void *remote, void *local, size_t size) {
+    ZEND_ASSERT(plan->count < ZEND_STAT_SAMPLER_PLAN_MAX);
+
+    plan->local[plan->count].iov_base  = local;
+    plan->local[plan->count].iov_len   = size;
+    plan->remote[plan->count].iov_base = (void*) remote;
+    plan->remote[plan->count].iov_len  = size;
+
+    return plan->count++;
+}
 
-    if (EXPECTED(cache = zend_hash_index_find_ptr(&sampler->cache.symbols, (zend_ulong) remote))) {
-        return memcpy(local, cache, sizeof(zend_function)) == local ? SUCCESS : FAILURE;
+/* Returns the number of leading entries in the plan that were read in full:
+    the kernel stops transferring at the first remote vector it cannot read,
+    so the caller orders entries from most to least important */
+static zend_always_inline int zend_stat_sampler_plan_read(zend_stat_sampler_t *sampler, zend_stat_sampler_plan_t *plan) {
+    ssize_t read;
+    int complete = 0;
+
+    if (UNEXPECTED(0 == plan->count)) {
+        return 0;
     }
 
-    if (UNEXPECTED(zend_stat_sampler_read(sampler, remote, local, sizeof(zend_function)) != SUCCESS)) {
-        return FAILURE;
+    sampler->syscalls++;
+
+    read = process_vm_readv(
+                sampler->request->pid,
+                plan->local, plan->count,
+                plan->remote, plan->count, 0);
+
+    if (UNEXPECTED(read <= 0)) {
+        return 0;
     }
 
-    if (
-        (local->type == ZEND_INTERNAL_FUNCTION)
-#ifdef ZEND_ACC_IMMUTABLE
-        || (local->common.fn_flags & ZEND_ACC_IMMUTABLE)
-#endif
-    ) {
-        zend_hash_index_add_mem(
-            &sampler->cache.symbols,
-            (zend_ulong) remote,
-            local, sizeof(zend_function));
+    while ((complete < plan->count) &&
+           ((size_t) read >= plan->local[complete].iov_len)) {
+        read -= plan->local[complete].iov_len;
+        complete++;
     }
 
-    return SUCCESS;
+    return complete;
+} /* }}} */
+
+static zend_always_inline zend_stat_string_t* zend_stat_sampler_string_intern(zend_stat_sampler_t *sampler, const zend_string *remote, zend_string *local) { /* {{{ */
+    /* the local copy is consumed by interning */
+    zend_bool permanent = GC_FLAGS(local) & IS_STR_PERMANENT;
+    zend_stat_string_t *string = zend_stat_string(local);
+
+    if (EXPECTED(string && permanent && !sampler->cache->bypass)) {
+        zend_hash_index_add_ptr(
+            &sampler->cache->strings,
+            (zend_ulong) remote, string);
+    }
+
+    return string;
 } /* }}} */
 
 static zend_always_inline zend_stat_string_t* zend_stat_sampler_read_string(zend_stat_sampler_t *sampler, zend_string *string) { /* {{{ */
     zend_string *result;
     size_t length;
 
-    if (EXPECTED((result = zend_hash_index_find_ptr(&sampler->cache.strings, (zend_ulong) string)))) {
+    if (EXPECTED(!sampler->cache->bypass) &&
+        EXPECTED((result = zend_hash_index_find_ptr(&sampler->cache->strings, (zend_ulong) string)))) {
         return (zend_stat_string_t*) result;
     }
 
@@ -199,31 +460,326 @@ static zend_always_inline zend_stat_string_t* zend_stat_sampler_read_string(zend
         return NULL;
     }
 
-    if (EXPECTED(GC_FLAGS(result) & IS_STR_PERMANENT)) {
-        return zend_hash_index_add_ptr(
-            &sampler->cache.strings,
-            (zend_ulong) string, zend_stat_string(result));
+    return zend_stat_sampler_string_intern(sampler, string, result);
+} /* }}} */
+
+/* {{{ Strings are read speculatively: a fixed size read of header and value
+    together covers almost every file, class and function name, anything
+    longer (or any read that failed) falls back to reading length then value */
+static zend_always_inline void zend_stat_sampler_strings_init(zend_stat_sampler_strings_t *strings) {
+    strings->count = 0;
+}
+
+static zend_always_inline void zend_stat_sampler_strings_add(zend_stat_sampler_t *sampler, zend_stat_sampler_strings_t *strings, zend_stat_sampler_plan_t *plan, zend_string *remote, zend_stat_string_t **result) {
+    zend_stat_sampler_string_t *string;
+
+    if (UNEXPECTED(NULL == remote)) {
+        *result = NULL;
+        return;
     }
 
-    return zend_stat_string(result);
+    if (EXPECTED(!sampler->cache->bypass) &&
+        EXPECTED((*result = zend_hash_index_find_ptr(&sampler->cache->strings, (zend_ulong) remote)))) {
+        return;
+    }
+
+    ZEND_ASSERT(strings->count < ZEND_STAT_SAMPLER_STRINGS_MAX);
+
+    string = &strings->strings[strings->count++];
+    string->remote = remote;
+    string->result = result;
+    string->entry  =
+        zend_stat_sampler_plan_add(plan,
+            remote, &string->buffer, sizeof(string->buffer));
+}
+
+static zend_always_inline void zend_stat_sampler_strings_finish(zend_stat_sampler_t *sampler, zend_stat_sampler_strings_t *strings, int complete) {
+    zend_stat_sampler_string_t *string = strings->strings,
+                               *end    = string + strings->count;
+
+    while (string < end) {
+        size_t length = ZSTR_LEN(&string->buffer.string);
+
+        if (EXPECTED((string->entry < complete) &&
+                (_ZSTR_STRUCT_SIZE(length) <= sizeof(string->buffer)))) {
+            zend_string *local = zend_string_alloc(length, 1);
+
+            memcpy(local, &string->buffer, _ZSTR_STRUCT_SIZE(length));
+
+            *string->result =
+                zend_stat_sampler_string_intern(
+                    sampler, string->remote, local);
+        } else {
+            *string->result =
+                zend_stat_sampler_read_string(
+                    sampler, string->remote);
+        }
+
+        string++;
+    }
 } /* }}} */
 
-static zend_always_inline zend_stat_string_t* zend_stat_sampler_read_string_at(zend_stat_sampler_t *sampler, const void *symbol, size_t offset) { /* {{{ */
-    zend_string *string;
+/* {{{ */
+static zend_always_inline void zend_stat_sampler_frame_plan(zend_stat_sampler_plan_t *plan, const zend_execute_data *remote, zend_stat_sampler_frame_t *frame) {
+    memset(frame, 0, sizeof(zend_stat_sampler_frame_t));
+
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_execute_data, remote, func),
+        &frame->func, sizeof(zend_function*));
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_execute_data, remote, opline),
+        &frame->opline, sizeof(zend_op*));
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_execute_data, remote, prev_execute_data),
+        &frame->prev, sizeof(zend_execute_data*));
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_execute_data, remote, This.u2.num_args),
+        &frame->args, sizeof(uint32_t));
+}
 
-    /* Failure to read indicates the string, or symbol which contains the string, was freed:
-        all of file, class, and function names should not fail since they
-        cannot normally be freed during a request.
-       Currently stat doesn't read any other strings ...
-    */
+static zend_always_inline int zend_stat_sampler_read_frame(zend_stat_sampler_t *sampler, const zend_execute_data *remote, zend_stat_sampler_frame_t *frame) {
+    zend_stat_sampler_plan_t plan;
 
-    if (UNEXPECTED(zend_stat_sampler_read(sampler,
-            ZEND_STAT_ADDRESS_OFFSET(symbol, offset),
-            &string, sizeof(zend_string*)) != SUCCESS)) {
-        return NULL;
+    zend_stat_sampler_plan_init(&plan);
+    zend_stat_sampler_frame_plan(&plan, remote, frame);
+
+    if (UNEXPECTED(zend_stat_sampler_plan_read(sampler, &plan) != plan.count)) {
+        return FAILURE;
     }
 
-    return zend_stat_sampler_read_string(sampler, string);
+    if (UNEXPECTED(NULL == frame->func)) {
+        return FAILURE;
+    }
+
+    return SUCCESS;
+} /* }}} */
+
+/* {{{ Functions are resolved to a type and symbol, internal and immutable
+    functions are cached by address once resolved */
+static zend_always_inline zend_bool zend_stat_sampler_function_find(zend_stat_sampler_t *sampler, const zend_function *remote, zend_stat_sampler_function_t *function) {
+    zend_stat_sampler_function_t *cache;
+    zend_stat_symbol_t shared;
+
+    if (UNEXPECTED(sampler->cache->bypass)) {
+        return 0;
+    }
+
+    if (EXPECTED(cache = zend_hash_index_find_ptr(&sampler->cache->symbols, (zend_ulong) remote))) {
+        memcpy(function, cache, sizeof(zend_stat_sampler_function_t));
+        return 1;
+    }
+
+    /* Another process may have resolved the function already */
+    if (zend_stat_symbol_find(remote, &shared)) {
+        function->type            = shared.type;
+        function->opcodes         = shared.opcodes;
+        function->symbol.file     = shared.file;
+        function->symbol.scope    = shared.scope;
+        function->symbol.function = shared.function;
+
+        zend_hash_index_add_mem(
+            &sampler->cache->symbols,
+            (zend_ulong) remote,
+            function, sizeof(zend_stat_sampler_function_t));
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Adds the reads for the fields of remote to plan, the return value is the
+    number of entries that must be complete for an internal function, a user
+    function requires every entry returned in user */
+static zend_always_inline int zend_stat_sampler_function_plan(zend_stat_sampler_plan_t *plan, const zend_function *remote, zend_stat_sampler_symbol_t *symbol, int *user) {
+    int internal;
+
+    memset(symbol, 0, sizeof(zend_stat_sampler_symbol_t));
+
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_function, remote, type),
+        &symbol->type, sizeof(zend_uchar));
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_function, remote, common.fn_flags),
+        &symbol->flags, sizeof(uint32_t));
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_function, remote, common.scope),
+        &symbol->scope, sizeof(zend_class_entry*));
+    internal = zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_function, remote, common.function_name),
+        &symbol->function, sizeof(zend_string*)) + 1;
+
+    /* these are not members of an internal function, they are read
+        speculatively and ignored when the function is internal */
+    zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_function, remote, op_array.filename),
+        &symbol->file, sizeof(zend_string*));
+    *user = zend_stat_sampler_plan_add(plan,
+        ZEND_STAT_ADDRESSOF(zend_function, remote, op_array.opcodes),
+        &symbol->opcodes, sizeof(zend_op*)) + 1;
+
+    return internal;
+}
+
+static zend_always_inline int zend_stat_sampler_function_resolve(zend_stat_sampler_t *sampler, const zend_function *remote, zend_stat_sampler_symbol_t *symbol, zend_stat_sampler_function_t *function) {
+    zend_stat_sampler_plan_t plan;
+    zend_stat_sampler_strings_t strings;
+    zend_string *scope = NULL;
+    int complete;
+
+    memset(function, 0, sizeof(zend_stat_sampler_function_t));
+
+    function->type = symbol->type;
+
+    zend_stat_sampler_plan_init(&plan);
+    zend_stat_sampler_strings_init(&strings);
+
+    if (symbol->scope) {
+        zend_stat_sampler_plan_add(&plan,
+            ZEND_STAT_ADDRESSOF(zend_class_entry, symbol->scope, name),
+            &scope, sizeof(zend_string*));
+    }
+
+    if (symbol->type == ZEND_USER_FUNCTION) {
+        function->opcodes = symbol->opcodes;
+
+        zend_stat_sampler_strings_add(
+            sampler, &strings, &plan,
+            symbol->file, &function->symbol.file);
+    }
+
+    zend_stat_sampler_strings_add(
+        sampler, &strings, &plan,
+        symbol->function, &function->symbol.function);
+
+    complete = zend_stat_sampler_plan_read(sampler, &plan);
+
+    /* Failure to read the name of the scope indicates the class was freed */
+    if (UNEXPECTED(symbol->scope && (complete < 1))) {
+        return FAILURE;
+    }
+
+    zend_stat_sampler_strings_finish(sampler, &strings, complete);
+
+    if (UNEXPECTED((symbol->type == ZEND_USER_FUNCTION) &&
+            (NULL == function->symbol.file))) {
+        return FAILURE;
+    }
+
+    if (scope) {
+        zend_stat_sampler_plan_init(&plan);
+        zend_stat_sampler_strings_init(&strings);
+        zend_stat_sampler_strings_add(
+            sampler, &strings, &plan,
+            scope, &function->symbol.scope);
+        zend_stat_sampler_strings_finish(sampler, &strings,
+            zend_stat_sampler_plan_read(sampler, &plan));
+
+        if (UNEXPECTED(NULL == function->symbol.scope)) {
+            return FAILURE;
+        }
+    }
+
+    if (UNEXPECTED(sampler->cache->bypass)) {
+        return SUCCESS;
+    }
+
+    if (
+        (symbol->type == ZEND_INTERNAL_FUNCTION)
+#ifdef ZEND_ACC_IMMUTABLE
+        || (symbol->flags & ZEND_ACC_IMMUTABLE)
+#endif
+    ) {
+        zend_stat_symbol_t shared = {
+            function->type,
+            function->opcodes,
+            function->symbol.file,
+            function->symbol.scope,
+            function->symbol.function
+        };
+
+        zend_hash_index_add_mem(
+            &sampler->cache->symbols,
+            (zend_ulong) remote,
+            function, sizeof(zend_stat_sampler_function_t));
+
+        zend_stat_symbol_publish(remote, &shared);
+    }
+
+    return SUCCESS;
+}
+
+static zend_always_inline int zend_stat_sampler_read_function(zend_stat_sampler_t *sampler, const zend_function *remote, zend_stat_sampler_function_t *function) {
+    zend_stat_sampler_plan_t plan;
+    zend_stat_sampler_symbol_t symbol;
+    int internal, user, complete;
+
+    if (EXPECTED(zend_stat_sampler_function_find(sampler, remote, function))) {
+        return SUCCESS;
+    }
+
+    zend_stat_sampler_plan_init(&plan);
+
+    internal = zend_stat_sampler_function_plan(&plan, remote, &symbol, &user);
+    complete = zend_stat_sampler_plan_read(sampler, &plan);
+
+    if (UNEXPECTED((complete < internal) ||
+            ((symbol.type == ZEND_USER_FUNCTION) && (complete < user)))) {
+        return FAILURE;
+    }
+
+    return zend_stat_sampler_function_resolve(sampler, remote, &symbol, function);
+} /* }}} */
+
+static zend_always_inline void zend_stat_sampler_read_stack(zend_stat_sampler_t *sampler, zend_stat_sampler_frame_t *frame, zend_stat_sampler_function_t *function, zend_stat_sampler_stack_t *stack, uint32_t depth) { /* {{{ */
+    /* The top of the stack is the sampled frame, each frame in the walk
+        reads the line of the current frame and the fields of the
+        previous frame together */
+    zend_stat_sampler_frame_t current = *frame;
+    zend_stat_sampler_function_t called = *function;
+
+    while (stack->depth < depth) {
+        zend_stat_stack_frame_t *entry = &stack->frames[stack->depth];
+        zend_stat_sampler_plan_t plan;
+        zend_stat_sampler_frame_t prev;
+        int lined = 0,
+            complete;
+
+        /* internal frames have no line */
+        entry->line = 0;
+
+        zend_stat_sampler_plan_init(&plan);
+
+        if ((called.type == ZEND_USER_FUNCTION) && (NULL != current.opline)) {
+            lined = zend_stat_sampler_plan_add(&plan,
+                ZEND_STAT_ADDRESSOF(zend_op, current.opline, lineno),
+                &entry->line, sizeof(uint32_t)) + 1;
+        }
+
+        if (NULL != current.prev) {
+            zend_stat_sampler_frame_plan(&plan, current.prev, &prev);
+        }
+
+        complete = zend_stat_sampler_plan_read(sampler, &plan);
+
+        entry->file     = called.symbol.file;
+        entry->scope    = called.symbol.scope;
+        entry->function = called.symbol.function;
+
+        if (UNEXPECTED(complete < lined)) {
+            entry->line = 0;
+        }
+
+        stack->depth++;
+
+        if ((NULL == current.prev) ||
+            (complete != plan.count) ||
+            (NULL == prev.func) ||
+            (zend_stat_sampler_read_function(sampler, prev.func, &called) != SUCCESS)) {
+            break;
+        }
+
+        current = prev;
+    }
 } /* }}} */
 
 static zend_always_inline zend_bool zend_stat_sample_unlined(zend_uchar opcode) { /* {{{ */
@@ -252,213 +808,574 @@ static zend_always_inline zend_bool zend_stat_sample_unlined(zend_uchar opcode)
     ;
 } /* }}} */
 
-/* {{{ */
-static zend_always_inline void zend_stat_sample(zend_stat_sampler_t *sampler) {
-    zend_execute_data *fp, frame;
-    zend_function function;
-    zend_op opline;
-    zend_stat_sample_t sample = zend_stat_sample_empty;
+static zend_always_inline zend_bool zend_stat_sample_caller(zend_stat_sample_t *sample, zend_stat_sampler_stack_t *stack) { /* {{{ */
+    zend_stat_stack_frame_t *frame = stack->frames,
+                            *end   = frame + stack->depth;
+
+    while (++frame < end) {
+        if (frame->file) {
+            sample->location.caller.file     = frame->file;
+            sample->location.caller.scope    = frame->scope;
+            sample->location.caller.function = frame->function;
+            return 1;
+        }
+    }
+
+    return 0;
+} /* }}} */
+
+static zend_always_inline uint64_t zend_stat_sampler_lag(zend_stat_sampler_clock_t *clock) { /* {{{ */
+    uint64_t now = zend_stat_sampler_now();
+
+    if (UNEXPECTED(0 == clock->deadline || now < clock->deadline)) {
+        return 0;
+    }
 
-    sample.elapsed = zend_stat_time();
+    return now - clock->deadline;
+} /* }}} */
+
+static zend_always_inline void zend_stat_sampler_cpu_attach(zend_stat_sampler_t *sampler, clockid_t id, zend_bool available, pid_t pid) { /* {{{ */
+    sampler->cpu.id        = id;
+    sampler->cpu.available = available;
+    sampler->cpu.pid       = pid;
+    sampler->cpu.last      = 0;
+    sampler->cpu.wall      = 0;
+    sampler->cpu.budget    = 0;
+} /* }}} */
+
+static zend_always_inline zend_bool zend_stat_sampler_cpu_tick(zend_stat_sampler_t *sampler, zend_stat_sample_t *sample) { /* {{{ */
+    /* Reads the CPU clock of the target to tag the sample as on or off CPU,
+        on the CPU clock the sample is only taken once the target has used an
+        interval of CPU time since the last sample */
+    struct timespec clk;
+    uint64_t now, wall, used, elapsed, interval;
+
+    if (EXPECTED(ZEND_STAT_CPU_OFF == zend_stat_sampler_cpu) || !sampler->cpu.available) {
+        return 1;
+    }
+
+    if (UNEXPECTED(clock_gettime(sampler->cpu.id, &clk) != SUCCESS)) {
+        sampler->cpu.available = 0;
+        return 1;
+    }
+
+    now  = ((uint64_t) clk.tv_sec * 1000000000L) + clk.tv_nsec;
+    wall = zend_stat_sampler_now();
+
+    if (UNEXPECTED(0 == sampler->cpu.last)) {
+        sampler->cpu.last = now;
+        sampler->cpu.wall = wall;
+
+        return ZEND_STAT_CPU_CLOCK != zend_stat_sampler_cpu;
+    }
+
+    used = now - sampler->cpu.last;
+
+    if (ZEND_STAT_CPU_CLOCK == zend_stat_sampler_cpu) {
+        interval = zend_stat_sampler_interval_get();
+        elapsed  = wall - sampler->cpu.wall;
+
+        sampler->cpu.last    = now;
+        sampler->cpu.wall    = wall;
+
+        /* the tick stands for the intervals in its weight, missed or
+            backed off, the share of them spent on CPU is charged */
+        if (EXPECTED(elapsed > 0)) {
+            sampler->cpu.budget +=
+                (uint64_t) (((double) used / elapsed) *
+                    ((double) sample->weight * interval));
+        }
+
+        if (sampler->cpu.budget < interval) {
+            return 0;
+        }
+
+        sample->cpu    = ZEND_STAT_SAMPLE_CPU_ON;
+        sample->weight = MIN(sampler->cpu.budget / interval, UINT32_MAX);
+
+        sampler->cpu.budget %= interval;
+        return 1;
+    }
+
+    /* on CPU when the target was running for most of the time since the
+        last tick */
+    sample->cpu =
+        ((used * 2) >= (wall - sampler->cpu.wall)) ?
+            ZEND_STAT_SAMPLE_CPU_ON :
+            ZEND_STAT_SAMPLE_CPU_OFF;
+
+    sampler->cpu.last = now;
+    sampler->cpu.wall = wall;
+
+    return 1;
+} /* }}} */
+
+static zend_always_inline void zend_stat_sampler_proc_close(zend_stat_sampler_t *sampler) { /* {{{ */
+    /* a sampler that was never attached is zeroed, nothing is open */
+    if (UNEXPECTED(0 == sampler->proc.pid)) {
+        return;
+    }
+
+    if (sampler->proc.stat >= 0) {
+        close(sampler->proc.stat);
+    }
+
+    if (sampler->proc.syscall >= 0) {
+        close(sampler->proc.syscall);
+    }
+
+    sampler->proc.stat    = -1;
+    sampler->proc.syscall = -1;
+} /* }}} */
+
+static zend_always_inline void zend_stat_sampler_proc_attach(zend_stat_sampler_t *sampler, pid_t pid, pid_t tid) { /* {{{ */
+    if (EXPECTED((sampler->proc.pid == pid) && (sampler->proc.tid == tid))) {
+        return;
+    }
+
+    zend_stat_sampler_proc_close(sampler);
+
+    sampler->proc.pid     = pid;
+    sampler->proc.tid     = tid;
+    sampler->proc.tick    = 0;
+    sampler->proc.stat    = -1;
+    sampler->proc.syscall = -1;
+} /* }}} */
+
+static zend_always_inline ssize_t zend_stat_sampler_proc_read(zend_stat_sampler_t *sampler, int *fd, const char *name, char *buf, size_t size) { /* {{{ */
+    ssize_t result;
+
+    /* a file that failed to open is retried on the next sample */
+    if (UNEXPECTED(*fd < 0)) {
+        char path[64];
+
+        snprintf(path, sizeof(path),
+            "/proc/%d/task/%d/%s",
+            sampler->proc.pid, sampler->proc.tid, name);
+
+        if ((*fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) {
+            return FAILURE;
+        }
+    }
+
+    result = pread(*fd, buf, size - 1, 0);
+
+    sampler->syscalls++;
+
+    if (UNEXPECTED(result <= 0)) {
+        return FAILURE;
+    }
+
+    buf[result] = 0;
+
+    return result;
+} /* }}} */
+
+static zend_always_inline void zend_stat_sampler_proc_sample(zend_stat_sampler_t *sampler, zend_stat_sample_t *sample) { /* {{{ */
+    /* The state of the task, and the syscall it is blocked in, are read
+        from proc for one in every stat.proc internal samples, the files
+        stay open for the life of the sampler */
+    char buf[512],
+         *state;
+    zend_long rate = zend_stat_sampler_proc;
+
+    if (EXPECTED(0 == rate) ||
+        UNEXPECTED(0 == sampler->proc.pid) ||
+        ((sampler->proc.tick++ % rate) != 0)) {
+        return;
+    }
+
+    if (zend_stat_sampler_proc_read(sampler,
+            &sampler->proc.stat, "stat", buf, sizeof(buf)) == FAILURE) {
+        return;
+    }
+
+    /* the name of the command may contain anything, the state follows the
+        last parenthesis */
+    if (UNEXPECTED(NULL == (state = strrchr(buf, ')')) || state[1] != ' ')) {
+        return;
+    }
+
+    sample->task.state = state[2];
+
+    if (zend_stat_sampler_proc_read(sampler,
+            &sampler->proc.syscall, "syscall", buf, sizeof(buf)) == FAILURE) {
+        return;
+    }
+
+    /* "running" when the task is on CPU, -1 when blocked outside of a
+        syscall, otherwise the number of the syscall first */
+    if (EXPECTED(buf[0] >= '0' && buf[0] <= '9')) {
+        sample->task.syscall = (int32_t) strtol(buf, NULL, 10);
+    }
+} /* }}} */
+
+static zend_always_inline int zend_stat_sample(zend_stat_sampler_t *sampler) {
+    zend_execute_data *fp = NULL;
+    zend_stat_sampler_plan_t plan;
+    zend_stat_sampler_frame_t frame;
+    zend_stat_sampler_function_t function;
+    zend_stat_sampler_symbol_t symbol;
+    zend_stat_sampler_stack_t stack;
+    struct {
+        zend_uchar opcode;
+        uint32_t   lineno;
+    } opline = {0, 0};
+    zend_bool cached;
+    uint32_t depth = zend_stat_sampler_depth_get();
+    int internal = 0,
+        user = 0,
+        lined = 0,
+        arginfo = -1,
+        complete;
+    zend_stat_sample_extended_t extended;
+    zend_stat_sample_t *sample = &extended.sample;
+
+    *sample = zend_stat_sample_empty;
+
+    sample->elapsed = zend_stat_time();
+    sample->weight  = sampler->clock.weight;
+    sample->lag     = zend_stat_sampler_lag(&sampler->clock);
+
+    if (!zend_stat_sampler_cpu_tick(sampler, sample)) {
+        return SUCCESS;
+    }
+
+    sampler->syscalls = 0;
+
+    stack.depth = 0;
+
+    zend_stat_sampler_plan_init(&plan);
 
     /* This can never fail while the sampler is active */
-    zend_stat_sampler_read(sampler,
+    zend_stat_sampler_plan_add(&plan,
         ZEND_STAT_ADDRESSOF(
             zend_heap_header_t, sampler->heap, size),
-        &sample.memory, sizeof(sample.memory));
+        &sample->memory, sizeof(sample->memory));
+    zend_stat_sampler_plan_add(&plan,
+        sampler->fp, &fp, sizeof(zend_execute_data*));
 
-    if (UNEXPECTED((zend_stat_sampler_read(sampler,
-            sampler->fp, &fp, sizeof(zend_execute_data*)) != SUCCESS) || (NULL == fp))) {
+    errno    = 0;
+    complete = zend_stat_sampler_plan_read(sampler, &plan);
+
+    if (UNEXPECTED(0 == complete) &&
+        ((ESRCH == errno) || (EFAULT == errno))) {
+        /* The target is gone, or is not the process that was registered,
+            there is nothing to sample */
+        return FAILURE;
+    }
+
+    if (UNEXPECTED((complete != plan.count) || (NULL == fp))) {
         /* There is no current execute data set */
-        sample.type = ZEND_STAT_SAMPLE_MEMORY;
+        sample->type = ZEND_STAT_SAMPLE_MEMORY;
 
         goto _zend_stat_sample_finish;
     }
 
-    if (UNEXPECTED((zend_stat_sampler_read(sampler,
-            fp,
-            &frame, sizeof(zend_execute_data)) != SUCCESS))) {
+    if (UNEXPECTED(zend_stat_sampler_read_frame(sampler, fp, &frame) != SUCCESS)) {
         /* The frame was freed before it could be sampled */
-        sample.type = ZEND_STAT_SAMPLE_MEMORY;
+        sample->type = ZEND_STAT_SAMPLE_MEMORY;
 
         goto _zend_stat_sample_finish;
     }
 
-    if (UNEXPECTED((NULL != frame.opline) &&
-        (zend_stat_sampler_read(sampler,
-            frame.opline, &opline, sizeof(zend_op)) != SUCCESS))) {
-        /* The instruction pointer is in an op array that was free'd */
-        sample.type = ZEND_STAT_SAMPLE_MEMORY;
+    /* The function, instruction, and arguments all depend only on the frame,
+        they are read together in order of importance */
+    zend_stat_sampler_plan_init(&plan);
 
-        goto _zend_stat_sample_finish;
+    cached = zend_stat_sampler_function_find(sampler, frame.func, &function);
+
+    if (!cached) {
+        internal =
+            zend_stat_sampler_function_plan(
+                &plan, frame.func, &symbol, &user);
+    }
+
+    if (NULL != frame.opline) {
+        zend_stat_sampler_plan_add(&plan,
+            ZEND_STAT_ADDRESSOF(zend_op, frame.opline, opcode),
+            &opline.opcode, sizeof(zend_uchar));
+        lined = zend_stat_sampler_plan_add(&plan,
+            ZEND_STAT_ADDRESSOF(zend_op, frame.opline, lineno),
+            &opline.lineno, sizeof(uint32_t)) + 1;
     }
 
     if (UNEXPECTED(zend_stat_sampler_arginfo_get())) {
-        sample.arginfo.length = MIN(frame.This.u2.num_args, ZEND_STAT_SAMPLE_MAX_ARGINFO);
-
-        if (EXPECTED(sample.arginfo.length > 0)) {
-            if (UNEXPECTED(zend_stat_sampler_read(sampler,
-                    ZEND_CALL_ARG(fp, 1),
-                    &sample.arginfo.info,
-                    sizeof(zval) * sample.arginfo.length) != SUCCESS)) {
-                /* The stack was freed by the sampled process, we don't bail, because
-                    the rest of the sampled frame should be readable */
-                sample.arginfo.length = 0;
-            }
+        /* Arguments are an extension, the buffer only stores them when
+            they are present */
+        sample->extension.length =
+            sizeof(zval) * MIN(frame.args, ZEND_STAT_SAMPLE_MAX_ARGINFO);
+
+        if (EXPECTED(sample->extension.length > 0)) {
+            arginfo = zend_stat_sampler_plan_add(&plan,
+                ZEND_CALL_ARG(fp, 1),
+                ZEND_STAT_SAMPLE_ARGINFO(sample),
+                sample->extension.length);
         }
     }
 
+    complete = zend_stat_sampler_plan_read(sampler, &plan);
+
+    if (UNEXPECTED(arginfo >= complete)) {
+        /* The stack was freed by the sampled process, we don't bail, because
+            the rest of the sampled frame should be readable */
+        sample->extension.length = 0;
+    }
+
     /* Failures to read from here onward indicate that the sampled function has been
         or is being destroyed */
 
-    if (UNEXPECTED(zend_stat_sampler_read_symbol(
-            sampler, frame.func, &function) != SUCCESS)) {
-        sample.type = ZEND_STAT_SAMPLE_MEMORY;
+    if (!cached) {
+        if (UNEXPECTED((complete < internal) ||
+                ((symbol.type == ZEND_USER_FUNCTION) && (complete < user)) ||
+                (zend_stat_sampler_function_resolve(
+                    sampler, frame.func, &symbol, &function) != SUCCESS))) {
+            sample->type = ZEND_STAT_SAMPLE_MEMORY;
 
-        memset(&sample.arginfo, 0, sizeof(sample.arginfo));
+            sample->extension.length = 0;
 
-        goto _zend_stat_sample_finish;
+            goto _zend_stat_sample_finish;
+        }
     }
 
     if (function.type == ZEND_USER_FUNCTION) {
-        sample.symbol.file =
-            zend_stat_sampler_read_string(
-                sampler, function.op_array.filename);
-
-        if (UNEXPECTED(NULL == sample.symbol.file)) {
-            sample.type = ZEND_STAT_SAMPLE_MEMORY;
+        if (UNEXPECTED(complete < lined)) {
+            /* The instruction pointer is in an op array that was free'd */
+            sample->type = ZEND_STAT_SAMPLE_MEMORY;
 
-            memset(&sample.arginfo,  0, sizeof(sample.arginfo));
+            sample->extension.length = 0;
 
             goto _zend_stat_sample_finish;
         }
 
-        sample.type                = ZEND_STAT_SAMPLE_USER;
-        sample.location.opline.opcode     = opline.opcode;
+        sample->type                = ZEND_STAT_SAMPLE_USER;
+        sample->location.opline.opcode     = opline.opcode;
         if (EXPECTED(!zend_stat_sample_unlined(opline.opcode))) {
-            sample.location.opline.line   = opline.lineno;
+            sample->location.opline.line   = opline.lineno;
+        }
+        sample->location.opline.offset     = frame.opline - function.opcodes;
+
+        if (depth) {
+            zend_stat_sampler_read_stack(
+                sampler, &frame, &function, &stack, depth);
         }
-        sample.location.opline.offset     = frame.opline - function.op_array.opcodes;
     } else {
-        zend_execute_data pframe;
-        zend_function     pfunc;
-
-        sample.type = ZEND_STAT_SAMPLE_INTERNAL;
-
-        while (zend_stat_sampler_read(sampler,
-                frame.prev_execute_data,
-                &pframe, sizeof(zend_execute_data)) == SUCCESS) {
-            if (EXPECTED(zend_stat_sampler_read_symbol(sampler,
-                    pframe.func, &pfunc) == SUCCESS)) {
-                if (pfunc.type == ZEND_USER_FUNCTION) {
-                    sample.location.caller.file =
-                            zend_stat_sampler_read_string(
-                                sampler, pfunc.op_array.filename);
-
-                    if (pfunc.op_array.scope) {
-                        sample.location.caller.scope =
-                            zend_stat_sampler_read_string_at(
-                                sampler,
-                                pfunc.op_array.scope,
-                                XtOffsetOf(zend_class_entry, name));
-                        if (UNEXPECTED(NULL == sample.location.caller.scope)) {
-                            break;
-                        }
-                    }
-
-                    sample.location.caller.function =
-                        zend_stat_sampler_read_string(sampler, pfunc.op_array.function_name);
-                    break;
-                }
-            } else {
+        zend_stat_sampler_frame_t    pframe;
+        zend_stat_sampler_function_t pfunction;
+
+        sample->type = ZEND_STAT_SAMPLE_INTERNAL;
+
+        zend_stat_sampler_proc_sample(sampler, sample);
+
+        if (depth) {
+            zend_stat_sampler_read_stack(
+                sampler, &frame, &function, &stack, depth);
+
+            /* The caller may already be on the stack */
+            if (zend_stat_sample_caller(sample, &stack)) {
+                goto _zend_stat_sample_symbol;
+            }
+        }
+
+        while ((NULL != frame.prev) &&
+               (zend_stat_sampler_read_frame(sampler, frame.prev, &pframe) == SUCCESS) &&
+               (zend_stat_sampler_read_function(sampler, pframe.func, &pfunction) == SUCCESS)) {
+            if (pfunction.type == ZEND_USER_FUNCTION) {
+                sample->location.caller = pfunction.symbol;
                 break;
             }
             frame = pframe;
         }
     }
 
-    if (function.common.scope) {
-        sample.symbol.scope =
-            zend_stat_sampler_read_string_at(
-                sampler,
-                function.common.scope,
-                XtOffsetOf(zend_class_entry, name));
+_zend_stat_sample_symbol:
+    sample->symbol = function.symbol;
 
-        if (UNEXPECTED(NULL == sample.symbol.scope)) {
-            sample.type = ZEND_STAT_SAMPLE_MEMORY;
+    if (stack.depth) {
+        /* Samples carry the identifier of the interned stack */
+        sample->stack =
+            zend_stat_stack(stack.frames, stack.depth);
+    }
 
-            memset(&sample.location, 0, sizeof(sample.location));
-            memset(&sample.arginfo,  0, sizeof(sample.arginfo));
+_zend_stat_sample_finish:
+    sample->syscalls = sampler->syscalls;
+
+    /* Samples only refer to the request, it is published once in the
+        request table */
+    sample->request.id         = sampler->request->id;
+    sample->request.generation = sampler->request->generation;
+
+    /* the summary is private to the sampler, until the request ends */
+    if (sample->type != ZEND_STAT_SAMPLE_MEMORY) {
+        zend_stat_request_count(
+            sampler->summary,
+            sample->symbol.scope,
+            sample->symbol.function, sample->weight);
+    } else {
+        zend_stat_request_count(
+            sampler->summary,
+            NULL, NULL, sample->weight);
+    }
 
-            goto _zend_stat_sample_finish;
-        }
+    zend_stat_buffer_insert(sampler->buffer, sampler->shard, sample);
+
+    return SUCCESS;
+} /* }}} */
+
+static void zend_stat_sampler_cache_symbol_free(zval *zv) { /* {{{ */
+    free(Z_PTR_P(zv));
+} /* }}} */
+
+static void (*zend_stat_sampler_restart_hook_next)(int) = NULL;
+
+static void zend_stat_sampler_restart_hook(int reason) { /* {{{ */
+    /* Opcache will reset shared memory once no request is using it, from then
+        the addresses of immutable functions and permanent strings are reused */
+    zend_stat_strings_restart();
+
+    if (zend_stat_sampler_restart_hook_next) {
+        zend_stat_sampler_restart_hook_next(reason);
     }
+} /* }}} */
 
-    sample.symbol.function =
-        zend_stat_sampler_read_string(
-            sampler, function.common.function_name);
+static zend_always_inline void zend_stat_sampler_restart_hook_install(void) { /* {{{ */
+    void (**hook)(int) =
+        (void (**)(int))
+            dlsym(RTLD_DEFAULT, "zend_accel_schedule_restart_hook");
 
-_zend_stat_sample_finish:
-    /* This is just a memcpy and some adds,
-        request data is refcounted. */
-    zend_stat_request_copy(
-        &sample.request, sampler->request);
+    if (NULL == hook || *hook == zend_stat_sampler_restart_hook) {
+        return;
+    }
 
-    zend_stat_buffer_insert(sampler->buffer, &sample);
+    zend_stat_sampler_restart_hook_next = *hook;
+
+    *hook = zend_stat_sampler_restart_hook;
 } /* }}} */
 
-static zend_always_inline time_t zend_stat_sampler_clock(long cumulative, long *ns) { /* {{{ */
-    time_t result = 0;
+static zend_always_inline void zend_stat_sampler_restart_observe(void) { /* {{{ */
+    /* Opcache resets during the activation of the first request to find no
+        other request using shared memory, which may be this request */
+    zend_ulong restarts = zend_stat_strings_restarting();
+    zval function, status, *pending, *progress;
+    double now;
+    int reporting;
 
-    while (cumulative >= 1000000000L) {
-        asm("" : "+rm"(cumulative));
+    if (EXPECTED(0 == restarts)) {
+        return;
+    }
+
+    now = zend_stat_time();
 
-        cumulative -= 1000000000L;
-        result++;
+    if ((now - zend_stat_sampler_restart_checked) < ZEND_STAT_SAMPLER_RESTART_CHECK) {
+        return;
     }
 
-    *ns = cumulative;
+    zend_stat_sampler_restart_checked = now;
 
-    return result;
+    ZVAL_STRINGL(&function, "opcache_get_status", sizeof("opcache_get_status")-1);
+    ZVAL_FALSE(&status);
+
+    /* a restricted api warns, the restart then stays pending until it must
+        have been forced */
+    reporting = EG(error_reporting);
+    EG(error_reporting) = 0;
+
+    if (call_user_function(CG(function_table), NULL, &function, &status, 0, NULL) != SUCCESS) {
+        ZVAL_FALSE(&status);
+    }
+
+    EG(error_reporting) = reporting;
+
+    if (Z_TYPE(status) == IS_ARRAY) {
+        pending  = zend_hash_str_find(Z_ARRVAL(status), ZEND_STRL("restart_pending"));
+        progress = zend_hash_str_find(Z_ARRVAL(status), ZEND_STRL("restart_in_progress"));
+
+        if ((pending && !zend_is_true(pending)) &&
+            (progress && !zend_is_true(progress))) {
+            zend_stat_strings_restarted(restarts);
+        }
+    }
+
+    zval_ptr_dtor(&status);
+    zval_ptr_dtor(&function);
 } /* }}} */
 
-#ifdef ZEND_ACC_IMMUTABLE
-static void zend_stat_sampler_cache_symbol_free(zval *zv) { /* {{{ */
-    free(Z_PTR_P(zv));
+static zend_stat_sampler_cache_t* zend_stat_sampler_cache_activate(zend_stat_sampler_cache_t *cache, pid_t pid) { /* {{{ */
+    /* Only ever called while the cache is not being used to sample, pending
+        is loaded first: once it reads clear the generation has advanced */
+    zend_bool  bypass     = zend_stat_strings_restarting() != 0;
+    zend_ulong generation = zend_stat_strings_generation();
+
+    if (UNEXPECTED(!cache->initialized)) {
+        zend_hash_init(&cache->strings, 32, NULL, NULL, 1);
+        zend_hash_init(&cache->symbols, 32, NULL, zend_stat_sampler_cache_symbol_free, 1);
+
+        cache->initialized = 1;
+    } else if (UNEXPECTED(bypass || (cache->pid != pid) || (cache->generation != generation))) {
+        zend_hash_clean(&cache->strings);
+        zend_hash_clean(&cache->symbols);
+    }
+
+    cache->bypass     = bypass;
+    cache->pid        = pid;
+    cache->generation = generation;
+
+    return cache;
+} /* }}} */
+
+static void zend_stat_sampler_cache_shutdown(zend_stat_sampler_cache_t *cache) { /* {{{ */
+    if (!cache->initialized) {
+        return;
+    }
+
+    zend_hash_destroy(&cache->strings);
+    zend_hash_destroy(&cache->symbols);
+
+    memset(cache, 0, sizeof(zend_stat_sampler_cache_t));
 } /* }}} */
-#endif
 
 static zend_never_inline void* zend_stat_sampler(zend_stat_sampler_t *sampler) { /* {{{ */
     struct zend_stat_sampler_timer_t
         *timer = &sampler->timer;
+    zend_stat_sampler_clock_t
+        *clock = &sampler->clock;
     struct timespec clk;
 
-    if (clock_gettime(CLOCK_REALTIME, &clk) != SUCCESS) {
+    if (!zend_stat_sampler_clock_start(clock,
+            ((uint64_t) zend_stat_pid() << 32) ^ (uintptr_t) sampler)) {
         goto _zend_stat_sampler_exit;
     }
 
-    zend_hash_init(&sampler->cache.strings, 32, NULL, NULL, 1);
-#ifdef ZEND_ACC_IMMUTABLE
-    zend_hash_init(&sampler->cache.symbols, 32, NULL, zend_stat_sampler_cache_symbol_free, 1);
-#endif
-
     pthread_mutex_lock(&timer->mutex);
 
     while (!timer->closed) {
-        clk.tv_sec +=
-            zend_stat_sampler_clock(
-                clk.tv_nsec +
-                    zend_stat_sampler_interval_get(),
-        &clk.tv_nsec);
+        if (UNEXPECTED(timer->parked)) {
+            /* A persistent sampler waits here between requests */
+            while (timer->parked && !timer->closed) {
+                pthread_cond_wait(&timer->cond, &timer->mutex);
+            }
+
+            if (!(clock->deadline = zend_stat_sampler_now())) {
+                goto _zend_stat_sampler_leave;
+            }
+
+            continue;
+        }
+
+        zend_stat_sampler_clock_next(clock);
+
+        clk.tv_sec  = clock->deadline / 1000000000L;
+        clk.tv_nsec = clock->deadline % 1000000000L;
 
         switch (pthread_cond_timedwait(&timer->cond, &timer->mutex, &clk)) {
             case ETIMEDOUT:
-                zend_stat_sample(sampler);
+                /* the timeout may race with parking */
+                if (EXPECTED(!timer->parked && !timer->closed)) {
+                    zend_stat_sampler_clock_tick(clock);
+                    zend_stat_sample(sampler);
+                }
             break;
 
-            case EINVAL:
-                /* clock is in the past, loop to catch up */
-
             case SUCCESS:
                 /* do nothing */
                 break;
@@ -471,28 +1388,90 @@ static zend_never_inline void* zend_stat_sampler(zend_stat_sampler_t *sampler) {
 _zend_stat_sampler_leave:
     pthread_mutex_unlock(&timer->mutex);
 
-    zend_hash_destroy(&sampler->cache.strings);
-#ifdef ZEND_ACC_IMMUTABLE
-    zend_hash_destroy(&sampler->cache.symbols);
-#endif
-
 _zend_stat_sampler_exit:
     pthread_exit(NULL);
 } /* }}} */
 
+zend_stat_sampler_t* zend_stat_sampler_create(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard) { /* {{{ */
+    /* A sampler owned by the agent, it shares an allocation with its cache */
+    zend_stat_sampler_t *sampler =
+        (zend_stat_sampler_t*)
+            pecalloc(1,
+                sizeof(zend_stat_sampler_t) +
+                sizeof(zend_stat_sampler_cache_t), 1);
+
+    sampler->buffer = buffer;
+    sampler->shard  = shard;
+    sampler->cache  = (zend_stat_sampler_cache_t*) (sampler + 1);
+
+    return sampler;
+} /* }}} */
+
+int zend_stat_sampler_sample(zend_stat_sampler_t *sampler, zend_stat_request_t *request, zend_stat_request_summary_t *summary, void *heap, void *fp, zend_stat_sampler_clock_t *clock) { /* {{{ */
+    zend_stat_sampler_cache_activate(sampler->cache, request->pid);
+
+    sampler->clock = *clock;
+
+    /* the main thread of a worker serves its requests */
+    zend_stat_sampler_proc_attach(sampler, request->pid, request->pid);
+
+    if (UNEXPECTED(sampler->cpu.pid != request->pid)) {
+        /* the agent is in another process, it uses the process clock */
+        clockid_t id = 0;
+        zend_bool available =
+            SUCCESS == clock_getcpuclockid(request->pid, &id);
+
+        zend_stat_sampler_cpu_attach(sampler, id, available, request->pid);
+    }
+
+    sampler->request = request;
+    sampler->summary = summary;
+    sampler->heap    = (zend_heap_header_t*) heap;
+    sampler->fp      = (zend_execute_data*) fp;
+
+    return zend_stat_sample(sampler);
+} /* }}} */
+
+void zend_stat_sampler_destroy(zend_stat_sampler_t *sampler) { /* {{{ */
+    zend_stat_sampler_proc_close(sampler);
+    zend_stat_sampler_cache_shutdown(sampler->cache);
+
+    pefree(sampler, 1);
+} /* }}} */
+
 void zend_stat_sampler_startup( /* {{{ */
         zend_bool automatic,
         zend_long interval,
         zend_bool arginfo,
+        zend_long depth,
+        zend_long jitter,
+        zend_long adaptive,
+        zend_long cpu,
+        zend_long proc,
         zend_long samplers,
+        zend_bool persistent,
+        zend_bool agent,
         zend_stat_buffer_t *buffer) {
 
     zend_stat_sampler_auto_set(automatic);
     zend_stat_sampler_interval_set(interval);
     zend_stat_sampler_arginfo_set(arginfo);
+    zend_stat_sampler_depth_set(depth);
+    zend_stat_sampler_jitter_set(jitter);
+
+    zend_stat_sampler_adaptive = adaptive * 1000;
+    zend_stat_sampler_cpu      = cpu;
+    zend_stat_sampler_proc     = proc;
     zend_stat_sampler_limit_set(samplers);
 
+    zend_stat_sampler_persistent = persistent;
+    zend_stat_sampler_agent      = agent;
+
     zend_stat_sampler_buffer_set(buffer);
+
+    /* opcache is loaded before modules start, the hook is installed once
+        here, before any process is forked, whatever the mode of sampling */
+    zend_stat_sampler_restart_hook_install();
 } /* }}} */
 
 ZEND_FUNCTION(zend_stat_sampler_activate) /* {{{ */
@@ -509,7 +1488,86 @@ ZEND_FUNCTION(zend_stat_sampler_activate) /* {{{ */
     RETURN_BOOL(zend_stat_sampler_active());
 } /* }}} */
 
+static zend_always_inline void zend_stat_sampler_cpu_activate(void) { /* {{{ */
+    /* The sampler thread reads the CPU clock of the thread serving the request */
+    clockid_t id = 0;
+    zend_bool available;
+
+    if (EXPECTED(ZEND_STAT_CPU_OFF == zend_stat_sampler_cpu)) {
+        return;
+    }
+
+    /* the clock is fetched before it is passed, arguments are not ordered */
+    available = SUCCESS == pthread_getcpuclockid(pthread_self(), &id);
+
+    zend_stat_sampler_cpu_attach(ZEND_STAT_SAMPLER(), id, available, zend_stat_pid());
+} /* }}} */
+
+static zend_always_inline double zend_stat_sampler_cputime(void) { /* {{{ */
+#ifdef RUSAGE_THREAD
+    struct rusage ru;
+
+    if (EXPECTED(SUCCESS == getrusage(RUSAGE_THREAD, &ru))) {
+        return (double) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+               ((double) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0);
+    }
+#endif
+
+    return -1;
+} /* }}} */
+
+static zend_always_inline void zend_stat_sampler_summarize(zend_stat_buffer_shard_t *shard, double duration) { /* {{{ */
+    zend_stat_sample_extended_t  extended;
+    zend_stat_sample_t          *sample = &extended.sample;
+    zend_stat_sample_summary_t  *summary = ZEND_STAT_SAMPLE_SUMMARY_OF(sample);
+    zend_stat_request_summary_t *counted = &zend_stat_sampler_summary;
+    double cputime = zend_stat_sampler_cputime();
+    uint32_t it, next;
+
+    if (UNEXPECTED(0 == zend_stat_sampler_request.generation)) {
+        return;
+    }
+
+    memcpy(sample, &zend_stat_sample_empty, sizeof(zend_stat_sample_t));
+
+    sample->type               = ZEND_STAT_SAMPLE_SUMMARY;
+    sample->elapsed            = zend_stat_time();
+    sample->memory.used        = zend_memory_usage(0);
+    sample->memory.peak        = zend_memory_peak_usage(0);
+    sample->request.id         = zend_stat_sampler_request.id;
+    sample->request.generation = zend_stat_sampler_request.generation;
+
+    summary->duration = duration;
+    summary->cpu      = ((cputime < 0) || (zend_stat_sampler_rusage < 0)) ?
+                            -1 : cputime - zend_stat_sampler_rusage;
+    summary->samples  = counted->samples;
+    summary->symbols  = 0;
+
+    /* the few symbols counted are written heaviest first */
+    for (it = 0; it < ZEND_STAT_REQUEST_SYMBOLS; it++) {
+        if (NULL == counted->symbol[it].function) {
+            continue;
+        }
+
+        next = summary->symbols++;
+
+        while ((next > 0) &&
+               (summary->symbol[next - 1].samples < counted->symbol[it].samples)) {
+            summary->symbol[next] = summary->symbol[next - 1];
+            next--;
+        }
+
+        summary->symbol[next] = counted->symbol[it];
+    }
+
+    sample->extension.length = sizeof(zend_stat_sample_summary_t);
+
+    zend_stat_buffer_insert(zend_stat_sampler_buffer, shard, sample);
+} /* }}} */
+
 void zend_stat_sampler_activate(zend_bool start) { /* {{{ */
+    zend_stat_sampler_restart_observe();
+
     if ((0 == zend_stat_sampler_auto_get()) && (0 == start)) {
         return;
     }
@@ -522,13 +1580,70 @@ void zend_stat_sampler_activate(zend_bool start) { /* {{{ */
         zend_error(E_WARNING,
             "[STAT] Could not allocate request, "
             "not activating sampler, may be low on memory");
+        zend_stat_sampler_remove();
         return;
     }
-    
+
+    zend_stat_sampler_rusage = zend_stat_sampler_cputime();
+
+    memset(&zend_stat_sampler_summary, 0, sizeof(zend_stat_request_summary_t));
+
+    if (zend_stat_sampler_agent) {
+        /* The agent samples this process from the master */
+        ZSS(agent) = zend_stat_agent_register(
+            &zend_stat_sampler_request,
+            zend_mm_get_heap(),
+            ZEND_STAT_ADDRESSOF(
+                zend_executor_globals,
+                ZEND_EXECUTOR_ADDRESS,
+                current_execute_data));
+
+        if (UNEXPECTED(FAILURE == ZSS(agent))) {
+            zend_stat_request_end(&zend_stat_sampler_request);
+            zend_stat_sampler_remove();
+            return;
+        }
+
+        ZSS(timer).active = 1;
+        return;
+    }
+
+    if (ZSS(timer).persistent) {
+        /* The thread is parked, retarget and wake it */
+        pthread_mutex_lock(&ZSS(timer).mutex);
+
+        ZSS(cache) = zend_stat_sampler_cache_activate(&__cache, zend_stat_pid());
+        ZSS(request) = &zend_stat_sampler_request;
+        ZSS(summary) = &zend_stat_sampler_summary;
+        ZSS(buffer) = zend_stat_sampler_buffer;
+        ZSS(shard) = zend_stat_buffer_claim(zend_stat_sampler_buffer);
+        ZSS(heap) =
+            (zend_heap_header_t*) zend_mm_get_heap();
+        ZSS(fp) =
+            (zend_execute_data*)
+                ZEND_STAT_ADDRESSOF(
+                    zend_executor_globals,
+                    ZEND_EXECUTOR_ADDRESS,
+                    current_execute_data);
+        zend_stat_sampler_cpu_activate();
+        zend_stat_sampler_proc_attach(ZEND_STAT_SAMPLER(),
+            zend_stat_pid(), (pid_t) syscall(SYS_gettid));
+
+        ZSS(timer).parked = 0;
+        ZSS(timer).active = 1;
+
+        pthread_cond_signal(&ZSS(timer).cond);
+        pthread_mutex_unlock(&ZSS(timer).mutex);
+        return;
+    }
+
     ZEND_STAT_SAMPLER_RESET();
 
+    ZSS(cache) = zend_stat_sampler_cache_activate(&__cache, zend_stat_pid());
     ZSS(request) = &zend_stat_sampler_request;
+    ZSS(summary) = &zend_stat_sampler_summary;
     ZSS(buffer) = zend_stat_sampler_buffer;
+    ZSS(shard) = zend_stat_buffer_claim(zend_stat_sampler_buffer);
     ZSS(heap) =
         (zend_heap_header_t*) zend_mm_get_heap();
     ZSS(fp) =
@@ -538,8 +1653,17 @@ void zend_stat_sampler_activate(zend_bool start) { /* {{{ */
                 ZEND_EXECUTOR_ADDRESS,
                 current_execute_data);
 
+    zend_stat_sampler_cpu_activate();
+    zend_stat_sampler_proc_attach(ZEND_STAT_SAMPLER(),
+        zend_stat_pid(), (pid_t) syscall(SYS_gettid));
+
     if (!zend_stat_mutex_init(&ZSS(timer).mutex, 0) ||
         !zend_stat_condition_init(&ZSS(timer).cond, 0)) {
+        zend_stat_buffer_release(ZSS(buffer), ZSS(shard));
+        zend_stat_request_end(&zend_stat_sampler_request);
+        zend_stat_sampler_remove();
+        zend_stat_sampler_proc_close(ZEND_STAT_SAMPLER());
+        ZEND_STAT_SAMPLER_RESET();
         return;
     }
 
@@ -550,10 +1674,16 @@ void zend_stat_sampler_activate(zend_bool start) { /* {{{ */
             (void*) ZEND_STAT_SAMPLER()) != SUCCESS) {
         pthread_cond_destroy(&ZSS(timer).cond);
         pthread_mutex_destroy(&ZSS(timer).mutex);
+        zend_stat_buffer_release(ZSS(buffer), ZSS(shard));
+        zend_stat_request_end(&zend_stat_sampler_request);
+        zend_stat_sampler_remove();
+        zend_stat_sampler_proc_close(ZEND_STAT_SAMPLER());
+        ZEND_STAT_SAMPLER_RESET();
         return;
     }
 
     ZSS(timer).active = 1;
+    ZSS(timer).persistent = zend_stat_sampler_persistent;
 } /* }}} */
 
 ZEND_FUNCTION(zend_stat_sampler_active) /* {{{ */
@@ -583,10 +1713,56 @@ ZEND_FUNCTION(zend_stat_sampler_deactivate) /* {{{ */
 } /* }}} */
 
 void zend_stat_sampler_deactivate() { /* {{{ */
+    double duration;
+
     if (0 == zend_stat_sampler_active()) {
         return;
     }
 
+    duration = zend_stat_time() - zend_stat_sampler_request.elapsed;
+
+    /* the request is complete, its latency is recorded against its route */
+    zend_stat_routes_record(&zend_stat_sampler_request, duration);
+
+    if (zend_stat_sampler_agent) {
+        zend_stat_agent_unregister(ZSS(agent), &zend_stat_sampler_summary);
+
+        /* the agent writes to the shared shard, as does the summary */
+        zend_stat_sampler_summarize(NULL, duration);
+
+        zend_stat_request_end(&zend_stat_sampler_request);
+
+        zend_stat_sampler_remove();
+
+        ZEND_STAT_SAMPLER_RESET();
+        return;
+    }
+
+    if (ZSS(timer).persistent) {
+        /* Samples are taken with the mutex held, once it is acquired the
+            thread is not using the request and may be parked */
+        pthread_mutex_lock(&ZSS(timer).mutex);
+
+        ZSS(timer).parked = 1;
+        ZSS(timer).active = 0;
+
+        pthread_cond_signal(&ZSS(timer).cond);
+        pthread_mutex_unlock(&ZSS(timer).mutex);
+
+        /* the shard is still claimed, and the parked thread no longer
+            writes to it */
+        zend_stat_sampler_summarize(ZSS(shard), duration);
+
+        zend_stat_buffer_release(ZSS(buffer), ZSS(shard));
+
+        ZSS(shard) = NULL;
+
+        zend_stat_request_end(&zend_stat_sampler_request);
+
+        zend_stat_sampler_remove();
+        return;
+    }
+
     pthread_mutex_lock(&ZSS(timer).mutex);
 
     ZSS(timer).closed = 1;
@@ -599,10 +1775,41 @@ void zend_stat_sampler_deactivate() { /* {{{ */
     zend_stat_condition_destroy(&ZSS(timer).cond);
     zend_stat_mutex_destroy(&ZSS(timer).mutex);
 
-    zend_stat_request_release(&zend_stat_sampler_request);
+    zend_stat_sampler_summarize(ZSS(shard), duration);
+
+    zend_stat_buffer_release(ZSS(buffer), ZSS(shard));
+
+    zend_stat_request_end(&zend_stat_sampler_request);
 
     zend_stat_sampler_remove();
 
+    zend_stat_sampler_proc_close(ZEND_STAT_SAMPLER());
+
+    ZEND_STAT_SAMPLER_RESET();
+} /* }}} */
+
+void zend_stat_sampler_shutdown() { /* {{{ */
+    if (0 == ZSS(timer).persistent) {
+        zend_stat_sampler_cache_shutdown(&__cache);
+        return;
+    }
+
+    pthread_mutex_lock(&ZSS(timer).mutex);
+
+    ZSS(timer).closed = 1;
+
+    pthread_cond_signal(&ZSS(timer).cond);
+    pthread_mutex_unlock(&ZSS(timer).mutex);
+
+    pthread_join(ZSS(timer).thread, NULL);
+
+    zend_stat_condition_destroy(&ZSS(timer).cond);
+    zend_stat_mutex_destroy(&ZSS(timer).mutex);
+
+    zend_stat_sampler_proc_close(ZEND_STAT_SAMPLER());
+
+    zend_stat_sampler_cache_shutdown(&__cache);
+
     ZEND_STAT_SAMPLER_RESET();
 } /* }}} */
 
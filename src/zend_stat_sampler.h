@@ -22,6 +22,16 @@
 #include "zend_stat_sample.h"
 #include "zend_stat_request.h"
 
+typedef struct _zend_stat_sampler_t zend_stat_sampler_t;
+
+typedef struct _zend_stat_sampler_clock_t {
+    uint64_t deadline;
+    uint64_t interval;
+    uint64_t seed;
+    uint32_t scale;
+    uint32_t weight;
+} zend_stat_sampler_clock_t;
+
 extern ZEND_FUNCTION(zend_stat_sampler_activate);
 extern ZEND_FUNCTION(zend_stat_sampler_active);
 extern ZEND_FUNCTION(zend_stat_sampler_deactivate);
@@ -32,13 +42,24 @@ void zend_stat_sampler_interval_set(zend_long interval);
 void zend_stat_sampler_limit_set(zend_long interval);
 zend_long zend_stat_sampler_interval_get();
 void zend_stat_sampler_arginfo_set(zend_bool arginfo);
+void zend_stat_sampler_depth_set(zend_long depth);
+void zend_stat_sampler_jitter_set(zend_long jitter);
 void zend_stat_sampler_request_set(zend_stat_request_t *request);
 
 zend_bool zend_stat_sampler_add();
 void zend_stat_sampler_remove();
 
-void zend_stat_sampler_startup(zend_bool automatic, zend_long interval, zend_bool arginfo, zend_long samplers, zend_stat_buffer_t *buffer);
+void zend_stat_sampler_startup(zend_bool automatic, zend_long interval, zend_bool arginfo, zend_long depth, zend_long jitter, zend_long adaptive, zend_long cpu, zend_long proc, zend_long samplers, zend_bool persistent, zend_bool agent, zend_stat_buffer_t *buffer);
 void zend_stat_sampler_activate(zend_bool start);
 zend_bool zend_stat_sampler_active();
 void zend_stat_sampler_deactivate();
+void zend_stat_sampler_shutdown();
+
+zend_stat_sampler_t* zend_stat_sampler_create(zend_stat_buffer_t *buffer, zend_stat_buffer_shard_t *shard);
+int  zend_stat_sampler_sample(zend_stat_sampler_t *sampler, zend_stat_request_t *request, zend_stat_request_summary_t *summary, void *heap, void *fp, zend_stat_sampler_clock_t *clock);
+
+zend_bool zend_stat_sampler_clock_start(zend_stat_sampler_clock_t *clock, uint64_t seed);
+uint64_t  zend_stat_sampler_clock_next(zend_stat_sampler_clock_t *clock);
+void      zend_stat_sampler_clock_tick(zend_stat_sampler_clock_t *clock);
+void zend_stat_sampler_destroy(zend_stat_sampler_t *sampler);
 #endif	/* ZEND_STAT_SAMPLER_H */
@@ -0,0 +1,364 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_SKETCH
+# define ZEND_STAT_SKETCH
+
+#include "zend_stat.h"
+#include "zend_stat_io.h"
+#include "zend_stat_sketch.h"
+
+/* Counters are found by key in a chained table of buckets, and ordered by
+    count in a heap, so that the least counter is always at the root: a
+    counted key is updated in place, an uncounted key takes over the root */
+typedef struct _zend_stat_sketch_counter_t {
+    zend_stat_string_t *primary;
+    zend_stat_string_t *secondary;
+    zend_ulong          hash;
+    uint64_t            count;
+    uint64_t            error;
+    uint32_t            position;
+    uint32_t            next;
+} zend_stat_sketch_counter_t;
+
+struct _zend_stat_sketch_t {
+    pthread_mutex_t             mutex;
+    zend_uchar                  keys;
+    uint32_t                    size;
+    uint32_t                    used;
+    uint32_t                    mask;
+    uint64_t                    total;
+    uint32_t                   *heap;
+    uint32_t                   *buckets;
+    zend_stat_sketch_counter_t  counters[1];
+};
+
+#define ZEND_STAT_SKETCH_COUNT(sketch, position) \
+    ((sketch)->counters[(sketch)->heap[position]].count)
+
+zend_stat_sketch_t* zend_stat_sketch_create(uint32_t counters, zend_uchar keys) {
+    zend_stat_sketch_t *sketch;
+    uint32_t buckets = 1;
+
+    while (buckets < (counters * 2)) {
+        buckets <<= 1;
+    }
+
+    sketch = calloc(1,
+                sizeof(zend_stat_sketch_t) +
+                ((counters - 1) * sizeof(zend_stat_sketch_counter_t)) +
+                (counters * sizeof(uint32_t)) +
+                (buckets * sizeof(uint32_t)));
+
+    if (UNEXPECTED(NULL == sketch)) {
+        return NULL;
+    }
+
+    if (!zend_stat_mutex_init(&sketch->mutex, 0)) {
+        free(sketch);
+        return NULL;
+    }
+
+    sketch->keys    = keys;
+    sketch->size    = counters;
+    sketch->mask    = buckets - 1;
+    sketch->heap    = (uint32_t*) &sketch->counters[counters];
+    sketch->buckets = sketch->heap + counters;
+
+    return sketch;
+}
+
+static zend_always_inline zend_ulong zend_stat_sketch_string_hash(zend_stat_sketch_t *sketch, zend_stat_string_t *string) {
+    if (NULL == string) {
+        return 0;
+    }
+
+    if (sketch->keys == ZEND_STAT_SKETCH_VALUE) {
+        return zend_inline_hash_func(string->value, string->length);
+    }
+
+    return ((zend_ulong) string) >> 3;
+}
+
+static zend_always_inline zend_bool zend_stat_sketch_string_equals(zend_stat_sketch_t *sketch, zend_stat_string_t *a, zend_stat_string_t *b) {
+    if (a == b) {
+        return 1;
+    }
+
+    if ((sketch->keys == ZEND_STAT_SKETCH_ADDRESS) || (NULL == a) || (NULL == b)) {
+        return 0;
+    }
+
+    return (a->length == b->length) &&
+           (SUCCESS == memcmp(a->value, b->value, a->length));
+}
+
+static zend_always_inline void zend_stat_sketch_swap(zend_stat_sketch_t *sketch, uint32_t a, uint32_t b) {
+    uint32_t counter = sketch->heap[a];
+
+    sketch->heap[a] = sketch->heap[b];
+    sketch->heap[b] = counter;
+
+    sketch->counters[sketch->heap[a]].position = a;
+    sketch->counters[sketch->heap[b]].position = b;
+}
+
+/* A count only grows, so a counter only moves away from the root, except
+    when it is new */
+static void zend_stat_sketch_down(zend_stat_sketch_t *sketch, uint32_t position) {
+    do {
+        uint32_t left  = (position * 2) + 1,
+                 right = left + 1,
+                 least = position;
+
+        if ((left < sketch->used) &&
+            (ZEND_STAT_SKETCH_COUNT(sketch, left) < ZEND_STAT_SKETCH_COUNT(sketch, least))) {
+            least = left;
+        }
+
+        if ((right < sketch->used) &&
+            (ZEND_STAT_SKETCH_COUNT(sketch, right) < ZEND_STAT_SKETCH_COUNT(sketch, least))) {
+            least = right;
+        }
+
+        if (least == position) {
+            break;
+        }
+
+        zend_stat_sketch_swap(sketch, position, least);
+
+        position = least;
+    } while (1);
+}
+
+static void zend_stat_sketch_up(zend_stat_sketch_t *sketch, uint32_t position) {
+    while (position > 0) {
+        uint32_t parent = (position - 1) / 2;
+
+        if (ZEND_STAT_SKETCH_COUNT(sketch, parent) <= ZEND_STAT_SKETCH_COUNT(sketch, position)) {
+            break;
+        }
+
+        zend_stat_sketch_swap(sketch, position, parent);
+
+        position = parent;
+    }
+}
+
+static void zend_stat_sketch_unlink(zend_stat_sketch_t *sketch, zend_stat_sketch_counter_t *counter) {
+    uint32_t *link = &sketch->buckets[counter->hash & sketch->mask],
+              index = (counter - sketch->counters) + 1;
+
+    while (*link != index) {
+        link = &sketch->counters[*link - 1].next;
+    }
+
+    *link = counter->next;
+}
+
+static void zend_stat_sketch_link(zend_stat_sketch_t *sketch, zend_stat_sketch_counter_t *counter, zend_stat_string_t *primary, zend_stat_string_t *secondary, zend_ulong hash) {
+    uint32_t *bucket = &sketch->buckets[hash & sketch->mask];
+
+    if (sketch->keys == ZEND_STAT_SKETCH_VALUE) {
+        /* a key that is compared by value is kept until it is evicted */
+        primary   = primary   ? zend_stat_string_copy(primary)   : NULL;
+        secondary = secondary ? zend_stat_string_copy(secondary) : NULL;
+    }
+
+    counter->primary   = primary;
+    counter->secondary = secondary;
+    counter->hash      = hash;
+    counter->next      = *bucket;
+
+    *bucket = (counter - sketch->counters) + 1;
+}
+
+static void zend_stat_sketch_evict(zend_stat_sketch_t *sketch, zend_stat_sketch_counter_t *counter) {
+    zend_stat_sketch_unlink(sketch, counter);
+
+    if (sketch->keys == ZEND_STAT_SKETCH_VALUE) {
+        if (counter->primary) {
+            zend_stat_string_release(counter->primary);
+        }
+
+        if (counter->secondary) {
+            zend_stat_string_release(counter->secondary);
+        }
+    }
+}
+
+void zend_stat_sketch_add(zend_stat_sketch_t *sketch, zend_stat_string_t *primary, zend_stat_string_t *secondary, uint64_t weight) {
+    zend_stat_sketch_counter_t *counter;
+    zend_ulong hash = zend_stat_sketch_string_hash(sketch, primary),
+               mix  = zend_stat_sketch_string_hash(sketch, secondary);
+    uint32_t index;
+
+    if (UNEXPECTED(NULL == primary)) {
+        return;
+    }
+
+    hash ^= mix + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+
+    pthread_mutex_lock(&sketch->mutex);
+
+    sketch->total += weight;
+
+    for (index = sketch->buckets[hash & sketch->mask]; index; index = counter->next) {
+        counter = &sketch->counters[index - 1];
+
+        if ((counter->hash == hash) &&
+            zend_stat_sketch_string_equals(sketch, counter->primary, primary) &&
+            zend_stat_sketch_string_equals(sketch, counter->secondary, secondary)) {
+            counter->count += weight;
+
+            zend_stat_sketch_down(sketch, counter->position);
+
+            goto _zend_stat_sketch_add_unlock;
+        }
+    }
+
+    if (sketch->used < sketch->size) {
+        counter = &sketch->counters[sketch->used];
+
+        counter->count    = weight;
+        counter->error    = 0;
+        counter->position = sketch->used;
+
+        sketch->heap[sketch->used] = sketch->used;
+        sketch->used++;
+
+        zend_stat_sketch_link(sketch, counter, primary, secondary, hash);
+        zend_stat_sketch_up(sketch, counter->position);
+
+        goto _zend_stat_sketch_add_unlock;
+    }
+
+    /* the least counter is taken over, the key may have been counted
+        up to its count before it was evicted */
+    counter = &sketch->counters[sketch->heap[0]];
+
+    zend_stat_sketch_evict(sketch, counter);
+
+    counter->error  = counter->count;
+    counter->count += weight;
+
+    zend_stat_sketch_link(sketch, counter, primary, secondary, hash);
+    zend_stat_sketch_down(sketch, 0);
+
+_zend_stat_sketch_add_unlock:
+    pthread_mutex_unlock(&sketch->mutex);
+}
+
+static zend_bool zend_stat_sketch_write_string(zend_stat_io_buffer_t *iob, zend_bool separate, const char *label, zend_stat_string_t *string) {
+    if ((NULL == string) || (NULL == label)) {
+        return 1;
+    }
+
+    if ((separate && !zend_stat_io_buffer_append(iob, ", ", sizeof(", ")-1)) ||
+        !zend_stat_io_buffer_appendf(iob, "\"%s\": \"", label) ||
+        !zend_stat_io_buffer_appends(iob, string) ||
+        !zend_stat_io_buffer_append(iob, "\"", sizeof("\"")-1)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* The true count of a key is between its count less its error and its
+    count, the true count of a key that is not listed is at most the minimum */
+zend_bool zend_stat_sketch_write(zend_stat_sketch_t *sketch, zend_stat_io_buffer_t *iob, const char *primary, const char *secondary) {
+    zend_stat_sketch_counter_t *top[ZEND_STAT_SKETCH_TOP];
+    zend_bool result = 0;
+    uint32_t it, used = 0;
+
+    pthread_mutex_lock(&sketch->mutex);
+
+    for (it = 0; it < sketch->used; it++) {
+        zend_stat_sketch_counter_t *counter = &sketch->counters[it];
+        uint32_t position = used;
+
+        while ((position > 0) && (top[position - 1]->count < counter->count)) {
+            if (position < ZEND_STAT_SKETCH_TOP) {
+                top[position] = top[position - 1];
+            }
+            position--;
+        }
+
+        if (position < ZEND_STAT_SKETCH_TOP) {
+            top[position] = counter;
+
+            if (used < ZEND_STAT_SKETCH_TOP) {
+                used++;
+            }
+        }
+    }
+
+    if (!zend_stat_io_buffer_appendf(iob,
+            "{\"total\": %" PRIu64 ", \"minimum\": %" PRIu64 ", \"top\": [",
+            sketch->total,
+            (sketch->used < sketch->size) ? 0 : ZEND_STAT_SKETCH_COUNT(sketch, 0))) {
+        goto _zend_stat_sketch_write_unlock;
+    }
+
+    for (it = 0; it < used; it++) {
+        if (!zend_stat_io_buffer_append(iob,
+                it ? ", {" : "{",
+                it ? sizeof(", {")-1 : sizeof("{")-1) ||
+            !zend_stat_sketch_write_string(iob, 0, primary, top[it]->primary) ||
+            !zend_stat_sketch_write_string(iob,
+                NULL != top[it]->primary, secondary, top[it]->secondary) ||
+            !zend_stat_io_buffer_appendf(iob,
+                ", \"samples\": %" PRIu64 ", \"error\": %" PRIu64 "}",
+                top[it]->count,
+                top[it]->error)) {
+            goto _zend_stat_sketch_write_unlock;
+        }
+    }
+
+    result = zend_stat_io_buffer_append(iob, "]}", sizeof("]}")-1);
+
+_zend_stat_sketch_write_unlock:
+    pthread_mutex_unlock(&sketch->mutex);
+
+    return result;
+}
+
+void zend_stat_sketch_destroy(zend_stat_sketch_t *sketch) {
+    uint32_t it;
+
+    if (NULL == sketch) {
+        return;
+    }
+
+    if (sketch->keys == ZEND_STAT_SKETCH_VALUE) {
+        for (it = 0; it < sketch->used; it++) {
+            if (sketch->counters[it].primary) {
+                zend_stat_string_release(sketch->counters[it].primary);
+            }
+
+            if (sketch->counters[it].secondary) {
+                zend_stat_string_release(sketch->counters[it].secondary);
+            }
+        }
+    }
+
+    zend_stat_mutex_destroy(&sketch->mutex);
+
+    free(sketch);
+}
+#endif	/* ZEND_STAT_SKETCH */
@@ -0,0 +1,44 @@
+/*
+  +----------------------------------------------------------------------+
+  | stat                                                                |
+  +----------------------------------------------------------------------+
+  | Copyright (c) Joe Watkins 2019                                       |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: krakjoe                                                      |
+  +----------------------------------------------------------------------+
+ */
+
+#ifndef ZEND_STAT_SKETCH_H
+# define ZEND_STAT_SKETCH_H
+
+#include "zend_stat_io.h"
+
+#ifndef ZEND_STAT_SKETCH_COUNTERS
+#   define ZEND_STAT_SKETCH_COUNTERS 1024
+#endif
+
+#ifndef ZEND_STAT_SKETCH_TOP
+#   define ZEND_STAT_SKETCH_TOP 64
+#endif
+
+/* A sketch finds the heaviest keys in a stream of weighted samples in fixed
+    memory, using Space-Saving: a key that is not counted takes over the
+    counter with the least count, and inherits that count as its error */
+typedef struct _zend_stat_sketch_t zend_stat_sketch_t;
+
+#define ZEND_STAT_SKETCH_ADDRESS 0
+#define ZEND_STAT_SKETCH_VALUE   1
+
+zend_stat_sketch_t* zend_stat_sketch_create(uint32_t counters, zend_uchar keys);
+void                zend_stat_sketch_add(zend_stat_sketch_t *sketch, zend_stat_string_t *primary, zend_stat_string_t *secondary, uint64_t weight);
+zend_bool           zend_stat_sketch_write(zend_stat_sketch_t *sketch, zend_stat_io_buffer_t *iob, const char *primary, const char *secondary);
+void                zend_stat_sketch_destroy(zend_stat_sketch_t *sketch);
+#endif	/* ZEND_STAT_SKETCH_H */
@@ -23,6 +23,8 @@
 #include "zend_stat_io.h"
 #include "zend_stat_stream.h"
 
+#include <poll.h>
+
 static zend_always_inline void zend_stat_stream_yield(zend_stat_io_t *io) {
     zend_long interval =
         zend_stat_sampler_interval_get() / 1000;
@@ -30,16 +32,263 @@ static zend_always_inline void zend_stat_stream_yield(zend_stat_io_t *io) {
     usleep(ceil(interval / 2));
 }
 
+#ifndef ZEND_STAT_STREAM_LOSS_PERIOD
+#   define ZEND_STAT_STREAM_LOSS_PERIOD 1.0
+#endif
+
+#ifndef ZEND_STAT_STREAM_HANDSHAKE
+#   define ZEND_STAT_STREAM_HANDSHAKE 100
+#endif
+
+#ifndef ZEND_STAT_STREAM_GROUP_NAME
+#   define ZEND_STAT_STREAM_GROUP_NAME 64
+#endif
+
+/* The members of a group share a cursor, and each reads a partition of the
+    shards, and of the requests written to the shared shard, so that every
+    sample is delivered to exactly one of them */
+typedef struct _zend_stat_stream_group_t {
+    char                       name[ZEND_STAT_STREAM_GROUP_NAME];
+    zend_stat_buffer_cursor_t *cursor;
+    zend_ulong                 members;
+    int                        member[ZEND_STAT_IO_CLIENTS];
+} zend_stat_stream_group_t;
+
+static struct {
+    pthread_mutex_t          mutex;
+    zend_stat_stream_group_t group[ZEND_STAT_IO_CLIENTS];
+} zend_stat_stream_groups = {PTHREAD_MUTEX_INITIALIZER};
+
+/* A client may join a group by sending "group <name>\n" as soon as it
+    connects, a client that sends nothing reads the whole stream */
+static zend_bool zend_stat_stream_handshake(int client, char *name) {
+    struct pollfd pfd = {client, POLLIN, 0};
+    char line[ZEND_STAT_STREAM_GROUP_NAME + sizeof("group ")];
+    size_t length = 0;
+
+    if (poll(&pfd, 1, ZEND_STAT_STREAM_HANDSHAKE) <= 0) {
+        return 0;
+    }
+
+    while (length < (sizeof(line) - 1)) {
+        ssize_t bytes = recv(client, &line[length], 1, 0);
+
+        if (bytes <= 0) {
+            if ((bytes == FAILURE) && (errno == EINTR)) {
+                continue;
+            }
+
+            return 0;
+        }
+
+        if (line[length] == '\n') {
+            break;
+        }
+
+        length++;
+    }
+
+    if ((length <= (sizeof("group ") - 1)) ||
+        (length == (sizeof(line) - 1)) ||
+        (SUCCESS != memcmp(line, "group ", sizeof("group ") - 1))) {
+        return 0;
+    }
+
+    if (line[length - 1] == '\r') {
+        length--;
+    }
+
+    length -= sizeof("group ") - 1;
+
+    memcpy(name, &line[sizeof("group ") - 1], length);
+
+    name[length] = 0;
+
+    return length > 0;
+}
+
+static zend_stat_stream_group_t* zend_stat_stream_group_join(zend_stat_buffer_t *buffer, char *name, int client, zend_stat_buffer_cursor_t **shared) {
+    zend_stat_stream_group_t *group = NULL;
+    zend_ulong it;
+
+    pthread_mutex_lock(&zend_stat_stream_groups.mutex);
+
+    for (it = 0; it < ZEND_STAT_IO_CLIENTS; it++) {
+        zend_stat_stream_group_t *candidate =
+            &zend_stat_stream_groups.group[it];
+
+        if (candidate->members == 0) {
+            if (NULL == group) {
+                group = candidate;
+            }
+            continue;
+        }
+
+        if (SUCCESS == strcmp(candidate->name, name)) {
+            group = candidate;
+            break;
+        }
+    }
+
+    if (UNEXPECTED(NULL == group)) {
+        goto _zend_stat_stream_group_join_leave;
+    }
+
+    if (group->members == 0) {
+        /* a new group starts at the oldest sample still in the buffer */
+        group->cursor = zend_stat_buffer_cursor_create(buffer);
+
+        if (UNEXPECTED(NULL == group->cursor)) {
+            group = NULL;
+
+            goto _zend_stat_stream_group_join_leave;
+        }
+
+        strcpy(group->name, name);
+    }
+
+    /* a member that joins a running group reads the shared shard from now,
+        the samples already in it were meant for the other members */
+    *shared = zend_stat_buffer_cursor_shared(buffer, group->members == 0);
+
+    if (UNEXPECTED(NULL == *shared)) {
+        if (group->members == 0) {
+            zend_stat_buffer_cursor_destroy(group->cursor);
+
+            group->cursor = NULL;
+        }
+
+        group = NULL;
+
+        goto _zend_stat_stream_group_join_leave;
+    }
+
+    group->member[group->members++] = client;
+
+_zend_stat_stream_group_join_leave:
+    pthread_mutex_unlock(&zend_stat_stream_groups.mutex);
+
+    return group;
+}
+
+static void zend_stat_stream_group_partition(zend_stat_stream_group_t *group, int client, zend_ulong *partition, zend_ulong *partitions) {
+    zend_ulong it;
+
+    pthread_mutex_lock(&zend_stat_stream_groups.mutex);
+
+    for (it = 0; it < group->members; it++) {
+        if (group->member[it] == client) {
+            *partition = it;
+            break;
+        }
+    }
+
+    *partitions = group->members;
+
+    pthread_mutex_unlock(&zend_stat_stream_groups.mutex);
+}
+
+static void zend_stat_stream_group_leave(zend_stat_stream_group_t *group, int client) {
+    zend_ulong it;
+
+    pthread_mutex_lock(&zend_stat_stream_groups.mutex);
+
+    for (it = 0; it < group->members; it++) {
+        if (group->member[it] == client) {
+            /* the remaining members take over the partition */
+            memmove(
+                &group->member[it],
+                &group->member[it + 1],
+                sizeof(int) * (group->members - it - 1));
+
+            group->members--;
+            break;
+        }
+    }
+
+    if (group->members == 0) {
+        zend_stat_buffer_cursor_destroy(group->cursor);
+
+        group->cursor = NULL;
+    }
+
+    pthread_mutex_unlock(&zend_stat_stream_groups.mutex);
+}
+
 static void zend_stat_stream(zend_stat_io_t *io, int client) {
-    while (zend_stat_buffer_dump(io->buffer, client)) {
-        if (zend_stat_buffer_empty(io->buffer)) {
+    /* The stacks and requests already defined for this client */
+    zend_stat_sample_defined_t *defined = zend_stat_sample_defined_create();
+    /* The position of this client in the buffer */
+    zend_stat_buffer_cursor_t *cursor;
+    /* The group this client is a member of, its partition, and its own
+        position in the shared shard */
+    zend_stat_stream_group_t *group = NULL;
+    zend_stat_buffer_cursor_t *shared = NULL;
+    zend_ulong partition = 0,
+               partitions = 1;
+    char name[ZEND_STAT_STREAM_GROUP_NAME];
+    /* The loss last reported to this client */
+    zend_stat_buffer_loss_t loss = {0, 0, 0};
+    double reported = zend_stat_time();
+
+    if (UNEXPECTED(NULL == defined)) {
+        return;
+    }
+
+    if (zend_stat_stream_handshake(client, name)) {
+        group = zend_stat_stream_group_join(io->buffer, name, client, &shared);
+
+        if (UNEXPECTED(NULL == group)) {
+            zend_stat_sample_defined_destroy(defined);
+            return;
+        }
+
+        cursor = group->cursor;
+    } else {
+        cursor = zend_stat_buffer_cursor_create(io->buffer);
+
+        if (UNEXPECTED(NULL == cursor)) {
+            zend_stat_sample_defined_destroy(defined);
+            return;
+        }
+    }
+
+    do {
+        if (group) {
+            /* members come and go, the partition follows them */
+            zend_stat_stream_group_partition(
+                group, client, &partition, &partitions);
+        }
+
+        if (!zend_stat_buffer_dump_partition(io->buffer, cursor, shared, partition, partitions, client, defined)) {
+            break;
+        }
+
+        if ((zend_stat_time() - reported) >= ZEND_STAT_STREAM_LOSS_PERIOD) {
+            if (!zend_stat_buffer_loss_write(io->buffer, cursor, client, &loss)) {
+                break;
+            }
+
+            reported = zend_stat_time();
+        }
+
+        if (zend_stat_buffer_empty_partition(io->buffer, cursor, shared, partition, partitions)) {
             if (zend_stat_io_closed(io)) {
-                return;
+                break;
             }
 
             zend_stat_stream_yield(io);
         }
+    } while (1);
+
+    if (group) {
+        zend_stat_stream_group_leave(group, client);
+        zend_stat_buffer_cursor_destroy(shared);
+    } else {
+        zend_stat_buffer_cursor_destroy(cursor);
     }
+
+    zend_stat_sample_defined_destroy(defined);
 }
 
 zend_bool zend_stat_stream_startup(zend_stat_io_t *io, zend_stat_buffer_t *buffer, char *stream) {
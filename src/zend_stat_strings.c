@@ -21,17 +21,66 @@
 
 #include "zend_stat.h"
 #include "zend_stat_arena.h"
+#include "zend_stat_region.h"
 #include "zend_stat_strings.h"
 
+#define ZEND_STAT_STACK_EMPTY 0
+#define ZEND_STAT_STACK_BUSY  1
+#define ZEND_STAT_STACK_READY 2
+
+/* A slot or string that stays busy for this many loads belongs to a writer
+    that is gone, or is too slow to wait for, and is treated as a miss */
+#ifndef ZEND_STAT_STRINGS_SPINS
+#   define ZEND_STAT_STRINGS_SPINS 65536
+#endif
+
+/* Opcache forces a restart that is still waiting on requests after
+    opcache.force_restart_timeout, 180 seconds by default, a restart that
+    nobody observed in that time is taken to have happened */
+#ifndef ZEND_STAT_STRINGS_RESTART
+#   define ZEND_STAT_STRINGS_RESTART 180
+#endif
+
+typedef struct _zend_stat_stacks_frame_t {
+    uint32_t                state;
+    zend_ulong              hash;
+    zend_stat_stack_frame_t frame;
+} zend_stat_stacks_frame_t;
+
+typedef struct _zend_stat_stacks_stack_t {
+    uint32_t                state;
+    zend_ulong              hash;
+    zend_stat_stack_t       stack;
+} zend_stat_stacks_stack_t;
+
+/* Symbol slots are versioned: a writer makes the sequence odd while it writes,
+    readers discard any copy that was taken while the sequence changed */
+typedef struct _zend_stat_symbols_slot_t {
+    uint32_t            sequence;
+    zend_ulong          generation;
+    zend_ulong          address;
+    zend_stat_symbol_t  symbol;
+} zend_stat_symbols_slot_t;
+
 typedef struct {
     zend_long size;
     zend_long used;
     zend_long slots;
+    zend_long mapped;
+    zend_ulong generation;
+    zend_ulong restarts;
+    zend_ulong observed;
+    uint64_t   scheduled;
     struct {
         void *memory;
         zend_long size;
         zend_long used;
     } buffer;
+    struct {
+        zend_stat_stacks_frame_t *frames;
+        zend_stat_stacks_stack_t *stacks;
+    } stacks;
+    zend_stat_symbols_slot_t *symbols;
     zend_stat_arena_t  *arena;
     zend_stat_string_t *strings;
 } zend_stat_strings_t;
@@ -41,6 +90,13 @@ static zend_stat_string_t*  zend_stat_strings_opcodes[256];
 
 #define ZTSG(v) zend_stat_strings->v
 #define ZTSB(v) ZTSG(buffer).v
+#define ZTSS(v) ZTSG(stacks).v
+
+#define ZEND_STAT_STACKS_SIZE \
+    ((sizeof(zend_stat_stacks_frame_t) * ZEND_STAT_STACKS_FRAMES) + \
+     (sizeof(zend_stat_stacks_stack_t) * ZEND_STAT_STACKS_SLOTS))
+#define ZEND_STAT_SYMBOLS_SIZE \
+    (sizeof(zend_stat_symbols_slot_t) * ZEND_STAT_SYMBOLS_SLOTS)
 
 static zend_always_inline zend_stat_string_t* zend_stat_string_init(const char *value, size_t length) {
     zend_stat_string_t *string;
@@ -73,8 +129,7 @@ _zend_stat_string_init_load:
     offset = ZTSB(used);
 
     if (UNEXPECTED((offset + length) >= ZTSB(size))) {
-        /* panic OOM */
-
+        /* the buffer is full, the caller does without the string */
         return NULL;
     }
 
@@ -100,7 +155,8 @@ static zend_always_inline zend_stat_string_t* zend_stat_string_persistent(zend_s
             &ZTSG(used), 1, __ATOMIC_ACQ_REL) >= ZTSG(slots))) {
         __atomic_sub_fetch(&ZTSG(used), 1, __ATOMIC_ACQ_REL);
 
-        /* panic OOM */
+        /* the table is full, the sample goes without the string */
+        free(string);
 
         return NULL;
     }
@@ -128,7 +184,19 @@ _zend_stat_string_copy_check:
         return copy;
     }
 
-    while (__atomic_exchange_n(&copy->locked, 1, __ATOMIC_RELAXED));
+    {
+        uint32_t spins = 0;
+
+        while (__atomic_exchange_n(&copy->locked, 1, __ATOMIC_RELAXED)) {
+            if (UNEXPECTED(++spins == ZEND_STAT_STRINGS_SPINS)) {
+                __atomic_sub_fetch(&ZTSG(used), 1, __ATOMIC_ACQ_REL);
+
+                free(string);
+
+                return NULL;
+            }
+        }
+    }
 
     __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
@@ -138,8 +206,10 @@ _zend_stat_string_copy_check:
         __atomic_sub_fetch(&ZTSB(used), ZSTR_LEN(string), __ATOMIC_ACQ_REL);
         __atomic_thread_fence(__ATOMIC_RELEASE);
         __atomic_exchange_n(&copy->locked, 0, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&ZTSG(used), 1, __ATOMIC_ACQ_REL);
 
-        /* panic OOM */
+        /* the buffer is full, the sample goes without the string */
+        free(string);
 
         return NULL;
     }
@@ -171,11 +241,15 @@ _zend_stat_string_copy_check:
     return copy;
 }
 
-zend_bool zend_stat_strings_startup(zend_long strings) {
+zend_bool zend_stat_strings_startup(zend_long strings, zend_bool stacks) {
     size_t zend_stat_strings_size = floor((strings / 5) * 1),
            zend_stat_strings_buffer_size = floor((strings / 5) * 4);
 
-    zend_stat_strings = zend_stat_map(strings + sizeof(zend_stat_strings_t));
+    /* the stack tables are only mapped when stacks are collected */
+    zend_long mapped = sizeof(zend_stat_strings_t) + strings +
+                        (stacks ? ZEND_STAT_STACKS_SIZE : 0) + ZEND_STAT_SYMBOLS_SIZE;
+
+    zend_stat_strings = zend_stat_region_map(ZEND_STAT_REGION_STRINGS, mapped);
 
     if (!zend_stat_strings) {
         zend_error(E_WARNING,
@@ -185,20 +259,35 @@ zend_bool zend_stat_strings_startup(zend_long strings) {
 
     memset(zend_stat_strings, 0, sizeof(zend_stat_strings_t));
 
+    ZTSG(mapped)  = mapped;
+
     ZTSG(strings) = (void*)
                         (((char*) zend_stat_strings) + sizeof(zend_stat_strings_t));
     ZTSG(size)    = zend_stat_strings_size;
     ZTSG(slots)   = ZTSG(size) / sizeof(zend_stat_string_t);
     ZTSG(used)    = 0;
 
-    memset(ZTSG(strings), 0, zend_stat_strings_size);
+    zend_stat_commit(ZTSG(strings), zend_stat_strings_size);
 
     ZTSB(memory)  = (void*)
                         (((char*) ZTSG(strings)) + zend_stat_strings_size);
     ZTSB(size)    = zend_stat_strings_buffer_size;
     ZTSB(used)    = 0;
 
-    memset(ZTSB(memory), 0, zend_stat_strings_buffer_size);
+    zend_stat_commit(ZTSB(memory), zend_stat_strings_buffer_size);
+
+    /* The stack tables and symbols follow the strings, anonymous memory is
+        already zero, which is the empty state of every slot */
+    ZTSG(symbols) = (void*)
+                        (((char*) zend_stat_strings) + sizeof(zend_stat_strings_t) + strings);
+
+    if (stacks) {
+        ZTSS(frames)  = (void*)
+                            (((char*) ZTSG(symbols)) + ZEND_STAT_SYMBOLS_SIZE);
+        ZTSS(stacks)  = (void*)
+                            (((char*) ZTSS(frames)) +
+                                (sizeof(zend_stat_stacks_frame_t) * ZEND_STAT_STACKS_FRAMES));
+    }
 
     {
         int it = 0,
@@ -224,6 +313,14 @@ zend_bool zend_stat_strings_startup(zend_long strings) {
 
     ZTSG(arena) = zend_stat_arena_create(strings);
 
+    if (UNEXPECTED(NULL == ZTSG(arena))) {
+        zend_error(E_WARNING,
+            "[STAT] Failed to allocate shared memory for temporary strings");
+        zend_stat_region_unmap(ZEND_STAT_REGION_STRINGS, zend_stat_strings, mapped);
+        zend_stat_strings = NULL;
+        return 0;
+    }
+
     return 1;
 }
 
@@ -283,10 +380,307 @@ zend_stat_string_t *zend_stat_string(zend_string *string) {
     return zend_stat_string_persistent(string);
 }
 
+/* {{{ Frames and stacks are interned by hash in fixed tables of slots, a slot
+    is claimed by the first writer and is immutable once ready, the identifier
+    of a frame or stack is the index of its slot plus one, zero is never used */
+static zend_always_inline zend_bool zend_stat_stack_frame_equals(const zend_stat_stack_frame_t *a, const zend_stat_stack_frame_t *b) {
+    return a->file     == b->file &&
+           a->scope    == b->scope &&
+           a->function == b->function &&
+           a->line     == b->line;
+}
+
+static zend_always_inline zend_bool zend_stat_stack_equals(const zend_stat_stack_t *a, const uint32_t *frames, uint32_t depth) {
+    return a->depth == depth &&
+           SUCCESS == memcmp(a->frames, frames, sizeof(uint32_t) * depth);
+}
+
+/* Returns EMPTY when the caller claimed the slot, READY when the slot may be
+    compared, or BUSY when the writer did not finish in time */
+static zend_always_inline uint32_t zend_stat_stack_state(uint32_t *state) {
+    uint32_t current = __atomic_load_n(state, __ATOMIC_ACQUIRE),
+             spins = 0;
+
+    if (EXPECTED(current == ZEND_STAT_STACK_EMPTY)) {
+        if (__atomic_compare_exchange_n(state,
+                &current, ZEND_STAT_STACK_BUSY,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return ZEND_STAT_STACK_EMPTY;
+        }
+    }
+
+    while (UNEXPECTED(current == ZEND_STAT_STACK_BUSY) &&
+           EXPECTED(++spins < ZEND_STAT_STRINGS_SPINS)) {
+        current = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+    }
+
+    return current;
+}
+
+zend_bool zend_stat_stacks_enabled(void) {
+    return NULL != ZTSS(frames);
+}
+
+static zend_always_inline uint32_t zend_stat_stack_frame(const zend_stat_stack_frame_t *frame) {
+    zend_ulong hash =
+        zend_inline_hash_func(
+            (const char*) frame,
+            XtOffsetOf(zend_stat_stack_frame_t, line) + sizeof(uint32_t));
+    zend_ulong slot = hash % ZEND_STAT_STACKS_FRAMES;
+    uint32_t probes = 0;
+
+    do {
+        zend_stat_stacks_frame_t *interned = &ZTSS(frames)[slot];
+        uint32_t state = zend_stat_stack_state(&interned->state);
+
+        if (state == ZEND_STAT_STACK_EMPTY) {
+            interned->hash  = hash;
+            interned->frame = *frame;
+
+            __atomic_store_n(&interned->state, ZEND_STAT_STACK_READY, __ATOMIC_RELEASE);
+
+            return slot + 1;
+        }
+
+        if (EXPECTED(state == ZEND_STAT_STACK_READY) &&
+            EXPECTED((interned->hash == hash) &&
+                zend_stat_stack_frame_equals(&interned->frame, frame))) {
+            return slot + 1;
+        }
+
+        slot = (slot + 1) % ZEND_STAT_STACKS_FRAMES;
+    } while (++probes < ZEND_STAT_STACKS_PROBES);
+
+    /* the neighbourhood is full, the sample goes without a stack */
+    return 0;
+}
+
+uint32_t zend_stat_stack(const zend_stat_stack_frame_t *frames, uint32_t depth) {
+    uint32_t ids[ZEND_STAT_DEPTH_MAX];
+    uint32_t it = 0,
+             probes = 0;
+    zend_ulong hash, slot;
+
+    if (UNEXPECTED((0 == depth) || (NULL == ZTSS(stacks)))) {
+        return 0;
+    }
+
+    while (it < depth) {
+        if (UNEXPECTED(0 == (ids[it] = zend_stat_stack_frame(&frames[it])))) {
+            return 0;
+        }
+        it++;
+    }
+
+    hash = zend_inline_hash_func((const char*) ids, sizeof(uint32_t) * depth);
+    slot = hash % ZEND_STAT_STACKS_SLOTS;
+
+    do {
+        zend_stat_stacks_stack_t *interned = &ZTSS(stacks)[slot];
+        uint32_t state = zend_stat_stack_state(&interned->state);
+
+        if (state == ZEND_STAT_STACK_EMPTY) {
+            interned->hash        = hash;
+            interned->stack.depth = depth;
+
+            memcpy(interned->stack.frames, ids, sizeof(uint32_t) * depth);
+
+            __atomic_store_n(&interned->state, ZEND_STAT_STACK_READY, __ATOMIC_RELEASE);
+
+            return slot + 1;
+        }
+
+        if (EXPECTED(state == ZEND_STAT_STACK_READY) &&
+            EXPECTED((interned->hash == hash) &&
+                zend_stat_stack_equals(&interned->stack, ids, depth))) {
+            return slot + 1;
+        }
+
+        slot = (slot + 1) % ZEND_STAT_STACKS_SLOTS;
+    } while (++probes < ZEND_STAT_STACKS_PROBES);
+
+    /* the neighbourhood is full, the sample goes without a stack */
+    return 0;
+}
+
+const zend_stat_stack_t* zend_stat_stack_find(uint32_t id) {
+    zend_stat_stacks_stack_t *interned;
+
+    if (UNEXPECTED((0 == id) || (id > ZEND_STAT_STACKS_SLOTS) || (NULL == ZTSS(stacks)))) {
+        return NULL;
+    }
+
+    interned = &ZTSS(stacks)[id - 1];
+
+    if (UNEXPECTED(__atomic_load_n(&interned->state, __ATOMIC_ACQUIRE) != ZEND_STAT_STACK_READY)) {
+        return NULL;
+    }
+
+    return &interned->stack;
+}
+
+const zend_stat_stack_frame_t* zend_stat_stack_frame_find(uint32_t id) {
+    zend_stat_stacks_frame_t *interned;
+
+    if (UNEXPECTED((0 == id) || (id > ZEND_STAT_STACKS_FRAMES) || (NULL == ZTSS(frames)))) {
+        return NULL;
+    }
+
+    interned = &ZTSS(frames)[id - 1];
+
+    if (UNEXPECTED(__atomic_load_n(&interned->state, __ATOMIC_ACQUIRE) != ZEND_STAT_STACK_READY)) {
+        return NULL;
+    }
+
+    return &interned->frame;
+} /* }}} */
+
+/* {{{ Symbols are shared by every process: internal functions and functions
+    that are immutable in opcache have the same address in every process, the
+    first process to resolve such a function publishes the symbol */
+static zend_always_inline zend_ulong zend_stat_symbol_slot(zend_ulong address) {
+    return zend_inline_hash_func((const char*) &address, sizeof(zend_ulong)) % ZEND_STAT_SYMBOLS_SLOTS;
+}
+
+zend_bool zend_stat_symbol_find(const void *address, zend_stat_symbol_t *symbol) {
+    zend_ulong key = (zend_ulong) address,
+               generation = zend_stat_strings_generation(),
+               slot = zend_stat_symbol_slot(key);
+    uint32_t probes = 0;
+
+    do {
+        zend_stat_symbols_slot_t *shared = &ZTSG(symbols)[slot];
+        uint32_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+
+        if (0 == sequence) {
+            /* never written */
+            return 0;
+        }
+
+        if (EXPECTED(!(sequence & 1)) && (shared->address == key)) {
+            zend_stat_symbols_slot_t copy = *shared;
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (EXPECTED(__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == sequence) &&
+                EXPECTED(copy.address == key)) {
+                if (UNEXPECTED(copy.generation != generation)) {
+                    return 0;
+                }
+
+                *symbol = copy.symbol;
+
+                return 1;
+            }
+        }
+
+        slot = (slot + 1) % ZEND_STAT_SYMBOLS_SLOTS;
+    } while (++probes < ZEND_STAT_STACKS_PROBES);
+
+    return 0;
+}
+
+void zend_stat_symbol_publish(const void *address, const zend_stat_symbol_t *symbol) {
+    zend_ulong key = (zend_ulong) address,
+               generation = zend_stat_strings_generation(),
+               slot = zend_stat_symbol_slot(key);
+    uint32_t probes = 0;
+
+    do {
+        zend_stat_symbols_slot_t *shared = &ZTSG(symbols)[slot];
+        uint32_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+
+        if (UNEXPECTED(sequence & 1)) {
+            /* being written */
+            goto _zend_stat_symbol_publish_next;
+        }
+
+        if ((0 != sequence) &&
+            (shared->generation == generation) &&
+            (shared->address != key)) {
+            /* in use by another symbol */
+            goto _zend_stat_symbol_publish_next;
+        }
+
+        if ((0 != sequence) &&
+            (shared->generation == generation) &&
+            (shared->address == key)) {
+            /* already published */
+            return;
+        }
+
+        /* empty, or left by a previous generation */
+        if (!__atomic_compare_exchange_n(
+                &shared->sequence,
+                &sequence, sequence + 1,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            goto _zend_stat_symbol_publish_next;
+        }
+
+        shared->generation = generation;
+        shared->address    = key;
+        shared->symbol     = *symbol;
+
+        __atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+        return;
+
+_zend_stat_symbol_publish_next:
+        slot = (slot + 1) % ZEND_STAT_SYMBOLS_SLOTS;
+    } while (++probes < ZEND_STAT_STACKS_PROBES);
+
+    /* the neighbourhood is full, the symbol is resolved by each process */
+} /* }}} */
+
+zend_ulong zend_stat_strings_generation(void) {
+    return __atomic_load_n(&ZTSG(generation), __ATOMIC_ACQUIRE);
+}
+
+/* {{{ Opcache restarts are counted when they are scheduled, a restart is
+    pending until some process observes that opcache has reset, or until it
+    must have been forced */
+void zend_stat_strings_restart(void) {
+    __atomic_store_n(&ZTSG(scheduled), (uint64_t) zend_stat_time(), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ZTSG(restarts), 1, __ATOMIC_ACQ_REL);
+}
+
+zend_ulong zend_stat_strings_restarting(void) {
+    zend_ulong restarts = __atomic_load_n(&ZTSG(restarts), __ATOMIC_ACQUIRE);
+
+    if (EXPECTED(restarts == __atomic_load_n(&ZTSG(observed), __ATOMIC_ACQUIRE))) {
+        return 0;
+    }
+
+    if (UNEXPECTED(((uint64_t) zend_stat_time() -
+            __atomic_load_n(&ZTSG(scheduled), __ATOMIC_ACQUIRE)) > ZEND_STAT_STRINGS_RESTART)) {
+        zend_stat_strings_restarted(restarts);
+
+        return 0;
+    }
+
+    return restarts;
+}
+
+void zend_stat_strings_restarted(zend_ulong restarts) {
+    zend_ulong observed = __atomic_load_n(&ZTSG(observed), __ATOMIC_ACQUIRE);
+
+    /* the generation advances before the restart stops being pending, a
+        process that sees no restart pending also sees the new generation */
+    __atomic_add_fetch(&ZTSG(generation), 1, __ATOMIC_ACQ_REL);
+
+    while (observed < restarts) {
+        if (__atomic_compare_exchange_n(
+                &ZTSG(observed), &observed, restarts,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+} /* }}} */
+
 void zend_stat_strings_shutdown(void) {
     zend_stat_arena_destroy(ZTSG(arena));
 
-    zend_stat_unmap(zend_stat_strings, ZTSG(size));
+    zend_stat_region_unmap(ZEND_STAT_REGION_STRINGS, zend_stat_strings, ZTSG(mapped));
 }
 
 #endif	/* ZEND_STAT_STRINGS */
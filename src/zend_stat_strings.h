@@ -33,7 +33,43 @@ typedef struct _zend_stat_string_t {
 #define ZEND_STAT_STRING_PERSISTENT 0
 #define ZEND_STAT_STRING_TEMPORARY  1
 
-zend_bool zend_stat_strings_startup(zend_long strings);
+#ifndef ZEND_STAT_STACKS_FRAMES
+#   define ZEND_STAT_STACKS_FRAMES 65536
+#endif
+
+#ifndef ZEND_STAT_STACKS_SLOTS
+#   define ZEND_STAT_STACKS_SLOTS  65536
+#endif
+
+#ifndef ZEND_STAT_STACKS_PROBES
+#   define ZEND_STAT_STACKS_PROBES 64
+#endif
+
+#ifndef ZEND_STAT_SYMBOLS_SLOTS
+#   define ZEND_STAT_SYMBOLS_SLOTS 65536
+#endif
+
+typedef struct _zend_stat_symbol_t {
+    zend_uchar          type;
+    const void         *opcodes;
+    zend_stat_string_t *file;
+    zend_stat_string_t *scope;
+    zend_stat_string_t *function;
+} zend_stat_symbol_t;
+
+typedef struct _zend_stat_stack_frame_t {
+    zend_stat_string_t *file;
+    zend_stat_string_t *scope;
+    zend_stat_string_t *function;
+    uint32_t            line;
+} zend_stat_stack_frame_t;
+
+typedef struct _zend_stat_stack_t {
+    uint32_t            depth;
+    uint32_t            frames[ZEND_STAT_DEPTH_MAX];
+} zend_stat_stack_t;
+
+zend_bool zend_stat_strings_startup(zend_long strings, zend_bool stacks);
 zend_stat_string_t* zend_stat_string(zend_string *string);
 zend_stat_string_t *zend_stat_string_opcode(zend_uchar opcode);
 
@@ -41,5 +77,18 @@ zend_stat_string_t* zend_stat_string_temporary(const char *value, size_t length)
 zend_stat_string_t* zend_stat_string_copy(zend_stat_string_t *string);
 void zend_stat_string_release(zend_stat_string_t *string);
 
+zend_bool zend_stat_stacks_enabled(void);
+uint32_t zend_stat_stack(const zend_stat_stack_frame_t *frames, uint32_t depth);
+const zend_stat_stack_t* zend_stat_stack_find(uint32_t id);
+const zend_stat_stack_frame_t* zend_stat_stack_frame_find(uint32_t id);
+
+zend_bool zend_stat_symbol_find(const void *address, zend_stat_symbol_t *symbol);
+void      zend_stat_symbol_publish(const void *address, const zend_stat_symbol_t *symbol);
+
+zend_ulong zend_stat_strings_generation(void);
+void       zend_stat_strings_restart(void);
+zend_ulong zend_stat_strings_restarting(void);
+void       zend_stat_strings_restarted(zend_ulong restarts);
+
 void zend_stat_strings_shutdown(void);
 #endif	/* ZEND_STAT_STRINGS_H */
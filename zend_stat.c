@@ -32,12 +32,16 @@
 #endif
 
 #include "zend_stat.h"
+#include "zend_stat_agent.h"
 #include "zend_stat_arena.h"
 #include "zend_stat_buffer.h"
 #include "zend_stat_control.h"
 #include "zend_stat_ini.h"
 #include "zend_stat_io.h"
+#include "zend_stat_profile.h"
+#include "zend_stat_region.h"
 #include "zend_stat_request.h"
+#include "zend_stat_routes.h"
 #include "zend_stat_sampler.h"
 #include "zend_stat_stream.h"
 #include "zend_stat_strings.h"
@@ -46,7 +50,11 @@ static pid_t                   zend_stat_main = 0;
 static zend_stat_buffer_t*     zend_stat_buffer = NULL;
 static zend_stat_io_t          zend_stat_stream;
 static zend_stat_io_t          zend_stat_control;
+static zend_stat_io_t          zend_stat_snapshot;
 static double                  zend_stat_started = 0;
+static zend_stat_buffer_cursor_t* zend_stat_buffer_cursor = NULL;
+
+int zend_stat_memory = ZEND_STAT_MEMORY_EAGER;
 
 static int  zend_stat_startup(zend_extension*);
 static void zend_stat_shutdown(zend_extension *);
@@ -121,8 +129,18 @@ ZEND_FUNCTION(zend_stat_buffer_consume)
     ZEND_PARSE_PARAMETERS_START(0, 0)
     ZEND_PARSE_PARAMETERS_END();
 
+    if (UNEXPECTED(NULL == zend_stat_buffer_cursor)) {
+        zend_stat_buffer_cursor =
+            zend_stat_buffer_cursor_create(zend_stat_buffer);
+
+        if (UNEXPECTED(NULL == zend_stat_buffer_cursor)) {
+            RETURN_FALSE;
+        }
+    }
+
     zend_stat_buffer_consume(
         zend_stat_buffer,
+        zend_stat_buffer_cursor,
         (zend_stat_buffer_consumer_t) zend_stat_buffer_consume_u, 
         return_value, 1);
 }
@@ -149,14 +167,55 @@ static int zend_stat_startup(zend_extension *ze) {
         return SUCCESS;
     }
 
-    if (!zend_stat_strings_startup(zend_stat_ini_strings)) {
+    zend_stat_memory = zend_stat_ini_hugepages;
+
+    if (zend_stat_ini_lazy) {
+        zend_stat_memory |= ZEND_STAT_MEMORY_LAZY;
+    }
+
+    if (!zend_stat_regions_startup(zend_stat_ini_map)) {
+        zend_stat_ini_shutdown();
+
+        return SUCCESS;
+    }
+
+    if (!zend_stat_strings_startup(zend_stat_ini_strings, zend_stat_ini_depth > 0)) {
+        zend_stat_regions_shutdown();
+        zend_stat_ini_shutdown();
+
+        return SUCCESS;
+    }
+
+    if (!zend_stat_requests_startup(
+            zend_stat_ini_samplers > 0 ?
+                zend_stat_ini_samplers * ZEND_STAT_REQUESTS_RETAIN :
+                ZEND_STAT_REQUESTS_SLOTS)) {
+        zend_stat_strings_shutdown();
+        zend_stat_regions_shutdown();
         zend_stat_ini_shutdown();
 
         return SUCCESS;
     }
 
-    if (!(zend_stat_buffer = zend_stat_buffer_startup(zend_stat_ini_samples))) {
+    /* Unless configured, there is a shard for every producer: the agent
+        stripes the processes it samples over a few, otherwise every sampler
+        may have one of its own */
+    if (zend_stat_ini_shards <= 0) {
+        if (zend_stat_ini_agent) {
+            zend_stat_ini_shards = ZEND_STAT_AGENT_SHARDS;
+        } else if (zend_stat_ini_samplers > 0) {
+            zend_stat_ini_shards = zend_stat_ini_samplers;
+        } else {
+            zend_stat_ini_shards = ZEND_STAT_BUFFER_SHARDS;
+        }
+    }
+
+    if (!(zend_stat_buffer = zend_stat_buffer_startup(
+            zend_stat_ini_samples,
+            zend_stat_ini_shards))) {
+        zend_stat_requests_shutdown();
         zend_stat_strings_shutdown();
+        zend_stat_regions_shutdown();
         zend_stat_ini_shutdown();
 
         return SUCCESS;
@@ -167,7 +226,9 @@ static int zend_stat_startup(zend_extension *ze) {
             zend_stat_buffer,
             zend_stat_ini_control)) {
         zend_stat_buffer_shutdown(zend_stat_buffer);
+        zend_stat_requests_shutdown();
         zend_stat_strings_shutdown();
+        zend_stat_regions_shutdown();
         zend_stat_ini_shutdown();
 
         return SUCCESS;
@@ -179,17 +240,58 @@ static int zend_stat_startup(zend_extension *ze) {
             zend_stat_ini_stream)) {
         zend_stat_control_shutdown(&zend_stat_control);
         zend_stat_buffer_shutdown(zend_stat_buffer);
+        zend_stat_requests_shutdown();
+        zend_stat_strings_shutdown();
+        zend_stat_regions_shutdown();
+        zend_stat_ini_shutdown();
+
+        return SUCCESS;
+    }
+
+    if (zend_stat_ini_snapshot) {
+        /* latencies are only recorded when there is somewhere to read them */
+        zend_stat_routes_startup(ZEND_STAT_ROUTES_SLOTS);
+    }
+
+    if (!zend_stat_profile_startup(
+            &zend_stat_snapshot,
+            zend_stat_buffer,
+            zend_stat_ini_snapshot,
+            zend_stat_ini_baselines)) {
+        zend_stat_routes_shutdown();
+        zend_stat_stream_shutdown(&zend_stat_stream);
+        zend_stat_control_shutdown(&zend_stat_control);
+        zend_stat_buffer_shutdown(zend_stat_buffer);
+        zend_stat_requests_shutdown();
         zend_stat_strings_shutdown();
+        zend_stat_regions_shutdown();
         zend_stat_ini_shutdown();
 
         return SUCCESS;
     }
 
+    if (zend_stat_ini_agent) {
+        if (!zend_stat_agent_startup(
+                zend_stat_ini_samplers > 0 ?
+                    zend_stat_ini_samplers :
+                    ZEND_STAT_AGENT_SLOTS,
+                zend_stat_buffer)) {
+            zend_stat_ini_agent = 0;
+        }
+    }
+
     zend_stat_sampler_startup(
         zend_stat_ini_auto,
         zend_stat_ini_interval,
         zend_stat_ini_arginfo,
+        zend_stat_ini_depth,
+        zend_stat_ini_jitter,
+        zend_stat_ini_adaptive,
+        zend_stat_ini_cpu,
+        zend_stat_ini_proc,
         zend_stat_ini_samplers,
+        zend_stat_ini_persistent,
+        zend_stat_ini_agent,
         zend_stat_buffer);
 
     zend_stat_started = zend_stat_time();
@@ -207,19 +309,31 @@ static void zend_stat_shutdown(zend_extension *ze) {
         return;
     }
 
+    zend_stat_sampler_shutdown();
+
+    if (zend_stat_buffer_cursor) {
+        zend_stat_buffer_cursor_destroy(zend_stat_buffer_cursor);
+        zend_stat_buffer_cursor = NULL;
+    }
+
     if (zend_stat_pid() != zend_stat_main) {
         return;
     }
 
     if (zend_stat_ini_dump > 0) {
         zend_stat_buffer_dump(
-            zend_stat_buffer, zend_stat_ini_dump);
+            zend_stat_buffer, NULL, zend_stat_ini_dump, NULL);
     }
 
+    zend_stat_agent_shutdown();
     zend_stat_control_shutdown(&zend_stat_control);
     zend_stat_stream_shutdown(&zend_stat_stream);
+    zend_stat_profile_shutdown(&zend_stat_snapshot);
+    zend_stat_routes_shutdown();
     zend_stat_buffer_shutdown(zend_stat_buffer);
+    zend_stat_requests_shutdown();
     zend_stat_strings_shutdown();
+    zend_stat_regions_shutdown();
     zend_stat_ini_shutdown();
 
     zend_stat_started = 0;
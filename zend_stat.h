@@ -38,6 +38,16 @@
 
 double zend_stat_time(void);
 
+#define ZEND_STAT_MEMORY_EAGER       0
+#define ZEND_STAT_MEMORY_LAZY        (1<<0)
+#define ZEND_STAT_MEMORY_TRANSPARENT (1<<1)
+#define ZEND_STAT_MEMORY_EXPLICIT    (1<<2)
+
+#define ZEND_STAT_MEMORY_HUGEPAGE    (2 * 1024 * 1024)
+
+/* How shared memory is mapped, set once on startup before anything is mapped */
+extern int zend_stat_memory;
+
 static zend_always_inline pid_t zend_stat_pid(void) {
 #ifdef ZTS
     return syscall(SYS_gettid);
@@ -46,14 +56,65 @@ static zend_always_inline pid_t zend_stat_pid(void) {
 #endif
 }
 
+static zend_always_inline zend_long zend_stat_map_size(zend_long size) {
+    /* A region that may be backed by explicit hugepages is a whole number of
+        them, whether or not it was, so that it is unmapped the same way */
+    if (zend_stat_memory & ZEND_STAT_MEMORY_EXPLICIT) {
+        return (size + (ZEND_STAT_MEMORY_HUGEPAGE - 1)) & ~((zend_long) ZEND_STAT_MEMORY_HUGEPAGE - 1);
+    }
+
+    return size;
+}
+
 static zend_always_inline void* zend_stat_map(zend_long size) {
-    void *mapped = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    int flags = MAP_SHARED|MAP_ANONYMOUS;
+    void *mapped;
+
+    size = zend_stat_map_size(size);
+
+#ifdef MAP_NORESERVE
+    if (zend_stat_memory & ZEND_STAT_MEMORY_LAZY) {
+        /* pages are committed when first touched */
+        flags |= MAP_NORESERVE;
+    }
+#endif
+
+#ifdef MAP_HUGETLB
+    if (zend_stat_memory & ZEND_STAT_MEMORY_EXPLICIT) {
+        mapped = mmap(NULL, size, PROT_READ|PROT_WRITE, flags|MAP_HUGETLB, -1, 0);
+
+        if (EXPECTED(mapped != MAP_FAILED)) {
+            return mapped;
+        }
+
+        /* there are not enough hugepages reserved, transparent hugepages
+            are the next best thing */
+    }
+#endif
+
+    mapped = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+
+    if (UNEXPECTED(mapped == MAP_FAILED)) {
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (zend_stat_memory & (ZEND_STAT_MEMORY_TRANSPARENT|ZEND_STAT_MEMORY_EXPLICIT)) {
+        madvise(mapped, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    return mapped;
+}
 
-    if (EXPECTED(mapped != MAP_FAILED)) {
-        return mapped;
+/* Anonymous memory is already zero, committing a region faults it in now
+    rather than on the first insert, unless mapping is lazy */
+static zend_always_inline void zend_stat_commit(void *address, zend_long size) {
+    if (zend_stat_memory & ZEND_STAT_MEMORY_LAZY) {
+        return;
     }
 
-    return NULL;
+    memset(address, 0, size);
 }
 
 static zend_always_inline void zend_stat_unmap(void *address, zend_long size) {
@@ -61,7 +122,7 @@ static zend_always_inline void zend_stat_unmap(void *address, zend_long size) {
         return;
     }
 
-    munmap(address, size);
+    munmap(address, zend_stat_map_size(size));
 }
 
 static zend_always_inline zend_bool zend_stat_mutex_init(pthread_mutex_t *mutex, zend_bool shared) {
@@ -95,6 +156,13 @@ static zend_always_inline zend_bool zend_stat_condition_init(pthread_cond_t *con
 
     pthread_condattr_init(&attributes);
 
+    /* timed waits are measured on the monotonic clock */
+    if (pthread_condattr_setclock(
+            &attributes, CLOCK_MONOTONIC) != SUCCESS) {
+        pthread_condattr_destroy(&attributes);
+        return 0;
+    }
+
     if (shared) {
         if (pthread_condattr_setpshared(
                 &attributes, PTHREAD_PROCESS_SHARED) != SUCCESS) {
@@ -121,5 +189,15 @@ ZEND_TSRMLS_CACHE_EXTERN()
 # endif
 
 #define ZEND_STAT_INTERVAL_MIN 10
+#define ZEND_STAT_DEPTH_MAX    16
+#define ZEND_STAT_JITTER_MAX   100
+
+#define ZEND_STAT_CACHELINE    64
+#define ZEND_STAT_CACHELINE_ALIGNED \
+    __attribute__((aligned(ZEND_STAT_CACHELINE)))
+
+#define ZEND_STAT_CPU_OFF      0
+#define ZEND_STAT_CPU_TAG      1
+#define ZEND_STAT_CPU_CLOCK    2
 
 #endif	/* ZEND_STAT_H */